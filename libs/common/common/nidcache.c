@@ -0,0 +1,556 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// PSP Software Development Kit - https://github.com/pspdev
+#include <common/types.h>
+#include <common/sha1.h>
+#include <common/nidcache.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+/* File layout (native endian, a file written on another host is just ignored)
+ *   header  : magic "NIDC", version, count, slot count (power of 2), pool size
+ *   slots   : slot count * { FNV-1a hash, name offset + 1 (0 = free), nid }
+ *   pool    : NUL terminated names
+ */
+#define NIDCACHE_MAGIC      "NIDC"
+#define NIDCACHE_VERSION    1
+#define NIDCACHE_HDR_SIZE   20
+#define NIDCACHE_MIN_SLOTS  64
+
+struct nidfile
+{
+	u8 *base;
+	size_t size;
+	int mapped;
+	const u32 *slots;
+	u32 nslots;
+	u32 count;
+	const char *pool;
+	u32 poolsize;
+};
+
+struct nidentry
+{
+	char *name;
+	u32 len;
+	u32 hash;
+	u32 nid;
+};
+
+struct nidcache
+{
+	char *path;
+	struct nidfile file;
+	struct nidentry *add;
+	u32 addcount;
+	u32 addmax;
+};
+
+static u32 fnv1a(const char *name, unsigned long len)
+{
+	u32 h = 0x811C9DC5;
+	unsigned long i;
+
+	for(i = 0; i < len; i++)
+	{
+		h ^= (u8) name[i];
+		h *= 0x01000193;
+	}
+
+	return h;
+}
+
+static void nidfile_free(struct nidfile *f)
+{
+	if(f->base != NULL)
+	{
+#ifndef _WIN32
+		if(f->mapped)
+		{
+			munmap(f->base, f->size);
+		}
+		else
+#endif
+		{
+			free(f->base);
+		}
+	}
+
+	memset(f, 0, sizeof(*f));
+}
+
+static int nidfile_validate(struct nidfile *f)
+{
+	u32 hdr[5];
+	u64 expect;
+	u32 i, used;
+
+	if(f->size < NIDCACHE_HDR_SIZE)
+	{
+		return 0;
+	}
+
+	memcpy(hdr, f->base, sizeof(hdr));
+	if(memcmp(f->base, NIDCACHE_MAGIC, 4) != 0 || hdr[1] != NIDCACHE_VERSION)
+	{
+		return 0;
+	}
+
+	f->count = hdr[2];
+	f->nslots = hdr[3];
+	f->poolsize = hdr[4];
+	if(f->nslots == 0 || (f->nslots & (f->nslots - 1)) != 0 || f->count > f->nslots)
+	{
+		return 0;
+	}
+
+	expect = NIDCACHE_HDR_SIZE + (u64) f->nslots * 12 + f->poolsize;
+	if(expect != f->size)
+	{
+		return 0;
+	}
+
+	f->slots = (const u32 *) (f->base + NIDCACHE_HDR_SIZE);
+	f->pool = (const char *) (f->base + NIDCACHE_HDR_SIZE + (size_t) f->nslots * 12);
+	if(f->poolsize > 0 && f->pool[f->poolsize - 1] != 0)
+	{
+		return 0;
+	}
+
+	/* Every used slot names a string of the pool with its own hash, and the count matches */
+	for(i = 0, used = 0; i < f->nslots; i++)
+	{
+		const u32 *slot = &f->slots[i * 3];
+		const char *name;
+
+		if(slot[1] == 0)
+		{
+			continue;
+		}
+
+		if(slot[1] > f->poolsize)
+		{
+			return 0;
+		}
+
+		name = &f->pool[slot[1] - 1];
+		if(slot[0] != fnv1a(name, strlen(name)))
+		{
+			return 0;
+		}
+		used++;
+	}
+
+	return used == f->count;
+}
+
+/* Map the cache file, returns 0 (with an empty f) if it is missing or invalid. */
+static int nidfile_load(const char *path, struct nidfile *f)
+{
+	memset(f, 0, sizeof(*f));
+
+#ifndef _WIN32
+	{
+		struct stat st;
+		int fd;
+
+		fd = open(path, O_RDONLY);
+		if(fd < 0)
+		{
+			return 0;
+		}
+
+		if(fstat(fd, &st) == 0 && st.st_size >= NIDCACHE_HDR_SIZE)
+		{
+			void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if(p != MAP_FAILED)
+			{
+				f->base = (u8 *) p;
+				f->size = st.st_size;
+				f->mapped = 1;
+			}
+		}
+		close(fd);
+	}
+#else
+	{
+		FILE *fp;
+		long size;
+
+		fp = fopen(path, "rb");
+		if(fp == NULL)
+		{
+			return 0;
+		}
+
+		if(fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= NIDCACHE_HDR_SIZE)
+		{
+			f->base = (u8 *) malloc(size);
+			rewind(fp);
+			if(f->base != NULL && fread(f->base, 1, size, fp) == (size_t) size)
+			{
+				f->size = size;
+			}
+		}
+		fclose(fp);
+	}
+#endif
+
+	if(f->size == 0 || !nidfile_validate(f))
+	{
+		nidfile_free(f);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int nidfile_lookup(const struct nidfile *f, u32 hash, const char *name, unsigned long len, unsigned int *nid)
+{
+	u32 mask, i, n;
+
+	if(f->nslots == 0)
+	{
+		return 0;
+	}
+
+	mask = f->nslots - 1;
+	for(i = hash & mask, n = 0; n < f->nslots; i = (i + 1) & mask, n++)
+	{
+		const u32 *slot = &f->slots[i * 3];
+		u32 off;
+
+		if(slot[1] == 0)
+		{
+			break;
+		}
+
+		off = slot[1] - 1;
+		if(slot[0] == hash && (u64) off + len < f->poolsize
+			&& memcmp(&f->pool[off], name, len) == 0 && f->pool[off + len] == 0)
+		{
+			*nid = slot[2];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+struct nidcache *nidcache_open(const char *path)
+{
+	struct nidcache *c;
+
+	c = (struct nidcache *) calloc(1, sizeof(struct nidcache));
+	if(c == NULL)
+	{
+		return NULL;
+	}
+
+	c->path = strdup(path);
+	if(c->path == NULL)
+	{
+		free(c);
+		return NULL;
+	}
+
+	(void) nidfile_load(path, &c->file);
+
+	return c;
+}
+
+int nidcache_lookup(const struct nidcache *c, const char *name, unsigned long len, unsigned int *nid)
+{
+	return nidfile_lookup(&c->file, fnv1a(name, len), name, len, nid);
+}
+
+static int nidcache_add(struct nidcache *c, const char *name, unsigned long len, u32 hash, u32 nid)
+{
+	struct nidentry *e;
+
+	if(c->addcount == c->addmax)
+	{
+		u32 max = c->addmax ? c->addmax * 2 : 256;
+
+		e = (struct nidentry *) realloc(c->add, max * sizeof(struct nidentry));
+		if(e == NULL)
+		{
+			return 0;
+		}
+		c->add = e;
+		c->addmax = max;
+	}
+
+	e = &c->add[c->addcount];
+	e->name = (char *) malloc(len + 1);
+	if(e->name == NULL)
+	{
+		return 0;
+	}
+	memcpy(e->name, name, len);
+	e->name[len] = 0;
+	e->len = len;
+	e->hash = hash;
+	e->nid = nid;
+	c->addcount++;
+
+	return 1;
+}
+
+void nidcache_hash_many(struct nidcache *c, const unsigned char *const data[],
+                        const unsigned long len[], unsigned long n, unsigned int nids[])
+{
+	const unsigned char **mdata = NULL;
+	unsigned long *mlen = NULL, *midx, i, m;
+	unsigned int *mnids;
+
+	if(c == NULL)
+	{
+		sha1_many(data, len, n, nids);
+		return;
+	}
+
+	mdata = (const unsigned char **) calloc(n, sizeof(*mdata));
+	mlen = (unsigned long *) calloc(n, sizeof(*mlen));
+	midx = (unsigned long *) malloc(n * sizeof(*midx));
+	mnids = (unsigned int *) malloc(n * sizeof(*mnids));
+	if(mdata == NULL || mlen == NULL || midx == NULL || mnids == NULL)
+	{
+		sha1_many(data, len, n, nids);
+		goto out;
+	}
+
+	/* Only hash the names missing from the cache */
+	for(i = 0, m = 0; i < n; i++)
+	{
+		if(!nidcache_lookup(c, (const char *) data[i], len[i], &nids[i]))
+		{
+			mdata[m] = data[i];
+			mlen[m] = len[i];
+			midx[m] = i;
+			m++;
+		}
+	}
+
+	sha1_many(mdata, mlen, m, mnids);
+
+	for(i = 0; i < m; i++)
+	{
+		nids[midx[i]] = mnids[i];
+		(void) nidcache_add(c, (const char *) mdata[i], mlen[i], fnv1a((const char *) mdata[i], mlen[i]), mnids[i]);
+	}
+
+out:
+	free(mdata);
+	free(mlen);
+	free(midx);
+	free(mnids);
+}
+
+/* Table being built by nidcache_save */
+struct nidtable
+{
+	u32 *slots;
+	u32 nslots;
+	u32 count;
+	char *pool;
+	u32 poolsize;
+	u64 poolmax;
+};
+
+/* Returns 0 when the table or its pool is full */
+static int nidtable_insert(struct nidtable *t, u32 hash, const char *name, u32 len, u32 nid)
+{
+	u32 mask = t->nslots - 1;
+	u32 i, n;
+
+	for(i = hash & mask, n = 0; t->slots[i * 3 + 1] != 0; i = (i + 1) & mask, n++)
+	{
+		u32 off = t->slots[i * 3 + 1] - 1;
+
+		if(n == t->nslots)
+		{
+			return 0;
+		}
+
+		if(t->slots[i * 3] == hash && memcmp(&t->pool[off], name, len) == 0 && t->pool[off + len] == 0)
+		{
+			return 1;
+		}
+	}
+
+	if((u64) t->poolsize + len + 1 > t->poolmax)
+	{
+		return 0;
+	}
+
+	memcpy(&t->pool[t->poolsize], name, len);
+	t->pool[t->poolsize + len] = 0;
+	t->slots[i * 3] = hash;
+	t->slots[i * 3 + 1] = t->poolsize + 1;
+	t->slots[i * 3 + 2] = nid;
+	t->poolsize += len + 1;
+	t->count++;
+
+	return 1;
+}
+
+static int nidtable_merge(struct nidtable *t, const struct nidfile *f)
+{
+	u32 i;
+
+	for(i = 0; i < f->nslots; i++)
+	{
+		const u32 *slot = &f->slots[i * 3];
+		const char *name;
+
+		if(slot[1] == 0 || slot[1] > f->poolsize)
+		{
+			continue;
+		}
+
+		name = &f->pool[slot[1] - 1];
+		if(!nidtable_insert(t, slot[0], name, strlen(name), slot[2]))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int nidcache_save(struct nidcache *c)
+{
+	struct nidfile disk;
+	struct nidtable t;
+	u64 total, poolmax;
+	u32 hdr[5];
+	char *tmp;
+	FILE *fp;
+	u32 i;
+	int ret = 0;
+
+	/* Another process may have updated the file since we opened it */
+	(void) nidfile_load(c->path, &disk);
+
+	total = (u64) c->file.count + disk.count + c->addcount;
+	poolmax = (u64) c->file.poolsize + disk.poolsize;
+	for(i = 0; i < c->addcount; i++)
+	{
+		poolmax += c->add[i].len + 1;
+	}
+
+	memset(&t, 0, sizeof(t));
+	for(t.nslots = NIDCACHE_MIN_SLOTS; t.nslots < total * 2; t.nslots <<= 1);
+	if(poolmax >= 0xFFFFFFFF || t.nslots == 0)
+	{
+		nidfile_free(&disk);
+		return 0;
+	}
+
+	t.slots = (u32 *) calloc(t.nslots, 12);
+	t.pool = (char *) malloc(poolmax + 1);
+	t.poolmax = poolmax;
+	tmp = (char *) malloc(strlen(c->path) + 32);
+	do
+	{
+		if(t.slots == NULL || t.pool == NULL || tmp == NULL)
+		{
+			break;
+		}
+
+		if(!nidtable_merge(&t, &disk) || !nidtable_merge(&t, &c->file))
+		{
+			break;
+		}
+		for(i = 0; i < c->addcount; i++)
+		{
+			if(!nidtable_insert(&t, c->add[i].hash, c->add[i].name, c->add[i].len, c->add[i].nid))
+			{
+				break;
+			}
+		}
+		if(i < c->addcount)
+		{
+			break;
+		}
+
+		memcpy(&hdr[0], NIDCACHE_MAGIC, 4);
+		hdr[1] = NIDCACHE_VERSION;
+		hdr[2] = t.count;
+		hdr[3] = t.nslots;
+		hdr[4] = t.poolsize;
+
+		/* Readers either see the old file or the new one, never a partial one */
+		sprintf(tmp, "%s.%d.tmp", c->path, (int) getpid());
+		fp = fopen(tmp, "wb");
+		if(fp == NULL)
+		{
+			break;
+		}
+
+		if(fwrite(hdr, sizeof(hdr), 1, fp) != 1
+			|| fwrite(t.slots, 12, t.nslots, fp) != t.nslots
+			|| (t.poolsize > 0 && fwrite(t.pool, t.poolsize, 1, fp) != 1))
+		{
+			fclose(fp);
+			remove(tmp);
+			break;
+		}
+
+		if(fclose(fp) != 0)
+		{
+			remove(tmp);
+			break;
+		}
+
+#ifdef _WIN32
+		remove(c->path);
+#endif
+		if(rename(tmp, c->path) != 0)
+		{
+			remove(tmp);
+			break;
+		}
+
+		ret = 1;
+	}
+	while(0);
+
+	nidfile_free(&disk);
+	free(t.slots);
+	free(t.pool);
+	free(tmp);
+
+	return ret;
+}
+
+int nidcache_close(struct nidcache *c)
+{
+	int ret = 1;
+	u32 i;
+
+	if(c == NULL)
+	{
+		return 1;
+	}
+
+	if(c->addcount > 0)
+	{
+		ret = nidcache_save(c);
+	}
+
+	for(i = 0; i < c->addcount; i++)
+	{
+		free(c->add[i].name);
+	}
+	free(c->add);
+	nidfile_free(&c->file);
+	free(c->path);
+	free(c);
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// PSP Software Development Kit - https://github.com/pspdev
+#ifndef COMMON_NIDCACHE_H
+#define COMMON_NIDCACHE_H
+
+/* On-disk cache of name -> NID hashes, shared between the SDK tools.
+ *
+ * The file is an open addressing hash table (FNV-1a of the name, linear
+ * probing) followed by a pool of NUL terminated names. It is mapped read
+ * only, looked up in place and never modified: new entries are kept in
+ * memory and nidcache_close() writes a merged table to a temporary file
+ * which is then renamed over the old one.
+ */
+
+/* Environment variable used when no cache file is given on the command line */
+#define NIDCACHE_ENV "PSPSDK_NIDCACHE"
+
+struct nidcache;
+
+/* Open (or start) the cache at path. A missing or invalid file gives an empty
+   cache. Returns NULL on allocation failure. */
+struct nidcache *nidcache_open(const char *path);
+
+/* Look up a name, returns 1 and sets *nid when it is in the cache. */
+int nidcache_lookup(const struct nidcache *c, const char *name, unsigned long len, unsigned int *nid);
+
+/* Same as sha1_many() but names found in the cache are not hashed, and the
+   others are added to it. c may be NULL. */
+void nidcache_hash_many(struct nidcache *c, const unsigned char *const data[],
+                        const unsigned long len[], unsigned long n, unsigned int nids[]);
+
+/* Write the cache back if new names were added and free it.
+   Returns 0 if the cache file could not be updated. */
+int nidcache_close(struct nidcache *c);
+
+#endif /* COMMON_NIDCACHE_H */
@@ -277,6 +277,182 @@ void sha1(unsigned char hval[], const unsigned char data[], unsigned long len)
     sha1_begin(cx); sha1_hash(data, len, cx); sha1_end(hval, cx);
 }
 
+/* Multi-buffer SHA1 for short messages (symbol names). Every   */
+/* lane of a vector register holds the state of one message so  */
+/* that SHA1_MB_LANES single block messages are compiled by the */
+/* same instruction stream. GCC/Clang vector extensions map the */
+/* vectors to SSE2/AVX2 on x86 and NEON on ARM.                 */
+
+#define SHA1_MB_MAX_LEN (SHA1_BLOCK_SIZE - 9)
+
+#if defined(__GNUC__)
+
+#if defined(__AVX2__)
+#define SHA1_MB_LANES 8
+#else
+#define SHA1_MB_LANES 4
+#endif
+
+typedef unsigned int sha1_mbv __attribute__((vector_size(SHA1_MB_LANES * 4)));
+
+#define mb_rotl(x,n)    (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define mb_cycle(a,b,c,d,e,f,k,w)                     \
+    e += mb_rotl(a, 5) + f(b, c, d) + (k) + (w);     \
+    b  = mb_rotl(b, 30)
+
+#define mb_w(i) (w[(i) & 15] = mb_rotl(                 \
+                 w[((i) + 13) & 15] ^ w[((i) + 8) & 15] \
+               ^ w[((i) +  2) & 15] ^ w[(i) & 15], 1))
+
+static void sha1_mb_compile(sha1_mbv w[16], sha1_mbv h[5])
+{   sha1_mbv a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    int i;
+
+    for(i = 0; i < 80; i += 5)
+    {
+        sha1_mbv w0, w1, w2, w3, w4;
+
+        if(i < 15)
+        {
+            w0 = w[i]; w1 = w[i + 1]; w2 = w[i + 2];
+            w3 = w[i + 3]; w4 = w[i + 4];
+        }
+        else if(i == 15)
+        {
+            w0 = w[15]; w1 = mb_w(16); w2 = mb_w(17);
+            w3 = mb_w(18); w4 = mb_w(19);
+        }
+        else
+        {
+            w0 = mb_w(i); w1 = mb_w(i + 1); w2 = mb_w(i + 2);
+            w3 = mb_w(i + 3); w4 = mb_w(i + 4);
+        }
+
+        if(i < 20)
+        {
+            mb_cycle(a,b,c,d,e, ch, 0x5a827999, w0);
+            mb_cycle(e,a,b,c,d, ch, 0x5a827999, w1);
+            mb_cycle(d,e,a,b,c, ch, 0x5a827999, w2);
+            mb_cycle(c,d,e,a,b, ch, 0x5a827999, w3);
+            mb_cycle(b,c,d,e,a, ch, 0x5a827999, w4);
+        }
+        else if(i < 40)
+        {
+            mb_cycle(a,b,c,d,e, parity, 0x6ed9eba1, w0);
+            mb_cycle(e,a,b,c,d, parity, 0x6ed9eba1, w1);
+            mb_cycle(d,e,a,b,c, parity, 0x6ed9eba1, w2);
+            mb_cycle(c,d,e,a,b, parity, 0x6ed9eba1, w3);
+            mb_cycle(b,c,d,e,a, parity, 0x6ed9eba1, w4);
+        }
+        else if(i < 60)
+        {
+            mb_cycle(a,b,c,d,e, maj, 0x8f1bbcdc, w0);
+            mb_cycle(e,a,b,c,d, maj, 0x8f1bbcdc, w1);
+            mb_cycle(d,e,a,b,c, maj, 0x8f1bbcdc, w2);
+            mb_cycle(c,d,e,a,b, maj, 0x8f1bbcdc, w3);
+            mb_cycle(b,c,d,e,a, maj, 0x8f1bbcdc, w4);
+        }
+        else
+        {
+            mb_cycle(a,b,c,d,e, parity, 0xca62c1d6, w0);
+            mb_cycle(e,a,b,c,d, parity, 0xca62c1d6, w1);
+            mb_cycle(d,e,a,b,c, parity, 0xca62c1d6, w2);
+            mb_cycle(c,d,e,a,b, parity, 0xca62c1d6, w3);
+            mb_cycle(b,c,d,e,a, parity, 0xca62c1d6, w4);
+        }
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/* Hash up to SHA1_MB_LANES messages of at most SHA1_MB_MAX_LEN */
+/* bytes each, unused lanes hash the empty message.             */
+
+static void sha1_mb_lanes(const unsigned char *const data[], const unsigned long len[],
+                          int count, unsigned int nids[])
+{   unsigned char blk[SHA1_MB_LANES][SHA1_BLOCK_SIZE];
+    sha1_mbv w[16], h[5];
+    int i, l;
+
+    memset(blk, 0, sizeof(blk));
+    for(l = 0; l < SHA1_MB_LANES; ++l)
+    {
+        unsigned long n = l < count ? len[l] : 0;
+
+        if(n)
+            memcpy(blk[l], data[l], n);
+        blk[l][n] = 0x80;
+        blk[l][SHA1_BLOCK_SIZE - 2] = (unsigned char)((n << 3) >> 8);
+        blk[l][SHA1_BLOCK_SIZE - 1] = (unsigned char)(n << 3);
+    }
+
+    /* transpose the big endian message words into the lanes       */
+    for(i = 0; i < 16; ++i)
+        for(l = 0; l < SHA1_MB_LANES; ++l)
+            w[i][l] = ((unsigned int)blk[l][4 * i] << 24) | ((unsigned int)blk[l][4 * i + 1] << 16)
+                    | ((unsigned int)blk[l][4 * i + 2] << 8) | blk[l][4 * i + 3];
+
+    for(l = 0; l < SHA1_MB_LANES; ++l)
+    {
+        h[0][l] = 0x67452301; h[1][l] = 0xefcdab89;
+        h[2][l] = 0x98badcfe; h[3][l] = 0x10325476;
+        h[4][l] = 0xc3d2e1f0;
+    }
+
+    sha1_mb_compile(w, h);
+
+    for(l = 0; l < count; ++l)
+        nids[l] = bswap_32(h[0][l]);
+}
+
+#endif /* __GNUC__ */
+
+void sha1_many(const unsigned char *const data[], const unsigned long len[],
+               unsigned long n, unsigned int nids[])
+{   unsigned long i = 0;
+#if defined(__GNUC__)
+    const unsigned char *ld[SHA1_MB_LANES];
+    unsigned long ll[SHA1_MB_LANES];
+    unsigned long li[SHA1_MB_LANES];
+    unsigned int ln[SHA1_MB_LANES];
+    int count = 0, l;
+#endif
+
+    for(i = 0; i < n; ++i)
+    {
+#if defined(__GNUC__)
+        if(len[i] <= SHA1_MB_MAX_LEN)
+        {
+            ld[count] = data[i]; ll[count] = len[i]; li[count] = i;
+            if(++count == SHA1_MB_LANES)
+            {
+                sha1_mb_lanes(ld, ll, count, ln);
+                for(l = 0; l < count; ++l)
+                    nids[li[l]] = ln[l];
+                count = 0;
+            }
+            continue;
+        }
+#endif
+        {
+            unsigned char hval[SHA1_DIGEST_SIZE];
+
+            sha1(hval, data[i], len[i]);
+            nids[i] = hval[0] | (hval[1] << 8) | (hval[2] << 16) | ((unsigned int)hval[3] << 24);
+        }
+    }
+
+#if defined(__GNUC__)
+    if(count)
+    {
+        sha1_mb_lanes(ld, ll, count, ln);
+        for(l = 0; l < count; ++l)
+            nids[li[l]] = ln[l];
+    }
+#endif
+}
+
 #if defined(__cplusplus)
 }
 #endif
@@ -77,6 +77,14 @@ void sha1_hash(const unsigned char data[], unsigned long len, sha1_ctx ctx[1]);
 void sha1_end(unsigned char hval[], sha1_ctx ctx[1]);
 void sha1(unsigned char hval[], const unsigned char data[], unsigned long len);
 
+/* Hash n messages at once and store the first 32 bits of each digest,  */
+/* read as a little endian word (i.e. a PSP NID), in nids[]. Messages   */
+/* that fit into a single block (up to 55 bytes) are hashed several at  */
+/* a time in SIMD lanes, longer ones go through sha1() one by one.      */
+
+void sha1_many(const unsigned char *const data[], const unsigned long len[],
+               unsigned long n, unsigned int nids[]);
+
 #if defined(__cplusplus)
 }
 #endif
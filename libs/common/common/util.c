@@ -172,17 +172,17 @@ int build_file_path(char *out, size_t outsz, size_t *pLen, const char *a, const
     return 0;
 }
 
-int getfilesize(const char *path, int *pSize)
+int getfilesize(const char *path, long long *pSize)
 {
     struct stat st;
     if (stat(path, &st) != 0)
         return 1;
     if (pSize)
-        *pSize = (int)st.st_size;
+        *pSize = (long long)st.st_size;
     return 0;
 }
 
-int format_file_size(char * buf, size_t bufsz, int nbytes, int si, int dp)
+int format_file_size(char * buf, size_t bufsz, long long nbytes, int si, int dp)
 {
     /* JS source https://stackoverflow.com/a/14919494 */
     static const char * units_si[] = {"kB","MB","GB","TB","PB","EB","ZB","YB"};
@@ -192,8 +192,8 @@ int format_file_size(char * buf, size_t bufsz, int nbytes, int si, int dp)
     int u = -1;
     double r, n;
 
-    if (abs(nbytes) < thresh)
-        return snprintf(buf, bufsz, "%d B", nbytes);
+    if (nbytes < thresh && nbytes > -thresh)
+        return snprintf(buf, bufsz, "%lld B", nbytes);
 
     r = pow(10, (double)dp);
     n = (double)nbytes;
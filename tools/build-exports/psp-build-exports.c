@@ -11,6 +11,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <common/nidcache.h>
 #include <common/sha1.h>
 
 #ifdef HAVE_CONFIG_H
@@ -24,6 +25,7 @@
 #define MAX_LIB_ENTRY_NAME 127
 #define MAX_ERROR 1024
 #define MAX_LINE  1024
+#define HASH_BATCH 256
 #define SYSTEM_LIB_NAME "syslib"
 
 /* Name of the variables in the CMake code for -c command. */
@@ -82,10 +84,15 @@ static int g_uofw = 0;
 static char g_cvar_prefix[256] = {0};
 static int g_verbose = 0;
 static const char *g_infile;
+static const char *g_nidcachefile = NULL;
 static char g_errstring[MAX_ERROR] = "No Error";
 static struct psp_lib *g_libhead = NULL;
 static struct psp_lib *g_currlib = NULL;
 static int g_libcount = 0;
+/* Exports whose NID is the hash of their name, resolved after loading. */
+static struct psp_export **g_hashlist = NULL;
+static int g_hashcount = 0;
+static int g_hashmax = 0;
 
 void free_export_chain(struct psp_export *pHead)
 {
@@ -147,6 +154,11 @@ void free_lib_data(void)
 	}
 
 	g_libhead = NULL;
+
+	free(g_hashlist);
+	g_hashlist = NULL;
+	g_hashcount = 0;
+	g_hashmax = 0;
 }
 
 const char *find_alias(struct psp_alias *pHead, const char *name)
@@ -178,6 +190,7 @@ static struct option arg_opts[] =
 	{"build-stubs",     no_argument,       NULL, 's'},
 	{"build-stubs-new", no_argument,       NULL, 'k'},
 	{"print-cmake",     optional_argument, NULL, 'c'},
+	{"nid-cache",       required_argument, NULL, 'n'},
 	{"verbose",         no_argument,       NULL, 'v'},
 	{ NULL, 0, NULL, 0 }
 };
@@ -210,6 +223,7 @@ int process_args(int argc, char **argv)
 	int ch;
 
 	g_outputmode = PSP_BUILD_UNKNOWN;
+	g_nidcachefile = getenv(NIDCACHE_ENV);
 
 	const char *shortopts = "bskcv";
 	ch = getopt_long(argc, argv, shortopts, arg_opts, NULL);
@@ -238,6 +252,9 @@ int process_args(int argc, char **argv)
 				}
 				ret = 1;
 				break;
+			case 'n':
+				g_nidcachefile = optarg;
+				break;
 			case 'v':
 				g_verbose = 1;
 				break;
@@ -274,6 +291,7 @@ void print_help(void)
 	fprintf(stderr, "-c, --print-cmake[=<PREFIX>] :\n");
 	fprintf(stderr, "                          Print stubs info as CMake code to stdout\n");
 	fprintf(stderr, "                          Optional PREFIX arg is the variable name prefix.\n");
+	fprintf(stderr, "    --nid-cache FILE    : Cache of hashed NIDs (default $" NIDCACHE_ENV ")\n");
 	fprintf(stderr, "-v, --verbose           : Verbose output\n");
 }
 
@@ -741,7 +759,7 @@ int psp_export_end(char **params)
 	return 1;
 }
 
-int internal_do_export(const char *name, unsigned int nid, struct psp_export **pHead)
+int internal_do_export(const char *name, unsigned int nid, struct psp_export **pHead, int hash)
 {
 	struct psp_export *pNew;
 
@@ -758,6 +776,34 @@ int internal_do_export(const char *name, unsigned int nid, struct psp_export **p
 		strncpy(pNew->name, name, MAX_LIB_ENTRY_NAME);
 		pNew->nid = nid;
 
+		if(hash && strlen(name) > MAX_LIB_ENTRY_NAME)
+		{
+			/* The stored name is truncated, hash the full one now. */
+			unsigned char digest[SHA1_DIGEST_SIZE];
+
+			sha1(digest, (const unsigned char *) name, strlen(name));
+			pNew->nid = digest[0] | (digest[1] << 8) | (digest[2] << 16) | (digest[3] << 24);
+		}
+		else if(hash)
+		{
+			if(g_hashcount == g_hashmax)
+			{
+				struct psp_export **pList;
+				int max = g_hashmax ? g_hashmax * 2 : HASH_BATCH;
+
+				pList = (struct psp_export **) realloc(g_hashlist, max * sizeof(*pList));
+				if(pList == NULL)
+				{
+					free(pNew);
+					snprintf(g_errstring, MAX_ERROR, "Could not allocate memory for export %s", name);
+					return 0;
+				}
+				g_hashlist = pList;
+				g_hashmax = max;
+			}
+			g_hashlist[g_hashcount++] = pNew;
+		}
+
 		if(*pHead == NULL)
 		{
 			*pHead = pNew;
@@ -799,7 +845,7 @@ int psp_export_func_nid(char **params)
 
 	if(g_currlib->funcCount < MAX_LIB_FUNCS)
 	{
-		if(internal_do_export(params[0], nid, &g_currlib->pFuncHead))
+		if(internal_do_export(params[0], nid, &g_currlib->pFuncHead, 0))
 		{
 			g_currlib->funcCount++;
 			return 1;
@@ -815,21 +861,15 @@ int psp_export_func_nid(char **params)
 
 int psp_export_func_hash(char **params)
 {
-	unsigned int nid;
-	unsigned char hash[SHA1_DIGEST_SIZE];
-
 	if(g_currlib == NULL)
 	{
 		snprintf(g_errstring, MAX_ERROR, "Cannot export function, not in a library definition");
 		return 0;
 	}
 
-	sha1(hash, (unsigned char *) params[0], strlen(params[0]));
-	nid = hash[0] | (hash[1] << 8) | (hash[2] << 16) | (hash[3] << 24);
-
 	if(g_currlib->funcCount < MAX_LIB_FUNCS)
 	{
-		if(internal_do_export(params[0], nid, &g_currlib->pFuncHead))
+		if(internal_do_export(params[0], 0, &g_currlib->pFuncHead, 1))
 		{
 			g_currlib->funcCount++;
 			return 1;
@@ -860,7 +900,7 @@ int psp_export_var_nid(char **params)
 
 	if(g_currlib->varCount < MAX_LIB_VARS)
 	{
-		if(internal_do_export(params[0], nid, &g_currlib->pVarHead))
+		if(internal_do_export(params[0], nid, &g_currlib->pVarHead, 0))
 		{
 			g_currlib->varCount++;
 			return 1;
@@ -876,21 +916,15 @@ int psp_export_var_nid(char **params)
 
 int psp_export_var_hash(char **params)
 {
-	unsigned int nid;
-	unsigned char hash[SHA1_DIGEST_SIZE];
-
 	if(g_currlib == NULL)
 	{
 		snprintf(g_errstring, MAX_ERROR, "Cannot export variable, not in a library definition");
 		return 0;
 	}
 
-	sha1(hash, (unsigned char *) params[0], strlen(params[0]));
-	nid = hash[0] | (hash[1] << 8) | (hash[2] << 16) | (hash[3] << 24);
-
 	if(g_currlib->varCount < MAX_LIB_VARS)
 	{
-		if(internal_do_export(params[0], nid, &g_currlib->pVarHead))
+		if(internal_do_export(params[0], 0, &g_currlib->pVarHead, 1))
 		{
 			g_currlib->varCount++;
 			return 1;
@@ -996,6 +1030,53 @@ int process_command(const char *cmd, char ** params, int param_count)
 	return 0;
 }
 
+/* Compute the NID of the hashed exports, several names at a time. */
+void resolve_export_hashes(void)
+{
+	const unsigned char *names[HASH_BATCH];
+	unsigned long lens[HASH_BATCH];
+	unsigned int nids[HASH_BATCH];
+	struct nidcache *cache = NULL;
+	int i, j, count;
+
+	if(g_hashcount == 0)
+	{
+		return;
+	}
+
+	if(g_nidcachefile != NULL && g_nidcachefile[0] != 0)
+	{
+		cache = nidcache_open(g_nidcachefile);
+	}
+
+	for(i = 0; i < g_hashcount; i += count)
+	{
+		count = g_hashcount - i;
+		if(count > HASH_BATCH)
+		{
+			count = HASH_BATCH;
+		}
+
+		for(j = 0; j < count; j++)
+		{
+			names[j] = (const unsigned char *) g_hashlist[i + j]->name;
+			lens[j] = strlen(g_hashlist[i + j]->name);
+		}
+
+		nidcache_hash_many(cache, names, lens, count, nids);
+
+		for(j = 0; j < count; j++)
+		{
+			g_hashlist[i + j]->nid = nids[j];
+		}
+	}
+
+	if(!nidcache_close(cache))
+	{
+		fprintf(stderr, "Warning, could not update NID cache %s\n", g_nidcachefile);
+	}
+}
+
 int load_exports(void)
 {
 	FILE *fp;
@@ -1051,6 +1132,8 @@ int load_exports(void)
 			fprintf(stderr, "Error, reached end of file while still exporting a library\n");
 			return 0;
 		}
+
+		resolve_export_hashes();
 	}
 	else
 	{
@@ -16,6 +16,7 @@
 #include <common/types.h>
 #include <common/elftypes.h>
 #include <common/prxtypes.h>
+#include <common/nidcache.h>
 #include <common/sha1.h>
 
 static char *g_progname = NULL;
@@ -34,6 +35,7 @@ struct NidMap
 };
 
 #define MAX_MAPNIDS 1024
+#define HASH_BATCH  256
 
 struct ImportMap
 {
@@ -47,6 +49,7 @@ struct ImportMap
 static const char *g_outfile;
 static const char *g_infile;
 static const char *g_mapfile;
+static const char *g_nidcachefile;
 static unsigned char *g_elfdata = NULL;
 static unsigned int  g_elfsize;
 static struct ElfHeader g_elfhead;
@@ -61,6 +64,17 @@ static struct ElfSection *g_textrel = NULL;
 static struct ImportMap  *g_map = NULL;
 static int g_reversemap = 0;
 
+/* Map entries given by function name, hashed once the map file is read. */
+struct PendingNid
+{
+	struct NidMap *nid;
+	char *name;
+};
+
+static struct PendingNid *g_pending = NULL;
+static int g_pendingcount = 0;
+static int g_pendingmax = 0;
+
 /* Specifies that the current usage is to the print the pspsdk path */
 static int g_verbose = 0;
 
@@ -69,6 +83,7 @@ static struct option arg_opts[] =
 	{"output",  required_argument, NULL, 'o'},
 	{"reverse", no_argument,       NULL, 'r'},
 	{"map",     required_argument, NULL, 'm'},
+	{"nid-cache", required_argument, NULL, 'n'},
 	{"verbose", no_argument,       NULL, 'v'},
 	{ NULL, 0, NULL, 0 }
 };
@@ -81,6 +96,7 @@ int process_args(int argc, char **argv)
 	g_outfile = NULL;
 	g_infile = NULL;
 	g_mapfile = NULL;
+	g_nidcachefile = getenv(NIDCACHE_ENV);
 
 	ch = getopt_long(argc, argv, "vro:m:", arg_opts, NULL);
 	while(ch != -1)
@@ -95,6 +111,8 @@ int process_args(int argc, char **argv)
 					   break;
 			case 'r' : g_reversemap = 1;
 					   break;
+			case 'n' : g_nidcachefile = optarg;
+					   break;
 			default  : break;
 		};
 
@@ -131,6 +149,7 @@ void print_help(void)
 	fprintf(stderr, "-o, --output outfile    : Output to a different file\n");
 	fprintf(stderr, "-m, --map    mapfile    : Specify a firmware NID mapfile\n");
 	fprintf(stderr, "-r, --reverse           : Reverse the mapping\n");
+	fprintf(stderr, "    --nid-cache FILE    : Cache of hashed NIDs (default $" NIDCACHE_ENV ")\n");
 	fprintf(stderr, "-v, --verbose           : Verbose output\n");
 }
 
@@ -480,6 +499,87 @@ void strip_wsp(char *str)
 	str[len] = 0;
 }
 
+static int add_pending_nid(struct NidMap *nid, const char *name, int len)
+{
+	if(g_pendingcount == g_pendingmax)
+	{
+		struct PendingNid *temp;
+		int max = g_pendingmax ? g_pendingmax * 2 : HASH_BATCH;
+
+		temp = (struct PendingNid *) realloc(g_pending, max * sizeof(struct PendingNid));
+		if(temp == NULL)
+		{
+			return 0;
+		}
+		g_pending = temp;
+		g_pendingmax = max;
+	}
+
+	g_pending[g_pendingcount].name = (char *) malloc(len + 1);
+	if(g_pending[g_pendingcount].name == NULL)
+	{
+		return 0;
+	}
+	memcpy(g_pending[g_pendingcount].name, name, len);
+	g_pending[g_pendingcount].name[len] = 0;
+	g_pending[g_pendingcount].nid = nid;
+	g_pendingcount++;
+
+	return 1;
+}
+
+/* Hash the pending function names, several at a time */
+static void resolve_pending_nids(void)
+{
+	const unsigned char *names[HASH_BATCH];
+	unsigned long lens[HASH_BATCH];
+	unsigned int nids[HASH_BATCH];
+	struct nidcache *cache = NULL;
+	int i, j, count;
+
+	if(g_pendingcount > 0 && g_nidcachefile != NULL && g_nidcachefile[0] != 0)
+	{
+		cache = nidcache_open(g_nidcachefile);
+	}
+
+	for(i = 0; i < g_pendingcount; i += count)
+	{
+		count = g_pendingcount - i;
+		if(count > HASH_BATCH)
+		{
+			count = HASH_BATCH;
+		}
+
+		for(j = 0; j < count; j++)
+		{
+			names[j] = (const unsigned char *) g_pending[i + j].name;
+			lens[j] = strlen(g_pending[i + j].name);
+		}
+
+		nidcache_hash_many(cache, names, lens, count, nids);
+
+		for(j = 0; j < count; j++)
+		{
+			g_pending[i + j].nid->oldnid = nids[j];
+			if(g_verbose)
+			{
+				fprintf(stderr, "NID Mapping 0x%08X to 0x%08X\n", nids[j], g_pending[i + j].nid->newnid);
+			}
+			free(g_pending[i + j].name);
+		}
+	}
+
+	if(!nidcache_close(cache))
+	{
+		fprintf(stderr, "Warning, could not update NID cache %s\n", g_nidcachefile);
+	}
+
+	free(g_pending);
+	g_pending = NULL;
+	g_pendingcount = 0;
+	g_pendingmax = 0;
+}
+
 /* Load map file in 
  * File format is :-
  * @LibraryName followed by 0 or more
@@ -574,8 +674,6 @@ int load_mapfile(const char *mapfile)
 							}
 							else
 							{
-								unsigned char hash[SHA1_DIGEST_SIZE];
-
 								endp = strchr(buf, ':');
 								if(endp == NULL)
 								{
@@ -583,12 +681,18 @@ int load_mapfile(const char *mapfile)
 									continue;
 								}
 
-								sha1(hash, (unsigned char *) buf, endp-buf);
-								oldnid = hash[0] | (hash[1] << 8) | (hash[2] << 16) | (hash[3] << 24);
+								/* Hashed later on, see resolve_pending_nids */
+								if(!add_pending_nid(&currmap->nids[currmap->count], buf, endp-buf))
+								{
+									printf("Error allocating memory for import map\n");
+									ret = 0;
+									break;
+								}
+								oldnid = 0;
 							}
 
 							newnid = strtoul(endp+1, &endp, 16);
-							if(g_verbose)
+							if(g_verbose && buf[0] == '0')
 							{
 								fprintf(stderr, "NID Mapping 0x%08X to 0x%08X\n", oldnid, newnid);
 							}
@@ -603,6 +707,8 @@ int load_mapfile(const char *mapfile)
 			}
 		}
 		while(0);
+
+		resolve_pending_nids();
 	}
 
 	return ret;
@@ -1,9 +1,23 @@
 // SPDX-FileCopyrightText: 2022 Linblow <dev@linblow.com>
 // SPDX-License-Identifier: BSD-3-Clause
+#ifdef __linux__
+# define _GNU_SOURCE /* copy_file_range */
+#endif
 #include <common/util.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+# include <pthread.h>
+# include <sys/mman.h>
+#endif
+#ifdef __linux__
+# include <unistd.h>
+# include <sys/ioctl.h>
+# include <sys/sendfile.h>
+# include <linux/fs.h> /* FICLONERANGE */
+#endif
 /* getopt is GNU Lesser General Public version 2.1, or (at your option) any later version. 
    See https://choosealicense.com/licenses/lgpl-2.1/ */
 #include <getopt.h>
@@ -15,7 +29,7 @@
 #define DEFAULT_PBP_VERSION      (1) // 0: v1.0; 1: v1.1
 #define DEFAULT_OUTPUT_PATH      "EBOOT.PBP"
 
-#define READBUFSZ (16 * 1024 * 1024) // 16 MiB
+#define READBUFSZ (16 * 1024 * 1024) // 16 MiB, only when the data cannot be copied by the kernel
 
 enum {
    ERR_OK = 0,
@@ -26,7 +40,8 @@ enum {
    ERR_IO_WRITE,
    ERR_IO_GETFILESIZE,
    ERR_IO_STAT,
-   ERR_MALLOC
+   ERR_MALLOC,
+   ERR_FORMAT
 };
 
 typedef union {
@@ -93,6 +108,127 @@ static const char * get_pbpentry_name(int index)
    return (index >= 0 && index < 8) ? ent[index] : "";
 }
 
+/* 
+ * Copy the size bytes of fp at inOffset to fout at *pOffset, and advance it.
+ * On Linux the data is reflinked when both offsets are on a file system
+ * block, else copied by the kernel with copy_file_range, or sendfile when
+ * the files are not on the same file system. What is left is written from
+ * map, the mapped input when not NULL, else copied through *pBuf, allocated
+ * on first use. Without map, fp must be at inOffset.
+ */
+static int copy_file_data(FILE *fp, const char *map, long long inOffset, FILE *fout, long long *pOffset, long long size, char **pBuf)
+{
+   long long done = 0;
+   size_t readsize;
+
+#ifdef __linux__
+   int fdin = fileno(fp);
+   int fdout = fileno(fout);
+   loff_t in_off, out_off;
+   off_t sf_off;
+   ssize_t n;
+   int seekable = lseek(fdout, 0, SEEK_CUR) >= 0; /* Not a pipe. */
+
+   /* Previous buffered writes go first. */
+   if (0 != fflush(fout))
+      return ERR_IO_WRITE;
+
+#ifdef FICLONERANGE
+   struct stat st;
+   if (fstat(fdout, &st) == 0 && st.st_blksize > 0 && (inOffset % st.st_blksize) == 0 && (*pOffset % st.st_blksize) == 0)
+   {
+      /* An unaligned tail is allowed as it ends both files. */
+      struct file_clone_range range;
+      range.src_fd = fdin;
+      range.src_offset = inOffset;
+      range.src_length = size;
+      range.dest_offset = *pOffset;
+      if (ioctl(fdout, FICLONERANGE, &range) == 0)
+         done = size;
+   }
+#endif
+
+   in_off = inOffset + done;
+   out_off = *pOffset + done;
+   while (done < size)
+   {
+      n = copy_file_range(fdin, &in_off, fdout, &out_off, size - done, 0);
+      if (n <= 0)
+         break;
+      done += n;
+   }
+
+   /* sendfile writes at the file position. */
+   if (done < size && (!seekable || lseek(fdout, *pOffset + done, SEEK_SET) >= 0))
+   {
+      sf_off = inOffset + done;
+      while (done < size)
+      {
+         n = sendfile(fdout, fdin, &sf_off, size - done);
+         if (n <= 0)
+            break;
+         done += n;
+      }
+   }
+
+   if (done < size && map == NULL && 0 != fseeko(fp, inOffset + done, SEEK_SET))
+      return ERR_IO_READ;
+   if (done < size && seekable && 0 != fseeko(fout, *pOffset + done, SEEK_SET))
+      return ERR_IO_WRITE;
+#endif
+
+   if (done < size && map != NULL)
+   {
+      if ((size_t)(size - done) != fwrite(map + inOffset + done, 1, (size_t)(size - done), fout))
+         return ERR_IO_WRITE;
+      done = size;
+   }
+
+   if (done < size && *pBuf == NULL && (*pBuf = malloc(READBUFSZ)) == NULL)
+      return ERR_MALLOC;
+   while (done < size)
+   {
+      readsize = size - done >= READBUFSZ ? READBUFSZ : (size_t)(size - done);
+      if (readsize != fread(*pBuf, 1, readsize, fp))
+         return ERR_IO_READ;
+      if (readsize != fwrite(*pBuf, 1, readsize, fout))
+         return ERR_IO_WRITE;
+      done += readsize;
+   }
+
+   *pOffset += size;
+   return ERR_OK;
+}
+
+/* File name of each entry, and the other names it is found by. */
+static const char * const pbpentry_filenames[8][2] =
+{
+   {"PARAM.SFO", NULL},
+   {"ICON0.PNG", NULL},
+   {"ICON1.PMF", "ICON1.PNG"},
+   {"PIC0.PNG",  NULL},
+   {"PIC1.PNG",  "PICT1.PNG"},
+   {"SND0.AT3",  NULL},
+   {"DATA.PSP",  NULL},
+   {"DATA.PSAR", NULL}
+};
+
+/* Index of an entry from its file name, option name (e.g. icon0) or number (1 to 8), -1 if none. */
+static int find_pbpentry(const char *name)
+{
+   static const char *opt[] = {"param", "icon0", "icon1", "pic0", "pic1", "snd0", "data", "psar"};
+   int i;
+   for (i = 0; i < 8; ++i)
+   {
+      if (strcasecmp(name, opt[i]) == 0 || strcasecmp(name, pbpentry_filenames[i][0]) == 0 || 
+          (pbpentry_filenames[i][1] && strcasecmp(name, pbpentry_filenames[i][1]) == 0))
+         return i;
+   }
+   if (name[0] >= '1' && name[0] <= '8' && name[1] == 0)
+      return name[0] - '1';
+   return -1;
+}
+
 static int write_pbp(const char *path, 
                      const pbp_files_path *files, 
                      int pbp_version, 
@@ -102,9 +238,11 @@ static int write_pbp(const char *path,
 {
    int ret;
    int i;
-   int filesize[8];
+   long long filesize[8];
    char strsize[32];
-   size_t pbpsize, readsize;
+   char strname[256];
+   long long pbpsize;
+   long long offset;
    FILE *fout = NULL;
    FILE *fp = NULL;
    char *buf = NULL;
@@ -114,10 +252,6 @@ static int write_pbp(const char *path,
    if (fout == NULL)
       ENDERRF(ERR_IO_OPEN, "Cannot open the output file (%s)\n", path);
 
-   buf = malloc(READBUFSZ);
-   if (buf == NULL)
-      ENDERR(ERR_MALLOC, "Cannot allocate the file read buffer\n");
-
    /* Init PBP header */
    memset(&hdr, 0, sizeof(ScePBPHeader));
    memcpy(hdr.magic, PBP_MAGIC_STR, 4);
@@ -130,10 +264,13 @@ static int write_pbp(const char *path,
       filesize[i] = 0;
       if (files->path[i] && getfilesize(files->path[i], &filesize[i]) != 0)
          ENDERRF(ERR_IO_GETFILESIZE, "Cannot get the file size (%s)\n", files->path[i]);
+      /* The header offsets are 32-bit, only the last entry may end past 4 GiB. */
+      if (pbpsize > 0xFFFFFFFFLL)
+         ENDERRF(ERR_FORMAT, "The entries before %s do not fit in a PBP (%s)\n", get_pbpentry_name(i), path);
       if (i == 0)
          SW(&hdr.file_offset[i], sizeof(ScePBPHeader));
       else
-         SW(&hdr.file_offset[i], hdr.file_offset[i-1] + filesize[i-1]);
+         SW(&hdr.file_offset[i], (u32)pbpsize);
       pbpsize += filesize[i];
    }
 
@@ -141,18 +278,19 @@ static int write_pbp(const char *path,
       ENDERRF(ERR_IO_WRITE, "Cannot write out the file header (%s)\n", path);
 
    /* Append file data. */
+   offset = sizeof(ScePBPHeader);
    for (i = 0; i < 8; ++i)
    {
       if (g_verbose)
       {
-         buf[0] = 0;
+         strname[0] = 0;
          if (files->path[i])
-            sprintf(buf, " (%s)", basename(files->path[i]));
+            snprintf(strname, sizeof(strname), " (%s)", basename(files->path[i]));
          if (human_size)
             format_file_size(strsize, sizeof(strsize), filesize[i], use_si_units, size_precision);
          else
-            sprintf(strsize, "%d B", filesize[i]);
-         printf("[%d] %-13s %13s%s\n", i+1, get_pbpentry_name(i), strsize, buf);
+            sprintf(strsize, "%lld B", filesize[i]);
+         printf("[%d] %-13s %13s%s\n", i+1, get_pbpentry_name(i), strsize, strname);
       }
       if (files->path[i] == NULL)
          continue;
@@ -160,15 +298,13 @@ static int write_pbp(const char *path,
       fp = fopen(files->path[i], "rb");
       if (fp == NULL)
          ENDERRF(ERR_IO_OPEN, "Cannot open the file (%s)\n", files->path[i]);
-      while (filesize[i] > 0)
-      {
-         readsize = filesize[i] >= READBUFSZ ? READBUFSZ : filesize[i];
-         if (readsize != fread(buf, 1, readsize, fp))
-            ENDERRF(ERR_IO_READ, "Cannot read in the file data (%s)\n", files->path[i]);
-         if (readsize != fwrite(buf, 1, readsize, fout))
-            ENDERRF(ERR_IO_WRITE, "Cannot write out the file data (%s)\n", path);
-         filesize[i] -= readsize;
-      }
+      ret = copy_file_data(fp, NULL, 0, fout, &offset, filesize[i], &buf);
+      if (ret == ERR_IO_READ)
+         ENDERRF(ret, "Cannot read in the file data (%s)\n", files->path[i]);
+      if (ret == ERR_MALLOC)
+         ENDERR(ret, "Cannot allocate the file read buffer\n");
+      if (ret != ERR_OK)
+         ENDERRF(ret, "Cannot write out the file data (%s)\n", path);
       fclose(fp);
       fp = NULL;
    }
@@ -178,7 +314,7 @@ static int write_pbp(const char *path,
       if (human_size)
          format_file_size(strsize, sizeof(strsize), pbpsize, use_si_units, size_precision);
       else
-         sprintf(strsize, "%lu bytes", pbpsize);
+         sprintf(strsize, "%lld bytes", pbpsize);
       printf("Created %s of %s\n", basename(path), strsize);
    }
 
@@ -198,14 +334,201 @@ end:
    return ret;
 }
 
+typedef struct {
+   FILE *fp; // The PBP, only its descriptor is used when map is set
+   const char *map;
+   long long offset;
+   long long size;
+   char path[1024];
+   int ret;
+} unpack_job_t;
+
+static void * unpack_entry(void *arg)
+{
+   unpack_job_t *job = (unpack_job_t *)arg;
+   FILE *fout;
+   long long offset = 0;
+   char *buf = NULL;
+   long pos;
+
+   if (strcmp(job->path, "-") == 0)
+   {
+      /* Appended to what is already there, when it is a file. */
+      fout = stdout;
+      pos = ftell(stdout);
+      offset = pos > 0 ? pos : 0;
+   }
+   else
+      fout = fopen(job->path, "wb");
+   if (fout == NULL)
+   {
+      job->ret = ERR_IO_OPEN;
+      return NULL;
+   }
+
+   job->ret = copy_file_data(job->fp, job->map, job->offset, fout, &offset, job->size, &buf);
+   free(buf);
+
+   if (0 != (fout == stdout ? fflush(fout) : fclose(fout)) && job->ret == ERR_OK)
+      job->ret = ERR_IO_CLOSE;
+   return NULL;
+}
+
+/*
+ * Extract the entries of a PBP, all of them into the directory outpath, or
+ * only the entry index into the file outpath. The PBP is mapped and the
+ * entries are written by one thread each, only the range of an entry is read.
+ */
+static int unpack_pbp(const char *path, 
+                      const char *outpath, 
+                      int entry, 
+                      int human_size, 
+                      int use_si_units, 
+                      int size_precision)
+{
+   int ret;
+   int i;
+   int njobs = 0;
+   long long offset[9];
+   long long pbpsize;
+   char strsize[32];
+   const char *name;
+   FILE *fp = NULL;
+   const char *map = NULL;
+   struct stat st;
+   ScePBPHeader hdr;
+   unpack_job_t jobs[8];
+#ifndef _WIN32
+   pthread_t threads[8];
+   int started[8];
+#endif
+
+   fp = fopen(path, "rb");
+   if (fp == NULL)
+      ENDERRF(ERR_IO_OPEN, "Cannot open the input file (%s)\n", path);
+   if (fstat(fileno(fp), &st) != 0)
+      ENDERRF(ERR_IO_STAT, "Cannot get the file size (%s)\n", path);
+   pbpsize = st.st_size;
+   if (pbpsize < (long long)sizeof(ScePBPHeader))
+      ENDERRF(ERR_FORMAT, "Not a PBP file (%s)\n", path);
+
+#ifndef _WIN32
+   map = mmap(NULL, pbpsize, PROT_READ, MAP_SHARED, fileno(fp), 0);
+   if (map == MAP_FAILED)
+      map = NULL;
+#endif
+   if (map != NULL)
+      memcpy(&hdr, map, sizeof(ScePBPHeader));
+   else if (1 != fread(&hdr, sizeof(ScePBPHeader), 1, fp))
+      ENDERRF(ERR_IO_READ, "Cannot read in the file header (%s)\n", path);
+
+   /* Sizes follow from the offsets, see ScePBPHeader. */
+   if (memcmp(hdr.magic, PBP_MAGIC_STR, 4) != 0)
+      ENDERRF(ERR_FORMAT, "Not a PBP file (%s)\n", path);
+   for (i = 0; i < 8; ++i)
+      offset[i] = LW(hdr.file_offset[i]);
+   offset[8] = pbpsize;
+   for (i = 0; i < 8; ++i)
+   {
+      if (offset[i] < (long long)sizeof(ScePBPHeader) || offset[i] > offset[i+1])
+         ENDERRF(ERR_FORMAT, "Invalid %s offset in the file header (%s)\n", get_pbpentry_name(i), path);
+   }
+
+   if (entry >= 0 && offset[entry+1] == offset[entry])
+      ENDERRF(ERR_FAIL, "There is no %s in the file (%s)\n", get_pbpentry_name(entry), path);
+
+   for (i = 0; i < 8; ++i)
+   {
+      unpack_job_t *job = &jobs[njobs];
+      if ((entry >= 0 && i != entry) || offset[i+1] == offset[i])
+         continue;
+
+      /* ICON1 is either a PMF movie or a PNG. */
+      name = pbpentry_filenames[i][0];
+      if (i == PBP_ICON1_PNG && map != NULL && offset[i+1] - offset[i] >= 4 && memcmp(map + offset[i], "\x89PNG", 4) == 0)
+         name = pbpentry_filenames[i][1];
+
+      job->fp = fp;
+      job->map = map;
+      job->offset = offset[i];
+      job->size = offset[i+1] - offset[i];
+      job->ret = ERR_OK;
+      if (entry >= 0)
+         snprintf(job->path, sizeof(job->path), "%s", outpath ? outpath : name);
+      else if (0 != build_file_path(job->path, sizeof(job->path), NULL, outpath ? outpath : ".", "%s", name))
+         ENDERRF(ERR_FAIL, "The output path is too long (%s)\n", outpath);
+      njobs++;
+
+      if (g_verbose && strcmp(job->path, "-") != 0)
+      {
+         if (human_size)
+            format_file_size(strsize, sizeof(strsize), job->size, use_si_units, size_precision);
+         else
+            sprintf(strsize, "%lld B", job->size);
+         printf("[%d] %-13s %13s (%s)\n", i+1, get_pbpentry_name(i), strsize, job->path);
+      }
+   }
+
+#ifndef _WIN32
+   /* The mapping is shared, the kernel copies each entry on its own. */
+   for (i = 0; i < njobs; ++i)
+      started[i] = map != NULL && njobs > 1 && pthread_create(&threads[i], NULL, unpack_entry, &jobs[i]) == 0;
+   for (i = 0; i < njobs; ++i)
+   {
+      if (started[i])
+         pthread_join(threads[i], NULL);
+   }
+#endif
+   for (i = 0; i < njobs; ++i)
+   {
+#ifndef _WIN32
+      if (started[i])
+         continue;
+#endif
+      if (map == NULL && 0 != fseek(fp, jobs[i].offset, SEEK_SET))
+         jobs[i].ret = ERR_IO_READ;
+      else
+         unpack_entry(&jobs[i]);
+   }
+
+   for (i = 0; i < njobs; ++i)
+   {
+      if (jobs[i].ret == ERR_IO_OPEN)
+         ENDERRF(jobs[i].ret, "Cannot open the output file (%s)\n", jobs[i].path);
+      if (jobs[i].ret == ERR_IO_READ)
+         ENDERRF(jobs[i].ret, "Cannot read in the file data (%s)\n", path);
+      if (jobs[i].ret == ERR_MALLOC)
+         ENDERR(jobs[i].ret, "Cannot allocate the file read buffer\n");
+      if (jobs[i].ret != ERR_OK)
+         ENDERRF(jobs[i].ret, "Cannot write out the file data (%s)\n", jobs[i].path);
+   }
+
+   if (g_verbose && entry < 0)
+      printf("Extracted %d entries of %s to %s\n", njobs, basename(path), outpath ? outpath : ".");
+
+   ret = ERR_OK;
+
+end:
+#ifndef _WIN32
+   if (map != NULL)
+      munmap((void *)map, pbpsize);
+#endif
+   if (fp != NULL)
+      fclose(fp);
+
+   return ret;
+}
+
 static void show_help(char *argv[])
 {
    const char *prog = basename(argv[0]);
    printf(
-      "Create a Sony PSP file archive, v%s by Linblow.\n"
+      "Create or extract a Sony PSP file archive, v%s by Linblow.\n"
       "Usage:\n"
       "  %s [options] [-o <output_pbp>] -1 <sfo>\n"
-      "  %s [options] <output_pbp> <sfo> [<icon0> <icon1> <pic0> <pic1> <snd0> <data> <psar>]\n\n"
+      "  %s [options] <output_pbp> <sfo> [<icon0> <icon1> <pic0> <pic1> <snd0> <data> <psar>]\n"
+      "  %s [options] -u [-o <output_dir>] <input_pbp>\n"
+      "  %s [options] -e <entry> [-o <output_file>] <input_pbp>\n\n"
       "Options:\n"
       "  -h --help               Show this screen\n"
       "  -v --verbose[=<level>]  Print result to stdout (unless -q was passed)\n"
@@ -216,7 +539,12 @@ static void show_help(char *argv[])
       "                          Pass off/no to disable [default: enabled with precision=2]\n"
       "     --si                 Use SI units (i.e. power of 10 instead of 2)\n\n"
       "  -o --out=<path>         Set output PBP file path [default: EBOOT.PBP]\n"
+      "                          With -u the output directory [default: .]\n"
+      "                          With -e the output file, - for stdout [default: the entry name]\n"
       "  -x --ver=<ver>          Set PBP header version: 1.0 (or 0), 1.1 (or 1) [default: 1.1]\n\n"
+      "  -u --unpack             Extract all the files of the input PBP\n"
+      "  -e --entry=<name>       Extract only this file of the input PBP, by name (e.g., PARAM.SFO),\n"
+      "                          option name (e.g., icon0) or number (1 to 8)\n\n"
       "  -1 --param=<path>       Set PARAM.SFO file path\n"
       "  -2 --icon0=<path>       Set ICON0.PNG file path\n"
       "  -3 --icon1=<path>       Set ICON1.PNG / ICON1.PMF file path\n"
@@ -225,7 +553,7 @@ static void show_help(char *argv[])
       "  -6 --snd0=<path>        Set SND0.AT3 file path\n"
       "  -7 --data=<path>        Set DATA.PSP file path\n"
       "  -8 --psar=<path>        Set DATA.PSAR file path\n"
-      , TOOL_VERSION, prog, prog
+      , TOOL_VERSION, prog, prog, prog, prog
    );
 }
 
@@ -237,6 +565,8 @@ typedef struct {
    int use_si_units;
    int size_precision; // -1 for default
    int pbp_version; // 0 for 1.0, 1 for 1.1
+   int unpack;
+   char *entry; // Single entry to unpack
    char *output_path;
    pbp_files_path files;
 } parsed_args_t;
@@ -267,6 +597,8 @@ static int parse_args(int argc, char *argv[], parsed_args_t *args)
       {"si",         no_argument, &args->use_si_units, 1},
       {"out",        required_argument, 0, 'o'},
       {"ver",        required_argument, 0, 'x'}, // PBP version in header
+      {"unpack",     no_argument,       0, 'u'},
+      {"entry",      required_argument, 0, 'e'},
       {"param",      required_argument, 0, '1'},
       {"icon0",      required_argument, 0, '2'},
       {"icon1",      required_argument, 0, '3'},
@@ -281,7 +613,7 @@ static int parse_args(int argc, char *argv[], parsed_args_t *args)
    int c;
    while (1)
    {
-      c = getopt_long(argc, argv, "hH::o:pqv::x:1:2:3:4:5:6:7:8:", opts, &optindex);
+      c = getopt_long(argc, argv, "e:hH::o:pqv::x:u1:2:3:4:5:6:7:8:", opts, &optindex);
       if (c == -1)
          break;
       switch (c)
@@ -302,6 +634,13 @@ static int parse_args(int argc, char *argv[], parsed_args_t *args)
          case 'o':
             args->output_path = optarg;
             break;
+         case 'u':
+            args->unpack = 1;
+            break;
+         case 'e':
+            args->unpack = 1;
+            args->entry = optarg;
+            break;
          case 'x':
             if (strcmp(optarg, "1.0") == 0 || strcmp(optarg, "0") == 0)
                args->pbp_version = 0;
@@ -338,7 +677,7 @@ int main(int argc, char *argv[])
    args.use_si_units = 0;
    args.size_precision = -1; // will use the default
    args.pbp_version = DEFAULT_PBP_VERSION;
-   args.output_path = DEFAULT_OUTPUT_PATH;
+   args.output_path = NULL; // The default depends on the mode
    
    if (0 != parse_args(argc, argv, &args) || args.help)
    {
@@ -354,6 +693,21 @@ int main(int argc, char *argv[])
    if (args.size_precision < 0)
       args.size_precision = DEFAULT_SIZE_PRECISION;
 
+   if (args.unpack)
+   {
+      // <input_pbp>
+      int entry = -1;
+      if (optind + 1 != argc)
+         ENDERR(ERR_FAIL, "A single input PBP file path is required\n");
+      if (args.entry && (entry = find_pbpentry(args.entry)) < 0)
+         ENDERRF(ERR_FAIL, "Unknown PBP file (%s)\n", args.entry);
+      if (args.output_path && strlen(args.output_path) == 0)
+         ENDERR(ERR_FAIL, "The specified output path is empty\n");
+      return unpack_pbp(argv[optind], args.output_path, entry, args.human_size, args.use_si_units, args.size_precision);
+   }
+   if (args.output_path == NULL)
+      args.output_path = DEFAULT_OUTPUT_PATH;
+
    /* Legacy pack-pbp arguments. */
    // <output_pbp> <sfo> [<icon0> <icon1> <pic0> <pic1> <snd0> <data> <psar>]
    for (i = 0; optind < argc && i < 9; ++i, ++optind)
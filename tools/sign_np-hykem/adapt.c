@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "adapt.h"
+
+// Blocks over the ratio limit in a row before storing raw, and how long.
+#define ADAPT_RAW_STREAK	4
+#define ADAPT_SKIP_MIN		8
+#define ADAPT_SKIP_MAX		64
+
+// Lead over the schedule, in percent of the whole run, needed to go up a level.
+#define ADAPT_MARGIN		2
+
+void adapt_init(ADAPT *a, long long total, int level_max, double time_budget, double min_mbps)
+{
+	memset(a, 0, sizeof(ADAPT));
+	a->start = get_time();
+	a->total = total;
+	a->time_budget = time_budget;
+	a->min_rate = min_mbps * 1024 * 1024;
+	a->level = level_max;
+	a->level_max = level_max;
+	a->skip_len = ADAPT_SKIP_MIN;
+}
+
+int adapt_level(ADAPT *a)
+{
+	return (a->skip > 0) ? 0 : a->level;
+}
+
+// Time allowed for the whole run and for the bytes done so far.
+static double adapt_schedule(ADAPT *a, long long bytes)
+{
+	double budget = a->time_budget;
+
+	if (a->min_rate > 0 && (budget == 0 || a->total / a->min_rate < budget))
+		budget = a->total / a->min_rate;
+
+	return (a->total > 0) ? budget * bytes / a->total : 0;
+}
+
+void adapt_update(ADAPT *a, int level, int size, int ratio, int ratio_limit)
+{
+	a->done += size;
+	if (level < 0 || size <= 0)
+		return;
+
+	a->blocks[level]++;
+
+	// Incompressible data comes in runs (audio, video), stop trying for a while.
+	if (a->skip > 0)
+		a->skip--;
+	else if (ratio >= ratio_limit)
+	{
+		if (++a->raw_streak >= ADAPT_RAW_STREAK)
+		{
+			a->skip = a->skip_len;
+			a->raw_streak = 0;
+			if (a->skip_len < ADAPT_SKIP_MAX)
+				a->skip_len *= 2;
+		}
+	}
+	else if (ratio >= 0)
+	{
+		a->raw_streak = 0;
+		a->skip_len = ADAPT_SKIP_MIN;
+	}
+
+	// One step at a time, behind or well ahead of the schedule.
+	double lead = adapt_schedule(a, a->done) - (get_time() - a->start);
+	if (lead < 0 && a->level > 0)
+		a->level--;
+	else if (lead > adapt_schedule(a, a->total) * ADAPT_MARGIN / 100)
+	{
+		// With time to spare, every block is worth a try.
+		if (a->level < a->level_max)
+			a->level++;
+		else
+			a->skip = 0;
+	}
+}
+
+double adapt_average(ADAPT *a)
+{
+	long long n = 0, sum = 0;
+	int i;
+
+	for (i = 0; i <= LZRC_LEVEL_MAX; i++)
+	{
+		n += a->blocks[i];
+		sum += a->blocks[i] * i;
+	}
+
+	return (n > 0) ? (double)sum / n : 0;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include "tlzrc.h"
+
+/*
+	Compression level controller of -pbp -c, to finish within a time budget
+	or above a minimum rate. The run is paced against a schedule (the time
+	by which the bytes done so far should have been done): the level goes
+	down a step while behind it and up a step once ahead by a margin.
+	Level 0 stores the block raw without compressing it.
+*/
+typedef struct {
+	double start;
+	double time_budget;			// Seconds, 0 for none.
+	double min_rate;			// Bytes per second, 0 for none.
+	long long total;			// Bytes to process.
+	long long done;
+	int level;
+	int level_max;				// Starting and highest level.
+	int raw_streak;				// Compressed blocks in a row over the ratio limit.
+	int skip;					// Blocks left to store raw before trying again.
+	int skip_len;
+	long long blocks[LZRC_LEVEL_MAX + 1];
+} ADAPT;
+
+void adapt_init(ADAPT *a, long long total, int level_max, double time_budget, double min_mbps);
+
+// Level of the next block, 0 to store it raw.
+int adapt_level(ADAPT *a);
+
+/*
+	Account a block of size bytes processed at level. ratio is its compressed size in
+	percent, or -1 when it was not compressed. Blocks served without
+	compressing (duplicates, cache hits) pass a level of -1.
+*/
+void adapt_update(ADAPT *a, int level, int size, int ratio, int ratio_limit);
+
+// Average level of the blocks, raw ones count as 0.
+double adapt_average(ADAPT *a);
+
+#endif
@@ -0,0 +1,397 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+// Micro benchmarks of the sign_np engines, and of the whole -pbp pipeline.
+
+#include <stdio.h>
+
+#include "../libkirk/kirk_engine.h"
+#include "../libkirk/amctrl.h"
+#include "../libkirk/aes.h"
+#include "../tlzrc.h"
+#include "synth.h"
+
+#define BLOCK_SIZE (32 * 1024)
+
+typedef struct {
+	char name[32];
+	const char *kind;
+	int level;
+	int basis;				// NPUMDIMG block basis, pipeline only.
+	long long bytes;		// Bytes processed per iteration.
+	long long iterations;
+	double seconds;
+	double ratio;			// Output / input size, compression only.
+} BENCH_RESULT;
+
+typedef struct {
+	double min_time;
+	BENCH_RESULT *results;
+	int count;
+	int max;
+} BENCH;
+
+typedef int (*bench_func)(void *arg);
+
+static BENCH_RESULT *bench_add(BENCH *b, const char *name, const char *kind, int level, long long bytes)
+{
+	if (b->count == b->max)
+	{
+		b->max = b->max ? b->max * 2 : 32;
+		b->results = (BENCH_RESULT *) realloc(b->results, b->max * sizeof(BENCH_RESULT));
+	}
+
+	BENCH_RESULT *r = &b->results[b->count++];
+	memset(r, 0, sizeof(BENCH_RESULT));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->kind = kind;
+	r->level = level;
+	r->bytes = bytes;
+	return r;
+}
+
+// Run func until min_time has elapsed (at least 3 times).
+static void bench_run(BENCH *b, BENCH_RESULT *r, bench_func func, void *arg)
+{
+	double start = get_time();
+	double now = start;
+
+	func(arg);  // Warm up.
+	start = get_time();
+	while (r->iterations < 3 || now - start < b->min_time)
+	{
+		func(arg);
+		r->iterations++;
+		now = get_time();
+	}
+	r->seconds = now - start;
+
+	fprintf(stderr, "%-16s %-7s L%-2d %8.2f MB/s %10.1f us/op\n", r->name, r->kind ? r->kind : "-", r->level,
+		r->bytes ? r->bytes * r->iterations / (1024.0 * 1024.0) / r->seconds : 0,
+		r->seconds * 1e6 / r->iterations);
+}
+
+typedef struct {
+	u8 *in;
+	u8 *out;
+	u8 *tmp;
+	int in_size;
+	int out_size;
+	int level;
+	AES_ctx aes;
+	u8 key[0x10];
+	u8 sig_in[0x34];
+	u8 verify_in[0x64];
+} BENCH_DATA;
+
+static int run_lzrc_compress(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	d->out_size = lzrc_compress_level(d->out, BLOCK_SIZE * 2, d->in, BLOCK_SIZE, d->level);
+	return 0;
+}
+
+static int run_lzrc_decompress(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	return lzrc_decompress(d->tmp, BLOCK_SIZE, d->out, d->out_size);
+}
+
+static int run_aes_cbc_encrypt(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	AES_cbc_encrypt(&d->aes, d->in, d->tmp, BLOCK_SIZE);
+	return 0;
+}
+
+static int run_aes_cbc_decrypt(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	AES_cbc_decrypt(&d->aes, d->in, d->tmp, BLOCK_SIZE);
+	return 0;
+}
+
+static int run_aes_cmac(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	AES_CMAC(&d->aes, d->in, BLOCK_SIZE, d->tmp);
+	return 0;
+}
+
+static int run_bbcipher(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	CIPHER_KEY ckey;
+
+	sceDrmBBCipherInit(&ckey, 1, 2, d->key, d->key, 0x100);
+	sceDrmBBCipherUpdate(&ckey, d->tmp, BLOCK_SIZE);
+	return sceDrmBBCipherFinal(&ckey);
+}
+
+static int run_bbmac(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	MAC_KEY mkey;
+	u8 mac[0x10];
+
+	sceDrmBBMacInit(&mkey, 3);
+	sceDrmBBMacUpdate(&mkey, d->in, BLOCK_SIZE);
+	return sceDrmBBMacFinal(&mkey, mac, d->key);
+}
+
+static int run_ecdsa_sign(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	return sceUtilsBufferCopyWithRange(d->verify_in + 0x3C, 0x28, d->sig_in, 0x34, KIRK_CMD_ECDSA_SIGN);
+}
+
+static int run_ecdsa_verify(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	return sceUtilsBufferCopyWithRange(0, 0, d->verify_in, 0x64, KIRK_CMD_ECDSA_VERIFY);
+}
+
+static int run_prng(void *arg)
+{
+	BENCH_DATA *d = (BENCH_DATA *) arg;
+	return sceUtilsBufferCopyWithRange(d->tmp, 0x30, 0, 0, KIRK_CMD_PRNG);
+}
+
+typedef struct {
+	const char *cmd;
+} BENCH_PIPELINE;
+
+static int run_pipeline(void *arg)
+{
+	BENCH_PIPELINE *p = (BENCH_PIPELINE *) arg;
+	return system(p->cmd);
+}
+
+static void bench_engines(BENCH *b)
+{
+	BENCH_DATA d;
+	SYNTH_RNG rng;
+	BENCH_RESULT *r;
+	int kind;
+
+	memset(&d, 0, sizeof(d));
+	d.in = (u8 *) malloc(BLOCK_SIZE);
+	d.out = (u8 *) malloc(BLOCK_SIZE * 2);
+	d.tmp = (u8 *) calloc(1, BLOCK_SIZE * 2);
+	synth_seed(&rng, 1);
+
+	// Compression, one block of each kind.
+	for (kind = 0; kind < SYNTH_KINDS; kind++)
+	{
+		synth_fill(&rng, d.in, BLOCK_SIZE, kind);
+
+		d.level = LZRC_LEVEL_OPTIMAL;
+		r = bench_add(b, "lzrc_compress", synth_kind_names[kind], d.level, BLOCK_SIZE);
+		bench_run(b, r, run_lzrc_compress, &d);
+		r->ratio = (double)d.out_size / BLOCK_SIZE;
+
+		// The default level last, its output is decompressed below.
+		d.level = LZRC_LEVEL_DEFAULT;
+		r = bench_add(b, "lzrc_compress", synth_kind_names[kind], d.level, BLOCK_SIZE);
+		bench_run(b, r, run_lzrc_compress, &d);
+		r->ratio = (double)d.out_size / BLOCK_SIZE;
+
+		r = bench_add(b, "lzrc_decompress", synth_kind_names[kind], LZRC_LEVEL_DEFAULT, BLOCK_SIZE);
+		bench_run(b, r, run_lzrc_decompress, &d);
+		r->ratio = (double)d.out_size / BLOCK_SIZE;
+	}
+
+	// Crypto, on random data.
+	synth_fill(&rng, d.in, BLOCK_SIZE, SYNTH_RANDOM);
+	synth_fill(&rng, d.key, 0x10, SYNTH_RANDOM);
+	AES_set_key(&d.aes, d.key, 128);
+
+	bench_run(b, bench_add(b, "aes_cbc_encrypt", NULL, 0, BLOCK_SIZE), run_aes_cbc_encrypt, &d);
+	bench_run(b, bench_add(b, "aes_cbc_decrypt", NULL, 0, BLOCK_SIZE), run_aes_cbc_decrypt, &d);
+	bench_run(b, bench_add(b, "aes_cmac", NULL, 0, BLOCK_SIZE), run_aes_cmac, &d);
+	bench_run(b, bench_add(b, "bbcipher", NULL, 0, BLOCK_SIZE), run_bbcipher, &d);
+	bench_run(b, bench_add(b, "bbmac", NULL, 0, BLOCK_SIZE), run_bbmac, &d);
+
+	// ECDSA with a fresh key pair, the private key encrypted as KIRK expects it.
+	u8 keypair[0x3C];
+	sceUtilsBufferCopyWithRange(keypair, 0x3C, 0, 0, KIRK_CMD_ECDSA_GEN_KEYS);
+	encrypt_kirk16_private(d.sig_in, keypair);
+	synth_fill(&rng, d.sig_in + 0x20, 0x14, SYNTH_RANDOM);
+	memcpy(d.verify_in, keypair + 0x14, 0x28);
+	memcpy(d.verify_in + 0x28, d.sig_in + 0x20, 0x14);
+
+	bench_run(b, bench_add(b, "ecdsa_sign", NULL, 0, 0), run_ecdsa_sign, &d);
+	bench_run(b, bench_add(b, "ecdsa_verify", NULL, 0, 0), run_ecdsa_verify, &d);
+
+	// Random bytes as drawn for a PGD header.
+	bench_run(b, bench_add(b, "prng", NULL, 0, 0x30), run_prng, &d);
+
+	free(d.in);
+	free(d.out);
+	free(d.tmp);
+}
+
+static void bench_pipeline(BENCH *b, const char *sign_np, const char *iso, const char *basis_list)
+{
+	char cmd[1024];
+	BENCH_PIPELINE p;
+	FILE *f;
+	const char *bl;
+	int compress;
+
+	f = fopen(iso, "rb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot open %s\n", iso);
+		return;
+	}
+	fseek(f, 0, SEEK_END);
+	long long size = ftell(f);
+	fclose(f);
+
+	// Each block basis, raw then compressed: larger blocks compress better and shrink the table.
+	for (bl = basis_list; *bl; bl++)
+	{
+		char *end;
+		int basis = strtol(bl, &end, 0);
+		if (end == bl)
+			break;
+
+		for (compress = 0; compress < 2; compress++)
+		{
+			snprintf(cmd, sizeof(cmd), "\"%s\" -pbp %s --block-basis %d \"%s\" bench_out.pbp UP9000-NPUZ99999_00-0000000000000000 0 > bench_out.log",
+				sign_np, compress ? "-c" : "", basis, iso);
+			p.cmd = cmd;
+
+			BENCH_RESULT *r = bench_add(b, compress ? "pbp_compressed" : "pbp", NULL, compress ? LZRC_LEVEL_DEFAULT : 0, size);
+			r->basis = basis;
+			bench_run(b, r, run_pipeline, &p);
+
+			f = fopen("bench_out.pbp", "rb");
+			if (f != NULL)
+			{
+				fseek(f, 0, SEEK_END);
+				r->ratio = (double)ftell(f) / size;
+				fclose(f);
+			}
+		}
+
+		bl = end;
+		if (*bl != ',')
+			break;
+	}
+
+	remove("bench_out.pbp");
+	remove("bench_out.log");
+}
+
+static void write_csv(BENCH *b, FILE *f)
+{
+	int i;
+
+	fprintf(f, "benchmark,kind,level,block_basis,bytes,iterations,seconds,mb_per_s,us_per_op,ratio\n");
+	for (i = 0; i < b->count; i++)
+	{
+		BENCH_RESULT *r = &b->results[i];
+		fprintf(f, "%s,%s,%d,%d,%lld,%lld,%.6f,%.3f,%.3f,%.4f\n", r->name, r->kind ? r->kind : "", r->level,
+			r->basis, r->bytes, r->iterations, r->seconds,
+			r->bytes ? r->bytes * r->iterations / (1024.0 * 1024.0) / r->seconds : 0,
+			r->seconds * 1e6 / r->iterations, r->ratio);
+	}
+}
+
+static void write_json(BENCH *b, FILE *f)
+{
+	int i;
+
+	fprintf(f, "[\n");
+	for (i = 0; i < b->count; i++)
+	{
+		BENCH_RESULT *r = &b->results[i];
+		fprintf(f, "  {\"benchmark\":\"%s\",\"kind\":\"%s\",\"level\":%d,\"block_basis\":%d,\"bytes\":%lld,\"iterations\":%lld,"
+			"\"seconds\":%.6f,\"mb_per_s\":%.3f,\"us_per_op\":%.3f,\"ratio\":%.4f}%s\n",
+			r->name, r->kind ? r->kind : "", r->level, r->basis, r->bytes, r->iterations, r->seconds,
+			r->bytes ? r->bytes * r->iterations / (1024.0 * 1024.0) / r->seconds : 0,
+			r->seconds * 1e6 / r->iterations, r->ratio, (i < b->count - 1) ? "," : "");
+	}
+	fprintf(f, "]\n");
+}
+
+static void print_usage(void)
+{
+	printf("Usage: sign-np-bench [-t <seconds>] [--csv <file>] [--json <file>] [--pbp <psp-sign-np> <iso> [--basis <list>]]\n"
+	       "[-t <seconds>]: Minimum time of each benchmark (default: 0.5)\n"
+	       "[--csv <file>]: Write the results as CSV (default: stdout)\n"
+	       "[--json <file>]: Write the results as JSON\n"
+	       "[--pbp <psp-sign-np> <iso>]: Also time the whole -pbp pipeline on this ISO\n"
+	       "[--basis <list>]: Block basis values of the pipeline runs, eg. 0x8,0x10,0x20 (default: 0x10)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *csv_name = NULL;
+	const char *json_name = NULL;
+	const char *sign_np = NULL;
+	const char *iso = NULL;
+	const char *basis_list = "0x10";
+	BENCH b;
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	b.min_time = 0.5;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			b.min_time = strtod(argv[++i], NULL);
+		else if (!strcmp(argv[i], "--csv") && i + 1 < argc)
+			csv_name = argv[++i];
+		else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+			json_name = argv[++i];
+		else if (!strcmp(argv[i], "--pbp") && i + 2 < argc)
+		{
+			sign_np = argv[++i];
+			iso = argv[++i];
+		}
+		else if (!strcmp(argv[i], "--basis") && i + 1 < argc)
+			basis_list = argv[++i];
+		else
+		{
+			print_usage();
+			return 1;
+		}
+	}
+
+	kirk_init();
+
+	bench_engines(&b);
+	if (sign_np)
+		bench_pipeline(&b, sign_np, iso, basis_list);
+
+	if (csv_name || !json_name)
+	{
+		FILE *f = csv_name ? fopen(csv_name, "w") : stdout;
+		if (f == NULL)
+		{
+			fprintf(stderr, "ERROR: Cannot create %s\n", csv_name);
+			return 1;
+		}
+		write_csv(&b, f);
+		if (f != stdout)
+			fclose(f);
+	}
+
+	if (json_name)
+	{
+		FILE *f = fopen(json_name, "w");
+		if (f == NULL)
+		{
+			fprintf(stderr, "ERROR: Cannot create %s\n", json_name);
+			return 1;
+		}
+		write_json(&b, f);
+		fclose(f);
+	}
+
+	free(b.results);
+	return 0;
+}
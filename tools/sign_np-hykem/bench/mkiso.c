@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+// Deterministic synthetic PSP ISO images, to benchmark the -pbp pipeline.
+
+#include <stdio.h>
+
+#include "synth.h"
+
+#define SECTOR 2048
+
+// Layout: 16 system sectors, PVD, terminator, root, PSP_GAME, then the files.
+#define LBA_PVD		16
+#define LBA_TERM	17
+#define LBA_ROOT	18
+#define LBA_GAME	19
+#define LBA_FILES	20
+
+typedef struct {
+	const char *name;
+	u8 *data;
+	int size;
+	u32 lba;
+} MKISO_FILE;
+
+static void put_both32(u8 *p, u32 v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+	p[4] = v >> 24; p[5] = v >> 16; p[6] = v >> 8; p[7] = v;
+}
+
+static void put_both16(u8 *p, u16 v)
+{
+	p[0] = v; p[1] = v >> 8;
+	p[2] = v >> 8; p[3] = v;
+}
+
+// Directory record with an XA system use area, as on UMD images.
+static int dir_record(u8 *p, const char *name, int name_len, u32 lba, u32 size, int dir)
+{
+	int len = 33 + name_len + 14;
+	len += len & 1;
+
+	memset(p, 0, len);
+	p[0] = len;
+	put_both32(p + 2, lba);
+	put_both32(p + 10, size);
+	p[25] = dir ? 2 : 0;
+	put_both16(p + 28, 1);
+	p[32] = name_len;
+	memcpy(p + 33, name, name_len);
+
+	return len;
+}
+
+static int sfo_entry(u8 *buf, int *count, int *key_off, int *val_off, const char *key, const char *str)
+{
+	u8 *ent = buf + 0x14 + *count * 0x10;
+	int len = str ? (int)strlen(str) + 1 : 4;
+	int max = str ? (len + 15) & ~15 : 4;
+
+	*(u16 *)(ent + 0) = *key_off;
+	ent[2] = 4;
+	ent[3] = str ? 2 : 4;
+	*(u32 *)(ent + 4) = len;
+	*(u32 *)(ent + 8) = max;
+	*(u32 *)(ent + 12) = *val_off;
+
+	(*count)++;
+	*key_off += strlen(key) + 1;
+	*val_off += max;
+
+	return max;
+}
+
+// Minimal PARAM.SFO, with the keys read by sign_np.
+static u8 *build_sfo(int *size)
+{
+	static const char *keys[] = {"CATEGORY", "DISC_ID", "PSP_SYSTEM_VER", "TITLE"};
+	static const char *vals[] = {"UG", "ULUS99999", "6.20", "Synthetic benchmark image"};
+	int count = 0, key_off = 0, val_off = 0;
+	int i, key_base, val_base;
+	u8 *buf = (u8 *) calloc(1, 0x400);
+
+	for (i = 0; i < 4; i++)
+		sfo_entry(buf, &count, &key_off, &val_off, keys[i], vals[i]);
+
+	key_base = 0x14 + count * 0x10;
+	val_base = (key_base + key_off + 3) & ~3;
+
+	*(u32 *)(buf + 0) = 0x46535000;
+	*(u32 *)(buf + 4) = 0x101;
+	*(u32 *)(buf + 8) = key_base;
+	*(u32 *)(buf + 12) = val_base;
+	*(u32 *)(buf + 16) = count;
+
+	for (i = 0, key_off = 0; i < 4; i++)
+	{
+		u8 *ent = buf + 0x14 + i * 0x10;
+		strcpy((char *)buf + key_base + key_off, keys[i]);
+		key_off += strlen(keys[i]) + 1;
+		strcpy((char *)buf + val_base + *(u32 *)(ent + 12), vals[i]);
+	}
+
+	*size = val_base + val_off;
+	return buf;
+}
+
+static void print_usage(void)
+{
+	printf("Usage: sign-np-mkiso [-s <MB>] [-r <seed>] [-m <mix>] <output>\n"
+	       "[-s <MB>]: Image size (default: 64)\n"
+	       "[-r <seed>]: Generator seed, the same seed gives the same image (default: 1)\n"
+	       "[-m <mix>]: Weights of the data kinds (default: zeros=1,text=2,media=4,random=1)\n"
+	       "<output>: Resulting ISO file\n");
+}
+
+int main(int argc, char *argv[])
+{
+	SYNTH_MIX mix;
+	SYNTH_RNG rng;
+	long long size = 64LL * 1024 * 1024;
+	u64 seed = 1;
+	int i;
+
+	synth_parse_mix(&mix, "zeros=1,text=2,media=4,random=1");
+
+	for (i = 1; i < argc - 1; i++)
+	{
+		if (!strcmp(argv[i], "-s") && i + 1 < argc - 1)
+			size = strtoll(argv[++i], NULL, 10) * 1024 * 1024;
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc - 1)
+			seed = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc - 1)
+		{
+			if (synth_parse_mix(&mix, argv[++i]) != 0)
+			{
+				fprintf(stderr, "ERROR: Invalid mix %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else
+			break;
+	}
+
+	if (i != argc - 1)
+	{
+		print_usage();
+		return 1;
+	}
+
+	FILE *f = fopen(argv[argc - 1], "wb");
+	if (f == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot create %s\n", argv[argc - 1]);
+		return 1;
+	}
+
+	synth_seed(&rng, seed);
+
+	// Small files first, DATA.BIN fills the rest of the image with the mix.
+	MKISO_FILE files[4];
+	files[0].name = "DATA.BIN";
+	files[1].name = "EBOOT.BIN";
+	files[1].size = 256 * 1024;
+	files[1].data = (u8 *) malloc(files[1].size);
+	synth_fill(&rng, files[1].data, files[1].size, SYNTH_RANDOM);
+	files[2].name = "ICON0.PNG";
+	files[2].size = 12 * 1024;
+	files[2].data = (u8 *) malloc(files[2].size);
+	synth_fill(&rng, files[2].data, files[2].size, SYNTH_MEDIA);
+	memcpy(files[2].data, "\x89PNG", 4);
+	files[3].name = "PARAM.SFO";
+	files[3].data = build_sfo(&files[3].size);
+
+	u32 lba = LBA_FILES;
+	for (i = 1; i < 4; i++)
+	{
+		files[i].lba = lba;
+		lba += (files[i].size + SECTOR - 1) / SECTOR;
+	}
+	u32 total = size / SECTOR;
+	if (total < lba + 1)
+		total = lba + 1;
+	files[0].lba = lba;
+	files[0].size = (total - lba) * SECTOR;
+	files[0].data = NULL;
+
+	u8 sector[SECTOR];
+	int pos;
+
+	// System area.
+	memset(sector, 0, SECTOR);
+	for (i = 0; i < LBA_PVD; i++)
+		fwrite(sector, SECTOR, 1, f);
+
+	// Primary volume descriptor.
+	sector[0] = 1;
+	memcpy(sector + 1, "CD001", 5);
+	sector[6] = 1;
+	memset(sector + 8, ' ', 64);
+	memcpy(sector + 40, "SYNTHETIC", 9);
+	put_both32(sector + 80, total);
+	put_both16(sector + 120, 1);
+	put_both16(sector + 124, 1);
+	put_both16(sector + 128, SECTOR);
+	dir_record(sector + 156, "\0", 1, LBA_ROOT, SECTOR, 1);
+	sector[156] = 34;
+	sector[881] = 1;
+	fwrite(sector, SECTOR, 1, f);
+
+	// Terminator.
+	memset(sector, 0, SECTOR);
+	sector[0] = 255;
+	memcpy(sector + 1, "CD001", 5);
+	sector[6] = 1;
+	fwrite(sector, SECTOR, 1, f);
+
+	// Root directory.
+	memset(sector, 0, SECTOR);
+	pos = dir_record(sector, "\0", 1, LBA_ROOT, SECTOR, 1);
+	pos += dir_record(sector + pos, "\1", 1, LBA_ROOT, SECTOR, 1);
+	dir_record(sector + pos, "PSP_GAME", 8, LBA_GAME, SECTOR, 1);
+	fwrite(sector, SECTOR, 1, f);
+
+	// PSP_GAME directory.
+	memset(sector, 0, SECTOR);
+	pos = dir_record(sector, "\0", 1, LBA_GAME, SECTOR, 1);
+	pos += dir_record(sector + pos, "\1", 1, LBA_ROOT, SECTOR, 1);
+	for (i = 0; i < 4; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%s;1", files[i].name);
+		pos += dir_record(sector + pos, name, strlen(name), files[i].lba, files[i].size, 0);
+	}
+	fwrite(sector, SECTOR, 1, f);
+
+	for (i = 1; i < 4; i++)
+	{
+		int padded = ((files[i].size + SECTOR - 1) / SECTOR) * SECTOR;
+		u8 *buf = (u8 *) calloc(1, padded);
+		memcpy(buf, files[i].data, files[i].size);
+		fwrite(buf, padded, 1, f);
+		free(buf);
+		free(files[i].data);
+	}
+
+	// DATA.BIN, runs of 32 KiB to 2 MiB of the same kind.
+	u8 *chunk = (u8 *) malloc(2 * 1024 * 1024);
+	long long left = files[0].size;
+	long long counts[SYNTH_KINDS];
+	memset(counts, 0, sizeof(counts));
+	while (left > 0)
+	{
+		int kind = synth_pick(&rng, &mix);
+		int len = (int)(((synth_next(&rng) % 64) + 1) * 32 * 1024);
+		if (len > left)
+			len = (int)left;
+
+		synth_fill(&rng, chunk, len, kind);
+		fwrite(chunk, len, 1, f);
+		counts[kind] += len;
+		left -= len;
+	}
+	free(chunk);
+
+	if (fclose(f) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot write %s\n", argv[argc - 1]);
+		return 1;
+	}
+
+	printf("%s: %u sectors", argv[argc - 1], total);
+	for (i = 0; i < SYNTH_KINDS; i++)
+		printf(", %s %.1f MB", synth_kind_names[i], counts[i] / (1024.0 * 1024.0));
+	printf("\n");
+
+	return 0;
+}
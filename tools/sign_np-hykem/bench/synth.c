@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <stdio.h>
+
+#include "synth.h"
+
+const char *synth_kind_names[SYNTH_KINDS] = {"zeros", "text", "media", "random"};
+
+static const char *synth_words[] = {
+	"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with",
+	"be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which",
+	"but", "have", "an", "had", "they", "you", "were", "their", "one", "all", "we",
+	"stage", "player", "enemy", "item", "save", "load", "menu", "option", "sound",
+	"texture", "model", "level", "score", "time", "world", "quest", "battle", "<node",
+	"id=\"", "\"/>", "0x00", "1.0", "true", "false", "\r\n",
+};
+
+void synth_seed(SYNTH_RNG *rng, u64 seed)
+{
+	rng->s = seed * 0x9E3779B97F4A7C15ULL + 0x2545F4914F6CDD1DULL;
+	if (rng->s == 0)
+		rng->s = 1;
+}
+
+u64 synth_next(SYNTH_RNG *rng)
+{
+	rng->s ^= rng->s >> 12;
+	rng->s ^= rng->s << 25;
+	rng->s ^= rng->s >> 27;
+	return rng->s * 0x2545F4914F6CDD1DULL;
+}
+
+static void synth_random(SYNTH_RNG *rng, u8 *buf, int size)
+{
+	int i;
+
+	for (i = 0; i + 8 <= size; i += 8)
+	{
+		u64 r = synth_next(rng);
+		memcpy(buf + i, &r, 8);
+	}
+	for (; i < size; i++)
+		buf[i] = (u8)synth_next(rng);
+}
+
+static void synth_text(SYNTH_RNG *rng, u8 *buf, int size)
+{
+	int n = sizeof(synth_words) / sizeof(synth_words[0]);
+	int i = 0;
+
+	while (i < size)
+	{
+		u64 r = synth_next(rng);
+		const char *w = synth_words[(r >> 8) % n];
+		int len = strlen(w);
+
+		if (len > size - i)
+			len = size - i;
+		memcpy(buf + i, w, len);
+		i += len;
+
+		if (i < size)
+			buf[i++] = ((r & 0xF) == 0) ? '\n' : ' ';
+	}
+}
+
+// 2 KiB packets: a fixed start code and header, a counter, then payload with short runs.
+static void synth_media(SYNTH_RNG *rng, u8 *buf, int size)
+{
+	int i;
+
+	synth_random(rng, buf, size);
+	for (i = 0; i < size; i += 2048)
+	{
+		static const u8 pack[14] = {0x00, 0x00, 0x01, 0xBA, 0x44, 0x00, 0x04, 0x00, 0x04, 0x01, 0x01, 0x89, 0xC3, 0xF8};
+		int len = (size - i < 14) ? size - i : 14;
+		memcpy(buf + i, pack, len);
+		if (size - i >= 18)
+		{
+			u32 counter = i / 2048;
+			memcpy(buf + i + 14, &counter, 4);
+		}
+
+		// Padding at the end of some packets.
+		u64 r = synth_next(rng);
+		if ((r & 3) == 0)
+		{
+			int pad = (r >> 8) % 256;
+			int end = (i + 2048 < size) ? i + 2048 : size;
+			if (end - pad > i + 18)
+				memset(buf + end - pad, 0xFF, pad);
+		}
+	}
+}
+
+void synth_fill(SYNTH_RNG *rng, u8 *buf, int size, int kind)
+{
+	switch (kind)
+	{
+	case SYNTH_ZEROS:
+		memset(buf, 0, size);
+		break;
+	case SYNTH_TEXT:
+		synth_text(rng, buf, size);
+		break;
+	case SYNTH_MEDIA:
+		synth_media(rng, buf, size);
+		break;
+	default:
+		synth_random(rng, buf, size);
+		break;
+	}
+}
+
+int synth_pick(SYNTH_RNG *rng, const SYNTH_MIX *mix)
+{
+	int total = 0;
+	int i, r;
+
+	for (i = 0; i < SYNTH_KINDS; i++)
+		total += mix->weight[i];
+	if (total <= 0)
+		return SYNTH_RANDOM;
+
+	r = synth_next(rng) % total;
+	for (i = 0; i < SYNTH_KINDS; i++)
+	{
+		if (r < mix->weight[i])
+			return i;
+		r -= mix->weight[i];
+	}
+
+	return SYNTH_RANDOM;
+}
+
+int synth_parse_mix(SYNTH_MIX *mix, const char *str)
+{
+	char name[16];
+	int weight, n, i;
+
+	memset(mix, 0, sizeof(SYNTH_MIX));
+	while (*str)
+	{
+		if (sscanf(str, "%15[a-z]=%d%n", name, &weight, &n) != 2 || weight < 0)
+			return -1;
+
+		for (i = 0; i < SYNTH_KINDS; i++)
+		{
+			if (!strcmp(name, synth_kind_names[i]))
+				break;
+		}
+		if (i == SYNTH_KINDS)
+			return -1;
+
+		mix->weight[i] = weight;
+		str += n;
+		if (*str == ',')
+			str++;
+		else if (*str)
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "../utils.h"
+
+// Kinds of synthetic data, from the most to the least compressible.
+enum {
+	SYNTH_ZEROS,
+	SYNTH_TEXT,
+	SYNTH_MEDIA,	// Packetized, mostly high entropy payload (PMF/AT3 like).
+	SYNTH_RANDOM,
+	SYNTH_KINDS
+};
+
+// Relative weight of each kind in a mix.
+typedef struct {
+	int weight[SYNTH_KINDS];
+} SYNTH_MIX;
+
+extern const char *synth_kind_names[SYNTH_KINDS];
+
+// Deterministic generator state (xorshift64*), never 0.
+typedef struct {
+	u64 s;
+} SYNTH_RNG;
+
+void synth_seed(SYNTH_RNG *rng, u64 seed);
+u64 synth_next(SYNTH_RNG *rng);
+
+// Fill buf with size bytes of the given kind.
+void synth_fill(SYNTH_RNG *rng, u8 *buf, int size, int kind);
+
+// Pick a kind from the mix.
+int synth_pick(SYNTH_RNG *rng, const SYNTH_MIX *mix);
+
+/*
+	Parse a mix like "zeros=1,text=2,media=4,random=1" (missing kinds get 0).
+	Returns 0 on success.
+*/
+int synth_parse_mix(SYNTH_MIX *mix, const char *str);
+
+#endif
@@ -0,0 +1,348 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <stdio.h>
+#include <zlib.h>
+
+#include "libkirk/sha1.h"
+#include "blkcache.h"
+#include "tlzrc.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+	File layout (native endian):
+	  header   : BLKCACHE_HEADER, padded to BLKCACHE_HEADER_SIZE
+	  segments : nsegs * BLKCACHE_SEGMENT
+	  entries  : nsets * BLKCACHE_WAYS * BLKCACHE_ENTRY
+	  data     : nsegs * BLKCACHE_SEG_SIZE
+
+	Compressed blocks are appended to the current segment. When it is full,
+	the least recently used segment is recycled: bumping its generation
+	drops every entry that points into it. A hit marks the segment of the
+	block as used.
+*/
+#define BLKCACHE_MAGIC			0x434B4C42	// BLKC
+#define BLKCACHE_VERSION		1
+#define BLKCACHE_HEADER_SIZE	0x1000
+#define BLKCACHE_SEG_SIZE		0x100000
+#define BLKCACHE_WAYS			8
+#define BLKCACHE_MIN_SEGS		4
+
+// Expected average size of a cached block, to size the entry sets.
+#define BLKCACHE_AVG_ENTRY		0x800
+
+#define BLKCACHE_VALID	1
+#define BLKCACHE_RAW	2
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 nsegs;
+	u32 nsets;
+	u32 cur_seg;
+	u32 cur_off;
+	u64 clock;
+} BLKCACHE_HEADER;
+
+typedef struct {
+	u64 last_used;
+	u32 gen;
+	u32 pad;
+} BLKCACHE_SEGMENT;
+
+typedef struct {
+	BLKCACHE_KEY key;
+	u32 flags;
+	u32 seg;
+	u32 gen;
+	u32 off;
+	u32 len;
+	u32 crc;
+} BLKCACHE_ENTRY;
+
+struct blkcache {
+	int fd;
+	u8 *base;
+	size_t size;
+	BLKCACHE_HEADER *header;
+	BLKCACHE_SEGMENT *segs;
+	BLKCACHE_ENTRY *entries;
+	u8 *data;
+	long long hits;
+	long long misses;
+};
+
+static size_t blkcache_file_size(u32 nsegs, u32 nsets)
+{
+	return BLKCACHE_HEADER_SIZE + (size_t)nsegs * sizeof(BLKCACHE_SEGMENT) +
+		(size_t)nsets * BLKCACHE_WAYS * sizeof(BLKCACHE_ENTRY) + (size_t)nsegs * BLKCACHE_SEG_SIZE;
+}
+
+void blkcache_key(BLKCACHE_KEY *key, u8 *data, int size, int level)
+{
+	SHA_CTX sha;
+	u8 rev[4] = {LZRC_ENCODER_REV & 0xFF, (LZRC_ENCODER_REV >> 8) & 0xFF, (LZRC_ENCODER_REV >> 16) & 0xFF, LZRC_ENCODER_REV >> 24};
+
+	// Blocks of another encoder revision get other keys.
+	SHAInit(&sha);
+	SHAUpdate(&sha, rev, sizeof(rev));
+	SHAUpdate(&sha, data, size);
+	SHAFinal(key->hash, &sha);
+	key->size = size;
+	key->level = level;
+}
+
+#ifndef _WIN32
+
+BLKCACHE *blkcache_open(const char *path, long long size)
+{
+	BLKCACHE *c;
+	struct stat st;
+	u32 nsegs, nsets;
+
+	// Round the geometry, the entry sets are a power of 2.
+	nsegs = (u32)(size / BLKCACHE_SEG_SIZE);
+	if (nsegs < BLKCACHE_MIN_SEGS)
+		nsegs = BLKCACHE_MIN_SEGS;
+	for (nsets = 1; (u64)nsets * BLKCACHE_WAYS * BLKCACHE_AVG_ENTRY < (u64)nsegs * BLKCACHE_SEG_SIZE; nsets <<= 1)
+		;
+
+	c = (BLKCACHE *) calloc(1, sizeof(BLKCACHE));
+	if (c == NULL)
+		return NULL;
+
+	c->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (c->fd < 0)
+	{
+		fprintf(stderr, "Warning: Cannot open block cache %s\n", path);
+		free(c);
+		return NULL;
+	}
+
+	// A single process updates the cache at a time.
+	if (flock(c->fd, LOCK_EX | LOCK_NB) != 0)
+	{
+		fprintf(stderr, "Warning: Block cache %s is in use, running without it\n", path);
+		close(c->fd);
+		free(c);
+		return NULL;
+	}
+
+	// Only an empty file or a block cache is ever reinitialised, never a file passed by mistake.
+	u32 magic = 0;
+	if (fstat(c->fd, &st) != 0 || (st.st_size != 0 &&
+		(read_at(c->fd, &magic, sizeof(magic), 0) != 0 || magic != BLKCACHE_MAGIC)))
+	{
+		fprintf(stderr, "Warning: %s is not a block cache, running without it\n", path);
+		close(c->fd);
+		free(c);
+		return NULL;
+	}
+
+	c->size = blkcache_file_size(nsegs, nsets);
+	if ((size_t)st.st_size != c->size)
+	{
+		// New cache, or a different size: start from an empty one.
+		if (ftruncate(c->fd, 0) != 0 || ftruncate(c->fd, c->size) != 0)
+			goto fail;
+	}
+
+	c->base = (u8 *) mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (c->base == MAP_FAILED)
+	{
+		c->base = NULL;
+		goto fail;
+	}
+
+	c->header = (BLKCACHE_HEADER *) c->base;
+	c->segs = (BLKCACHE_SEGMENT *) (c->base + BLKCACHE_HEADER_SIZE);
+	c->entries = (BLKCACHE_ENTRY *) (c->segs + nsegs);
+	c->data = (u8 *) (c->entries + (size_t)nsets * BLKCACHE_WAYS);
+
+	if (c->header->magic != BLKCACHE_MAGIC || c->header->version != BLKCACHE_VERSION ||
+		c->header->nsegs != nsegs || c->header->nsets != nsets || c->header->cur_seg >= nsegs ||
+		c->header->cur_off > BLKCACHE_SEG_SIZE)
+	{
+		memset(c->base, 0, c->size - (size_t)nsegs * BLKCACHE_SEG_SIZE);
+		c->header->magic = BLKCACHE_MAGIC;
+		c->header->version = BLKCACHE_VERSION;
+		c->header->nsegs = nsegs;
+		c->header->nsets = nsets;
+	}
+
+	return c;
+
+fail:
+	fprintf(stderr, "Warning: Cannot map block cache %s\n", path);
+	blkcache_close(c);
+	return NULL;
+}
+
+void blkcache_close(BLKCACHE *c)
+{
+	if (c == NULL)
+		return;
+
+	if (c->base != NULL)
+		munmap(c->base, c->size);
+	close(c->fd);
+	free(c);
+}
+
+#else
+
+BLKCACHE *blkcache_open(const char *path, long long size)
+{
+	(void)size;
+	fprintf(stderr, "Warning: Block cache %s is not supported on this platform\n", path);
+	return NULL;
+}
+
+void blkcache_close(BLKCACHE *c)
+{
+	(void)c;
+}
+
+#endif
+
+static BLKCACHE_ENTRY *blkcache_set(BLKCACHE *c, BLKCACHE_KEY *key)
+{
+	u32 h = key->hash[0] | (key->hash[1] << 8) | (key->hash[2] << 16) | ((u32)key->hash[3] << 24);
+
+	return c->entries + (size_t)(h & (c->header->nsets - 1)) * BLKCACHE_WAYS;
+}
+
+static int blkcache_valid(BLKCACHE *c, BLKCACHE_ENTRY *e)
+{
+	return (e->flags & BLKCACHE_VALID) && e->seg < c->header->nsegs && e->gen == c->segs[e->seg].gen;
+}
+
+int blkcache_get(BLKCACHE *c, BLKCACHE_KEY *key, u8 *out, int out_len, int *raw)
+{
+	BLKCACHE_ENTRY *set = blkcache_set(c, key);
+	int i;
+
+	for (i = 0; i < BLKCACHE_WAYS; i++)
+	{
+		BLKCACHE_ENTRY *e = &set[i];
+
+		if (!blkcache_valid(c, e) || memcmp(&e->key, key, sizeof(BLKCACHE_KEY)) != 0)
+			continue;
+
+		*raw = (e->flags & BLKCACHE_RAW) ? 1 : 0;
+		if (!*raw)
+		{
+			// Drop entries that are damaged or do not fit.
+			if ((int)e->len > out_len || e->off + e->len > BLKCACHE_SEG_SIZE)
+				break;
+
+			u8 *p = c->data + (size_t)e->seg * BLKCACHE_SEG_SIZE + e->off;
+			if (crc32(0, p, e->len) != e->crc)
+			{
+				e->flags = 0;
+				break;
+			}
+			memcpy(out, p, e->len);
+		}
+
+		c->segs[e->seg].last_used = ++c->header->clock;
+		c->hits++;
+		return e->len;
+	}
+
+	c->misses++;
+	return -1;
+}
+
+// Recycle the least recently used segment for new blocks.
+static void blkcache_next_segment(BLKCACHE *c)
+{
+	u32 i, lru = 0;
+
+	for (i = 1; i < c->header->nsegs; i++)
+	{
+		if (c->segs[i].last_used < c->segs[lru].last_used)
+			lru = i;
+	}
+
+	c->segs[lru].gen++;
+	c->segs[lru].last_used = ++c->header->clock;
+	c->header->cur_seg = lru;
+	c->header->cur_off = 0;
+}
+
+void blkcache_put(BLKCACHE *c, BLKCACHE_KEY *key, u8 *data, int len)
+{
+	BLKCACHE_ENTRY *set = blkcache_set(c, key);
+	BLKCACHE_ENTRY *e = NULL;
+	u32 alen = (len + 15) &~ 15;
+	int i;
+
+	if (len < 0 || alen > BLKCACHE_SEG_SIZE)
+		return;
+
+	// Take the way of the same block, a free one, else the one in the oldest segment.
+	for (i = 0; i < BLKCACHE_WAYS; i++)
+	{
+		if (blkcache_valid(c, &set[i]) && !memcmp(&set[i].key, key, sizeof(BLKCACHE_KEY)))
+		{
+			e = &set[i];
+			break;
+		}
+	}
+	for (i = 0; i < BLKCACHE_WAYS && e == NULL; i++)
+	{
+		if (!blkcache_valid(c, &set[i]))
+			e = &set[i];
+	}
+	if (e == NULL)
+	{
+		e = &set[0];
+		for (i = 1; i < BLKCACHE_WAYS; i++)
+		{
+			if (c->segs[set[i].seg].last_used < c->segs[e->seg].last_used)
+				e = &set[i];
+		}
+	}
+
+	e->flags = 0;
+	e->key = *key;
+	e->len = len;
+	e->crc = 0;
+
+	if (data == NULL)
+	{
+		// The marker still belongs to a segment, so it ages with it.
+		e->flags = BLKCACHE_VALID | BLKCACHE_RAW;
+		e->seg = c->header->cur_seg;
+		e->gen = c->segs[e->seg].gen;
+		e->off = 0;
+		return;
+	}
+
+	if (c->header->cur_off + alen > BLKCACHE_SEG_SIZE)
+		blkcache_next_segment(c);
+
+	// Write the data before publishing the entry.
+	e->seg = c->header->cur_seg;
+	e->gen = c->segs[e->seg].gen;
+	e->off = c->header->cur_off;
+	memcpy(c->data + (size_t)e->seg * BLKCACHE_SEG_SIZE + e->off, data, len);
+	e->crc = crc32(0, data, len);
+	e->flags = BLKCACHE_VALID;
+
+	c->header->cur_off += alen;
+	c->segs[e->seg].last_used = ++c->header->clock;
+}
+
+void blkcache_counters(BLKCACHE *c, long long *hits, long long *misses)
+{
+	*hits = (c != NULL) ? c->hits : 0;
+	*misses = (c != NULL) ? c->misses : 0;
+}
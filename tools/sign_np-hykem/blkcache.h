@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef BLKCACHE_H
+#define BLKCACHE_H
+
+#include "utils.h"
+
+// Default size of a new block cache file.
+#define BLKCACHE_DEFAULT_SIZE (1024LL * 1024 * 1024)
+
+typedef struct blkcache BLKCACHE;
+
+// A plaintext block, identified by its SHA1 (with LZRC_ENCODER_REV), size and compression level.
+typedef struct {
+	u8 hash[0x14];
+	u32 size;
+	u32 level;
+} BLKCACHE_KEY;
+
+/*
+	Open (or create) the on-disk cache of compressed blocks. The file is
+	memory mapped and keeps its size, the least recently used blocks are
+	evicted to make room. Returns NULL if the cache cannot be used, eg. when
+	another process holds it.
+*/
+BLKCACHE *blkcache_open(const char *path, long long size);
+void blkcache_close(BLKCACHE *c);
+
+void blkcache_key(BLKCACHE_KEY *key, u8 *data, int size, int level);
+
+/*
+	Look up a block. Returns -1 if it is not cached, else its compressed size
+	with the compressed data copied to out. raw is set when only the size is
+	known, the block being stored raw after compression.
+*/
+int blkcache_get(BLKCACHE *c, BLKCACHE_KEY *key, u8 *out, int out_len, int *raw);
+
+// Add a compressed block, or a stored raw marker when data is NULL.
+void blkcache_put(BLKCACHE *c, BLKCACHE_KEY *key, u8 *data, int len);
+
+// Lookup counters.
+void blkcache_counters(BLKCACHE *c, long long *hits, long long *misses);
+
+#endif
@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "ckpt.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/*
+	File layout (native endian):
+	  header  : CKPT_HEADER
+	  outputs : output_nr * (CKPT_FILE_OUTPUT, then blocks * 0x20 table entries)
+*/
+#define CKPT_MAGIC		0x54504B43	// CKPT
+#define CKPT_VERSION	2
+
+// Sanity limit of the number of outputs.
+#define CKPT_MAX_OUTPUTS	0x10000
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u64 iso_size;
+	u32 block_basis;
+	u32 compress;
+	u32 blocks;
+	u32 output_nr;
+	u64 iso_offset;
+	u8 last_hash[0x14];
+	u8 prng[KIRK_PRNG_STATE_SIZE];
+	u8 pad[3];
+} CKPT_HEADER;
+
+typedef struct {
+	char content_id[0x30];
+	u8 key_hash[0x14];
+	u8 header_key[0x10];
+	u32 pad;
+	u64 table_offset;
+} CKPT_FILE_OUTPUT;
+
+char *ckpt_name(const char *pbp_name)
+{
+	char *name = (char *) malloc(strlen(pbp_name) + 6);
+
+	strcpy(name, pbp_name);
+	strcat(name, ".ckpt");
+	return name;
+}
+
+int ckpt_write(const char *path, CKPT *c)
+{
+	char *tmp_name = (char *) malloc(strlen(path) + 5);
+	CKPT_HEADER h;
+	FILE *f;
+	int i, ret = 0;
+
+	strcpy(tmp_name, path);
+	strcat(tmp_name, ".tmp");
+
+	f = fopen(tmp_name, "wb");
+	if (f == NULL)
+	{
+		free(tmp_name);
+		return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = CKPT_MAGIC;
+	h.version = CKPT_VERSION;
+	h.iso_size = c->iso_size;
+	h.block_basis = c->block_basis;
+	h.compress = c->compress;
+	h.blocks = c->blocks;
+	h.output_nr = c->output_nr;
+	h.iso_offset = c->iso_offset;
+	memcpy(h.last_hash, c->last_hash, 0x14);
+	memcpy(h.prng, c->prng, KIRK_PRNG_STATE_SIZE);
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		ret = -1;
+
+	for (i = 0; i < c->output_nr && ret == 0; i++)
+	{
+		CKPT_OUTPUT *o = &c->outputs[i];
+		CKPT_FILE_OUTPUT fo;
+
+		memset(&fo, 0, sizeof(fo));
+		memcpy(fo.content_id, o->content_id, 0x30);
+		memcpy(fo.key_hash, o->key_hash, 0x14);
+		memcpy(fo.header_key, o->header_key, 0x10);
+		fo.table_offset = o->table_offset;
+		if (fwrite(&fo, sizeof(fo), 1, f) != 1)
+			ret = -1;
+		else if (c->blocks > 0 && fwrite(o->table_buf, (size_t)c->blocks * 0x20, 1, f) != 1)
+			ret = -1;
+	}
+
+	// The old checkpoint stays valid until the new one is complete.
+	if (ckpt_sync(f) != 0)
+		ret = -1;
+	fclose(f);
+#ifdef _WIN32
+	remove(path);
+#endif
+	if (ret == 0 && rename(tmp_name, path) != 0)
+		ret = -1;
+	if (ret != 0)
+		remove(tmp_name);
+
+	free(tmp_name);
+	return ret;
+}
+
+int ckpt_read(const char *path, CKPT *c)
+{
+	CKPT_HEADER h;
+	FILE *f;
+	u32 i;
+
+	memset(c, 0, sizeof(CKPT));
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return 1;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != CKPT_MAGIC || h.version != CKPT_VERSION
+		|| h.output_nr == 0 || h.output_nr > CKPT_MAX_OUTPUTS)
+	{
+		fclose(f);
+		return -1;
+	}
+
+	c->iso_size = h.iso_size;
+	c->block_basis = h.block_basis;
+	c->compress = h.compress;
+	c->blocks = h.blocks;
+	c->output_nr = h.output_nr;
+	c->iso_offset = h.iso_offset;
+	memcpy(c->last_hash, h.last_hash, 0x14);
+	memcpy(c->prng, h.prng, KIRK_PRNG_STATE_SIZE);
+	c->outputs = (CKPT_OUTPUT *) calloc(h.output_nr, sizeof(CKPT_OUTPUT));
+
+	for (i = 0; i < h.output_nr; i++)
+	{
+		CKPT_OUTPUT *o = &c->outputs[i];
+		CKPT_FILE_OUTPUT fo;
+
+		if (fread(&fo, sizeof(fo), 1, f) != 1)
+			break;
+		memcpy(o->content_id, fo.content_id, 0x30);
+		memcpy(o->key_hash, fo.key_hash, 0x14);
+		memcpy(o->header_key, fo.header_key, 0x10);
+		o->table_offset = fo.table_offset;
+		o->table_buf = (u8 *) malloc((size_t)h.blocks * 0x20 + 1);
+		if (o->table_buf == NULL || (h.blocks > 0 && fread(o->table_buf, (size_t)h.blocks * 0x20, 1, f) != 1))
+			break;
+	}
+
+	fclose(f);
+	if (i < h.output_nr)
+	{
+		ckpt_free(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+void ckpt_free(CKPT *c)
+{
+	int i;
+
+	for (i = 0; c->outputs && i < c->output_nr; i++)
+		free(c->outputs[i].table_buf);
+	free(c->outputs);
+	c->outputs = NULL;
+}
+
+int ckpt_sync(FILE *f)
+{
+	if (fflush(f) != 0)
+		return -1;
+#ifdef _WIN32
+	return _commit(_fileno(f));
+#else
+	return fsync(fileno(f));
+#endif
+}
+
+int ckpt_rewind(FILE *f, long long offset)
+{
+	fflush(f);
+#ifdef _WIN32
+	if (_chsize_s(_fileno(f), offset) != 0 || _fseeki64(f, offset, SEEK_SET) != 0)
+		return -1;
+#else
+	if (ftruncate(fileno(f), offset) != 0 || fseeko(f, offset, SEEK_SET) != 0)
+		return -1;
+#endif
+	return 0;
+}
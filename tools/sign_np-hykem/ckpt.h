@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef CKPT_H
+#define CKPT_H
+
+#include <stdio.h>
+
+#include "libkirk/kirk_engine.h"
+#include "utils.h"
+
+// Blocks between two checkpoints of -pbp (32 MiB with the retail block basis).
+#define CKPT_EVERY 1024
+
+// An output of the run, as it was when the checkpoint was written.
+typedef struct {
+	char content_id[0x30];
+	u8 key_hash[0x14];			// SHA1 of the version key.
+	u8 header_key[0x10];
+	long long table_offset;
+	u8 *table_buf;				// Entries of the committed blocks.
+} CKPT_OUTPUT;
+
+/*
+	State of an interrupted -pbp run, kept in <output>.ckpt. The first
+	blocks blocks are in the outputs up to iso_offset, only the NPUMDIMG
+	header and table are missing.
+*/
+typedef struct {
+	long long iso_size;
+	int block_basis;
+	int compress;
+	int blocks;					// Blocks committed.
+	long long iso_offset;		// Offset of the next block, from the NPUMDIMG header.
+	u8 last_hash[0x14];			// SHA1 of the ISO data of the last committed block.
+	u8 prng[KIRK_PRNG_STATE_SIZE];
+	int output_nr;
+	CKPT_OUTPUT *outputs;
+} CKPT;
+
+// Name of the checkpoint of an output, to free.
+char *ckpt_name(const char *pbp_name);
+
+/*
+	Write the checkpoint, through a temporary file renamed over the old one.
+	The outputs must have been synced first, see ckpt_sync.
+*/
+int ckpt_write(const char *path, CKPT *c);
+
+// Read a checkpoint. Returns 1 if there is none, -1 if it cannot be used.
+int ckpt_read(const char *path, CKPT *c);
+void ckpt_free(CKPT *c);
+
+// Flush an output to disk.
+int ckpt_sync(FILE *f);
+
+// Drop what an output has past offset (blocks after the checkpoint) and seek there.
+int ckpt_rewind(FILE *f, long long offset);
+
+#endif
@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "dedup.h"
+
+typedef struct {
+	DEDUP_KEY key;
+	int used;
+	int raw;
+	long long iso_pos;
+	long long store_pos;		// Compressed data in the store.
+	int lzrc_size;
+} DEDUP_ENTRY;
+
+struct dedup {
+	DEDUP_ENTRY *entries;
+	u32 mask;
+	FILE *iso;
+	SHRINK *shrink;
+	u8 *store;
+	long long store_size;
+	long long store_used;
+	u8 *buf;
+	int buf_size;
+	int hits;
+};
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static u64 fmix64(u64 k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// MurmurHash3 (x64, 128-bit), only used to find candidates.
+void dedup_key(DEDUP_KEY *key, u8 *data, int size)
+{
+	const u64 c1 = 0x87c37b91114253d5ULL;
+	const u64 c2 = 0x4cf5ad432745937fULL;
+	u64 h1 = 0, h2 = 0;
+	u64 k1, k2;
+	int i;
+
+	for (i = 0; i + 16 <= size; i += 16)
+	{
+		memcpy(&k1, data + i, 8);
+		memcpy(&k2, data + i + 8, 8);
+
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	// Tail, zero padded.
+	if (i < size)
+	{
+		u8 tail[16];
+		memset(tail, 0, 16);
+		memcpy(tail, data + i, size - i);
+		memcpy(&k1, tail, 8);
+		memcpy(&k2, tail + 8, 8);
+
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= size; h2 ^= size;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+
+	key->hash[0] = h1;
+	key->hash[1] = h2;
+	key->size = size;
+}
+
+DEDUP *dedup_create(int blocks, FILE *iso, SHRINK *shrink)
+{
+	DEDUP *d;
+	u32 n;
+
+	// Keep the table at most half full.
+	for (n = 16; n < (u32)blocks * 2; n <<= 1)
+		;
+
+	d = (DEDUP *) calloc(1, sizeof(DEDUP));
+	if (d == NULL)
+		return NULL;
+
+	d->entries = (DEDUP_ENTRY *) calloc(n, sizeof(DEDUP_ENTRY));
+	if (d->entries == NULL)
+	{
+		free(d);
+		return NULL;
+	}
+
+	d->mask = n - 1;
+	d->iso = iso;
+	d->shrink = shrink;
+
+	return d;
+}
+
+void dedup_free(DEDUP *d)
+{
+	if (d == NULL)
+		return;
+
+	free(d->entries);
+	free(d->store);
+	free(d->buf);
+	free(d);
+}
+
+static DEDUP_ENTRY *dedup_slot(DEDUP *d, DEDUP_KEY *key)
+{
+	u32 i = (u32)key->hash[0] & d->mask;
+
+	// Linear probing, stops on the same key or a free slot.
+	while (d->entries[i].used && memcmp(&d->entries[i].key.hash, key->hash, sizeof(key->hash)))
+		i = (i + 1) & d->mask;
+
+	return &d->entries[i];
+}
+
+int dedup_get(DEDUP *d, DEDUP_KEY *key, u8 *data, u8 *out, int out_len, int *raw)
+{
+	DEDUP_ENTRY *e = dedup_slot(d, key);
+
+	if (!e->used || e->key.size != key->size || e->lzrc_size + 16 > out_len)
+		return -1;
+
+	if (d->buf_size < key->size)
+	{
+		free(d->buf);
+		d->buf = (u8 *) malloc(key->size);
+		d->buf_size = (d->buf != NULL) ? key->size : 0;
+		if (d->buf == NULL)
+			return -1;
+	}
+
+	// The hash only finds a candidate, compare the bytes as they were compressed.
+	if (read_at(fileno(d->iso), d->buf, key->size, e->iso_pos) != 0)
+		return -1;
+	if (d->shrink)
+		shrink_apply(d->shrink, d->buf, e->iso_pos, key->size);
+	if (memcmp(d->buf, data, key->size))
+		return -1;
+
+	*raw = e->raw;
+	if (!e->raw)
+		memcpy(out, d->store + e->store_pos, e->lzrc_size);
+
+	d->hits++;
+	return e->lzrc_size;
+}
+
+void dedup_put(DEDUP *d, DEDUP_KEY *key, long long iso_pos, u8 *lzrc, int lzrc_size, int raw)
+{
+	DEDUP_ENTRY *e = dedup_slot(d, key);
+
+	// Keep the first block of a hash, a colliding one is simply compressed.
+	if (e->used)
+		return;
+
+	if (!raw)
+	{
+		if (d->store_used + lzrc_size > DEDUP_STORE_SIZE)
+			return;
+
+		// The store grows as needed, up to its limit.
+		if (d->store_used + lzrc_size > d->store_size)
+		{
+			long long size = d->store_size ? d->store_size * 2 : 0x100000;
+			while (size < d->store_used + lzrc_size)
+				size *= 2;
+			if (size > DEDUP_STORE_SIZE)
+				size = DEDUP_STORE_SIZE;
+
+			u8 *store = (u8 *) realloc(d->store, size);
+			if (store == NULL)
+				return;
+			d->store = store;
+			d->store_size = size;
+		}
+
+		memcpy(d->store + d->store_used, lzrc, lzrc_size);
+		e->store_pos = d->store_used;
+		d->store_used += lzrc_size;
+	}
+
+	e->key = *key;
+	e->used = 1;
+	e->raw = raw;
+	e->iso_pos = iso_pos;
+	e->lzrc_size = lzrc_size;
+}
+
+int dedup_hits(DEDUP *d)
+{
+	return (d != NULL) ? d->hits : 0;
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdio.h>
+
+#include "shrink.h"
+#include "utils.h"
+
+// Compressed bytes of the unique blocks kept in memory, at most.
+#define DEDUP_STORE_SIZE (64 * 1024 * 1024)
+
+typedef struct dedup DEDUP;
+
+// A plaintext block, identified by a 128-bit hash and its size.
+typedef struct {
+	u64 hash[2];
+	int size;
+} DEDUP_KEY;
+
+/*
+	Map of the blocks already written in this run, so repeated blocks are
+	compressed once. The plaintext of a match is read back from the ISO to
+	compare it, with the --shrink changes applied (shrink, or NULL). The
+	compressed data of the unique blocks is kept in memory, up to
+	DEDUP_STORE_SIZE bytes, the blocks past it are not added.
+*/
+DEDUP *dedup_create(int blocks, FILE *iso, SHRINK *shrink);
+void dedup_free(DEDUP *d);
+
+void dedup_key(DEDUP_KEY *key, u8 *data, int size);
+
+/*
+	Look up a block. Returns -1 if no identical block was written, else its
+	compressed size with the compressed data copied to out. raw is set when
+	the block was stored raw.
+*/
+int dedup_get(DEDUP *d, DEDUP_KEY *key, u8 *data, u8 *out, int out_len, int *raw);
+
+/*
+	Add a written block: its offset in the ISO, its compressed data and size,
+	or only the size when it was stored raw.
+*/
+void dedup_put(DEDUP *d, DEDUP_KEY *key, long long iso_pos, u8 *lzrc, int lzrc_size, int raw);
+
+// Number of blocks served from the map.
+int dedup_hits(DEDUP *d);
+
+#endif
@@ -167,20 +167,12 @@ void build_psp_header(PSP_Header2 *psph, u8 *ebuf, int esize, u32 devkit_ver)
 void build_tag_key(TAG_KEY *tk)
 {
 	int i;
-	u32 *k7 = (u32*)tag_key;
-
 	for (i = 0; i < 9; i++) {
 		memcpy(tag_key + 0x14 + (i * 16), tk->key, 0x10);
 		tag_key[0x14 + (i * 16)] = i;
 	}
 
-	k7[0] = KIRK_MODE_DECRYPT_CBC;
-	k7[1] = 0;
-	k7[2] = 0;
-	k7[3] = tk->code;
-	k7[4] = 0x90;
-
-	kirk_CMD7(tag_key, tag_key, 0x90 + 0x14);
+	kirk_aes_cbc_keyseed(tk->code, tag_key + 0x14, tag_key, 0x90, KIRK_MODE_DECRYPT_CBC);
 }
 
 /*
@@ -227,12 +219,7 @@ void build_psp_SHA1(u8 *ebuf, u8 *pbuf)
 	}
 	memcpy(tmp + 0xd0, pbuf, 0x80);
 
-	k4[0] = KIRK_MODE_ENCRYPT_CBC;
-	k4[1] = 0;
-	k4[2] = 0;
-	k4[3] = tkey->code;
-	k4[4] = 0x40;
-	kirk_CMD4(tmp + 0x80 - 0x14, tmp, 0x40 + 0x14);
+	kirk_aes_cbc_keyseed(tkey->code, tmp + 0x14, tmp + 0x80, 0x40, KIRK_MODE_ENCRYPT_CBC);
 
 	for (i = 0; i < 0x40; i++) {
 		tmp[0x80 + i] ^=  tag_key[0x10 + i];
@@ -248,21 +235,14 @@ void build_psp_SHA1(u8 *ebuf, u8 *pbuf)
 	
 	memcpy(tmp + 0x08, tag_key, 0x10);
 	
-	k4[0] = 0x014c;
 	k4[1] = tkey->tag;
 
-	kirk_CMD11(tmp, tmp, 0x150);
+	kirk_sha1(tmp + 4, 0x14c, tmp);
 
 	memcpy(tmp + 0x5c, test_k140, 0x10);
 	memcpy(tmp + 0x6c, tmp, 0x14);
 
-	k4 = (u32*)(tmp + 0x48);
-	k4[0] = KIRK_MODE_ENCRYPT_CBC;
-	k4[1] = 0;
-	k4[2] = 0;
-	k4[3] = tkey->code;
-	k4[4] = 0x60;
-	kirk_CMD4(tmp + 0x48, tmp + 0x48, 0x60);
+	kirk_aes_cbc_keyseed(tkey->code, tmp + 0x5c, tmp + 0x5c, 0x60, KIRK_MODE_ENCRYPT_CBC);
 
 	memset(tmp, 0, 0x5c);
 	
@@ -323,4 +303,98 @@ int sign_eboot(u8 *eboot, int eboot_size, int tag, u8 *seboot, u32 devkit_ver)
 	memcpy(seboot, ebuf, esize + 0x150);
 	
 	return (esize + 0x150);
-}
\ No newline at end of file
+}
+/*
+	PSP EBOOT verifying function.
+*/
+const char *verify_eboot(u8 *seboot, int seboot_size)
+{
+	u8 tmp[0x150];
+	u8 kbuf[0x14 + 0x60];
+	u8 plain[0x60];
+	u8 hash[0x14];
+	int i, esize;
+
+	if (seboot_size < 0x150 || *(u32*)seboot != 0x5053507E)
+		return "~PSP header";
+
+	esize = *(int*)(seboot + 0x28);
+	if (esize <= 0 || *(int*)(seboot + 0x2C) != seboot_size || ((esize + 15) &~ 15) + 0x150 != seboot_size)
+		return "~PSP size";
+
+	// Select tag.
+	tkey = NULL;
+	for (i = 0; i < (int)(sizeof(key_list) / sizeof(TAG_KEY)); i++) {
+		if (key_list[i].tag == *(u32*)(seboot + 0xd0))
+			tkey = &key_list[i];
+	}
+	if (tkey == NULL)
+		return "~PSP tag";
+
+	// The rest of the tag area is left blank (see build_psp_SHA1).
+	if (!isEmpty(seboot + 0xd4, (tkey->type == 6) ? 0x38 : 0x58))
+		return "~PSP tag area";
+
+	build_tag_key(tkey);
+
+	// Decrypt the block holding the header SHA1 (see build_psp_SHA1).
+	memcpy(kbuf + 0x14, seboot + 0x140, 0x10);
+	memcpy(kbuf + 0x24, seboot + 0x12c, 0x14);
+	memcpy(kbuf + 0x38, seboot + 0x080, 0x30);
+	memcpy(kbuf + 0x68, seboot + 0x0c0, 0x0c);
+	kirk_aes_cbc_keyseed(tkey->code, kbuf + 0x14, plain, 0x60, KIRK_MODE_DECRYPT_CBC);
+
+	if (memcmp(plain, test_k140, 0x10) != 0)
+		return "~PSP header key";
+
+	// Rebuild the hashed buffer and test the SHA1.
+	memset(tmp, 0, 0x150);
+	*(u32*)(tmp + 0x04) = tkey->tag;
+	memcpy(tmp + 0x08, tag_key, 0x10);
+	if (tkey->type == 6)
+		memcpy(tmp + 0x50, seboot + 0xd0 + 0x3c, 0x20);
+	memcpy(tmp + 0x70, test_k140, 0x10);
+	memcpy(tmp + 0x80, plain + 0x24, 0x3c);
+	memcpy(tmp + 0xbc, seboot + 0x0cc, 0x04);
+	memcpy(tmp + 0xc0, seboot + 0x0b0, 0x10);
+	memcpy(tmp + 0xd0, seboot, 0x80);
+
+	kirk_sha1(tmp + 4, 0x14c, hash);
+	if (memcmp(hash, plain + 0x10, 0x14) != 0)
+		return "~PSP header SHA1";
+
+	// Recover the start of the KIRK1 header.
+	for (i = 0; i < 0x40; i++) {
+		kbuf[0x14 + i] = tmp[0x80 + i] ^ tag_key[0x10 + i];
+	}
+	kirk_aes_cbc_keyseed(tkey->code, kbuf + 0x14, plain, 0x40, KIRK_MODE_DECRYPT_CBC);
+
+	// Rebuild the KIRK1 block and test its CMAC hashes.
+	int ksize = 0x90 + 0x80 + ((esize + 15) &~ 15);
+	u8 *kirk1 = (u8 *) malloc (ksize);
+	if (kirk1 == NULL)
+		return "~PSP memory";
+
+	KIRK_CMD1_HEADER *k1 = (KIRK_CMD1_HEADER *)kirk1;
+	memset(kirk1, 0, 0x90);
+	for (i = 0; i < 0x40; i++) {
+		kirk1[i] = plain[i] ^ tag_key[0x50 + i];
+	}
+	if (tkey->type == 6) {
+		memcpy(kirk1 + 0x40, seboot + 0xd0 + 0x3c, 0x20);
+		k1->ecdsa_hash = 1;
+	}
+	k1->mode = KIRK_MODE_CMD1;
+	k1->data_size = esize;
+	k1->data_offset = 0x80;
+	memcpy(kirk1 + 0x90, seboot, 0x80);
+	memcpy(kirk1 + 0x110, seboot + 0x150, seboot_size - 0x150);
+
+	int ret = kirk_CMD10(kirk1, ksize);
+	free(kirk1);
+
+	if (ret != KIRK_OPERATION_SUCCESS)
+		return "~PSP KIRK1 CMAC";
+
+	return NULL;
+}
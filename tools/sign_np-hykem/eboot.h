@@ -2,6 +2,9 @@
    SPDX-FileCopyrightText: 2015 Hykem <hykem@hotmail.com>
    SPDX-License-Identifier: GPL-3.0-only */
 
+#ifndef EBOOT_H
+#define EBOOT_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,4 +20,9 @@ typedef struct {
 	u32 type;
 } TAG_KEY;
 
-int sign_eboot(u8 *eboot, int eboot_size, int tag, u8 *seboot, u32 devkit_ver);
\ No newline at end of file
+int sign_eboot(u8 *eboot, int eboot_size, int tag, u8 *seboot, u32 devkit_ver);
+
+// Check a signed EBOOT, returns NULL if valid or the name of the failed check.
+const char *verify_eboot(u8 *seboot, int seboot_size);
+
+#endif
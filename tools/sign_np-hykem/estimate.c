@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <math.h>
+
+#include "estimate.h"
+#include "libkirk/amctrl.h"
+#include "tlzrc.h"
+
+// Normal quantile of a two-sided 95% interval.
+#define ESTIMATE_Z	1.96
+
+int estimate_init(ESTIMATE *e, const char *format)
+{
+	memset(e, 0, sizeof(ESTIMATE));
+	if (format != NULL && strcmp(format, "text") && strcmp(format, "json"))
+		return -1;
+
+	e->json = (format != NULL && !strcmp(format, "json"));
+	return 0;
+}
+
+static long long bit_reverse(long long v, int bits)
+{
+	long long r = 0;
+	int i;
+
+	for (i = 0; i < bits; i++, v >>= 1)
+		r = (r << 1) | (v & 1);
+
+	return r;
+}
+
+int estimate_blocks(ESTIMATE *e, FILE *iso, long long iso_size, int block_size, int ratio_limit, SHRINK *shrink, u8 *header_key, u8 *version_key)
+{
+	u8 *iso_buf = (u8 *) malloc(block_size * 2);
+	u8 *lzrc_buf = (u8 *) malloc(block_size * 2);
+	CIPHER_KEY ckey;
+	MAC_KEY mkey;
+	u8 mac[0x10];
+	long long k;
+	int bits = 0;
+	double start = get_time();
+
+	if (iso_buf == NULL || lzrc_buf == NULL)
+	{
+		free(iso_buf);
+		free(lzrc_buf);
+		return -1;
+	}
+
+	e->blocks = (iso_size + block_size - 1) / block_size;
+	while ((1LL << bits) < e->blocks)
+		bits++;
+
+	// Every block once, the first ones of the order spread over the whole ISO.
+	for (k = 0; k < (1LL << bits) && e->samples < ESTIMATE_MAX_SAMPLES; k++)
+	{
+		long long i = bit_reverse(k, bits);
+		long long pos = i * block_size;
+		int wsize, asize, o;
+		double t;
+
+		if (i >= e->blocks)
+			continue;
+		if (e->samples >= ESTIMATE_MIN_SAMPLES && get_time() - start > ESTIMATE_TIME)
+			break;
+
+		wsize = (iso_size - pos < block_size) ? (int)(iso_size - pos) : block_size;
+		memset(iso_buf, 0, block_size);
+		if (read_at(fileno(iso), iso_buf, wsize, pos) != 0)
+			break;
+		if (shrink)
+			shrink_apply(shrink, iso_buf, pos, wsize);
+
+		t = get_time();
+		u8 *wbuf = iso_buf;
+		if (e->compress)
+		{
+			int lzrc_size = lzrc_compress_level(lzrc_buf, block_size * 2, iso_buf, block_size, e->level);
+			if ((lzrc_size * 100) / block_size < ratio_limit)
+			{
+				wbuf = lzrc_buf;
+				wsize = lzrc_size;
+			}
+			else
+				e->raw++;
+		}
+		asize = (wsize + 15) & ~15;
+
+		// The data is not kept, only the time matters.
+		for (o = 0; o < e->outputs; o++)
+		{
+			sceDrmBBCipherInit(&ckey, 1, 2, header_key, version_key, (u32)(pos >> 4));
+			sceDrmBBCipherUpdate(&ckey, wbuf, wsize);
+			sceDrmBBCipherFinal(&ckey);
+			sceDrmBBMacInit(&mkey, 3);
+			sceDrmBBMacUpdate(&mkey, wbuf, wsize);
+			sceDrmBBMacFinal(&mkey, mac, version_key);
+		}
+		t = get_time() - t;
+
+		e->samples++;
+		e->size_sum += asize;
+		e->size_sq += (double)asize * asize;
+		e->time_sum += t;
+		e->time_sq += t * t;
+	}
+
+	free(iso_buf);
+	free(lzrc_buf);
+
+	return (e->samples > 0) ? 0 : -1;
+}
+
+// Total of a per block quantity over the ISO, and the half width of its interval.
+static double estimate_total(ESTIMATE *e, double sum, double sq, double *half)
+{
+	double n = e->samples, N = e->blocks;
+	double mean = sum / n;
+	double var = (n > 1) ? (sq - sum * mean) / (n - 1) : 0;
+
+	// Sampled without replacement, a full census has no error.
+	double fpc = (N > 1) ? (N - n) / (N - 1) : 0;
+
+	if (var < 0)
+		var = 0;
+	*half = ESTIMATE_Z * N * sqrt(var / n * fpc);
+	return mean * N;
+}
+
+void estimate_print(ESTIMATE *e, FILE *f)
+{
+	double size_half, time_half;
+	double table_size = e->blocks * 0x20;
+	double fixed = e->header_size + 0x100 + table_size;
+	double data = estimate_total(e, e->size_sum, e->size_sq, &size_half);
+	double seconds = estimate_total(e, e->time_sum, e->time_sq, &time_half);
+
+	double size = fixed + data;
+	seconds += e->header_time;
+
+	if (e->json)
+	{
+		fprintf(f, "{\"blocks\":%lld,\"samples\":%d,\"level\":%d,\"outputs\":%d,", e->blocks, e->samples, e->compress ? e->level : 0, e->outputs);
+		fprintf(f, "\"size\":%.0f,\"size_low\":%.0f,\"size_high\":%.0f,\"table_size\":%.0f,\"header_size\":%lld,",
+			size, size - size_half, size + size_half, table_size, e->header_size);
+		fprintf(f, "\"raw_ratio\":%.4f,\"seconds\":%.3f,\"seconds_low\":%.3f,\"seconds_high\":%.3f}\n",
+			(double)e->raw / e->samples, seconds, seconds - time_half, seconds + time_half);
+		return;
+	}
+
+	fprintf(f, "Estimate from %d of %lld block(s)", e->samples, e->blocks);
+	if (e->compress)
+		fprintf(f, ", level %d", e->level);
+	fprintf(f, ", 95%% intervals\n");
+	fprintf(f, "PBP size: %.2f MB (%.2f to %.2f MB) per output\n", size / (1024.0 * 1024.0),
+		(size - size_half) / (1024.0 * 1024.0), (size + size_half) / (1024.0 * 1024.0));
+	fprintf(f, "Table size: %.1f KB, header %.1f KB\n", table_size / 1024.0, (e->header_size + 0x100) / 1024.0);
+	if (e->compress)
+		fprintf(f, "Blocks stored raw: %.1f%%\n", e->raw * 100.0 / e->samples);
+	fprintf(f, "Time: %.1f s (%.1f to %.1f s) for %d output(s), without the I/O\n", seconds,
+		seconds - time_half, seconds + time_half, e->outputs);
+}
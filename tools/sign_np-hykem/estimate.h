@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+
+#include <stdio.h>
+
+#include "shrink.h"
+#include "utils.h"
+
+// Sampling of --estimate: at least, at most, and the time after which it stops past the minimum.
+#define ESTIMATE_MIN_SAMPLES	32
+#define ESTIMATE_MAX_SAMPLES	2048
+#define ESTIMATE_TIME			3.0
+
+/*
+	Size and time of a -pbp run, extrapolated from a sample of its blocks.
+	The blocks are taken in bit reversed order, so that any number of them
+	spreads over the whole ISO (one per stratum of a power of two size).
+*/
+typedef struct {
+	int json;
+	int level;
+	int compress;
+	int outputs;
+	long long blocks;
+	int samples;
+	int raw;					// Sampled blocks stored raw.
+	double size_sum;			// Stored sizes of the sampled blocks.
+	double size_sq;
+	double time_sum;			// Seconds per sampled block, compression and every output's cipher and MAC.
+	double time_sq;
+	long long header_size;		// Bytes before the NPUMDIMG header, of one output.
+	double header_time;			// Seconds to write the headers.
+} ESTIMATE;
+
+/*
+	Parse the --estimate option value: NULL or "text" for a summary, "json"
+	for a single JSON object. Returns 0 on success.
+*/
+int estimate_init(ESTIMATE *e, const char *format);
+
+/*
+	Compress and time the sample blocks of the ISO, as the -pbp loop would
+	with these settings, without writing them. shrink is the --shrink
+	pre-pass, or NULL. Returns 0 on success.
+*/
+int estimate_blocks(ESTIMATE *e, FILE *iso, long long iso_size, int block_size, int ratio_limit, SHRINK *shrink, u8 *header_key, u8 *version_key);
+
+// Print the estimate, with 95% confidence intervals, to f.
+void estimate_print(ESTIMATE *e, FILE *f);
+
+#endif
@@ -378,6 +378,85 @@ static int findPath(const char *path, Iso9660DirectoryRecord *result_record)
 	return ret;
 }
 
+static int walkDir(const char *path, u32 lba, u32 dir_size, int level, isoWalkCallback callback, void *arg)
+{
+	u8 *dir;
+	u32 pos;
+	int ret = 0;
+	Iso9660DirectoryRecord *rec;
+	char name[32];
+	char *sub_path;
+
+	if(level > MAX_DIR_LEVEL) {
+		return -16;
+	}
+
+	// The whole directory is read first, the sector buffer is reused below.
+	dir = malloc(dir_size);
+
+	if (dir == NULL) {
+		return -6;
+	}
+
+	if (isoRead(dir, lba, 0, dir_size) != (int)dir_size) {
+		free(dir);
+		return -7;
+	}
+
+	pos = 0;
+
+	while (pos < dir_size && ret == 0) {
+		rec = (Iso9660DirectoryRecord*)&dir[pos];
+
+		if(rec->len_dr == 0) {
+			pos += isoPos2RestSize(pos);
+			continue;
+		}
+
+		if(pos + rec->len_dr > dir_size || rec->len_dr < rec->len_fi + sizeof(*rec)) {
+			printf("%s: Corrupt directory record found in %s, LBA %d\n", __func__, g_filename, lba + isoPos2LBA(pos));
+			ret = -12;
+			break;
+		}
+
+		if(rec->len_fi > 32) {
+			ret = -11;
+			break;
+		}
+
+		// Skip . and ..
+		if(rec->len_fi == 1 && (rec->fi == 0 || rec->fi == 1)) {
+			pos += rec->len_dr;
+			continue;
+		}
+
+		memset(name, 0, sizeof(name));
+		memcpy(name, &rec->fi, rec->len_fi);
+		normalizeName(name);
+
+		sub_path = malloc(strlen(path) + strlen(name) + 2);
+
+		if (sub_path == NULL) {
+			ret = -6;
+			break;
+		}
+
+		sprintf(sub_path, "%s/%s", path, name);
+		ret = callback(sub_path, rec, arg);
+
+		if (ret == 0 && (rec->fileFlags & ISO9660_FILEFLAGS_DIR)) {
+			ret = walkDir(sub_path, rec->lsbStart, rec->lsbDataLength, level + 1, callback, arg);
+		}
+
+		free(sub_path);
+		pos += rec->len_dr;
+	}
+
+	free(dir);
+
+	return ret;
+}
+
 int isoOpen(const char *path)
 {
 	int ret;
@@ -501,6 +580,19 @@ int isoGetFileInfo(char * path, u32 *filesize, u32 *lba)
 	return 0;
 }
 
+int isoWalk(isoWalkCallback callback, void *arg)
+{
+	int ret;
+
+	ret = callback("", &g_root_record, arg);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	return walkDir("", g_root_record.lsbStart, g_root_record.lsbDataLength, 0, callback, arg);
+}
+
 int isoRead(void *buffer, u32 lba, int offset, u32 size)
 {
 	u32 remaining;
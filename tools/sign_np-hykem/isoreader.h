@@ -66,4 +66,10 @@ int isoGetFileInfo(char * str, u32 * filesize, u32 *lba);
 //read raw data from iso
 int isoRead(void *buffer, u32 lba, int offset, u32 size);
 
+//called with the path ("" for the root, "/PSP_GAME" ...) and the record of each file and directory
+typedef int (*isoWalkCallback)(const char *path, Iso9660DirectoryRecord *record, void *arg);
+
+//walk the whole directory tree, stops at the first callback returning non zero
+int isoWalk(isoWalkCallback callback, void *arg);
+
 #endif
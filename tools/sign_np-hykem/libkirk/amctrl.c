@@ -11,8 +11,8 @@
 #include "amctrl.h"
 #include "aes.h"
 
-// KIRK buffer.
-static u8 kirk_buf[0x0814];
+// KIRK buffer (per thread, so BBMac/BBCipher contexts can run in parallel).
+static __thread u8 kirk_buf[0x0814];
 
 // AMCTRL keys.
 static u8 amctrl_key1[0x10] = {0xE3, 0x50, 0xED, 0x1D, 0x91, 0x0A, 0x1F, 0xD0, 0x29, 0xBB, 0x1C, 0x3E, 0xF3, 0x40, 0x77, 0xFB};
@@ -35,15 +35,9 @@ static u8 npdrm_fixed_key[0x10] = {
 static int kirk4(u8 *buf, int size, int type)
 {
 	int retv;
-	u32 *header = (u32*)buf;
-
-	header[0] = 4;
-	header[1] = 0;
-	header[2] = 0;
-	header[3] = type;
-	header[4] = size;
 
-	retv = sceUtilsBufferCopyWithRange(buf, size + 0x14, buf, size, 4);
+	// The data follows room for a command header, it is encrypted in place.
+	retv = kirk_aes_cbc_keyseed(type, buf + 0x14, buf + 0x14, size, KIRK_MODE_ENCRYPT_CBC);
 
 	if (retv)
 		return 0x80510311;
@@ -54,15 +48,9 @@ static int kirk4(u8 *buf, int size, int type)
 static int kirk7(u8 *buf, int size, int type)
 {
 	int retv;
-	u32 *header = (u32*)buf;
-
-	header[0] = 5;
-	header[1] = 0;
-	header[2] = 0;
-	header[3] = type;
-	header[4] = size;
 
-	retv = sceUtilsBufferCopyWithRange(buf, size + 0x14, buf, size, 7);
+	// As KIRK_CMD_DECRYPT_IV_0, the data at 0x14 is decrypted to the start of buf.
+	retv = kirk_aes_cbc_keyseed(type, buf + 0x14, buf, size, KIRK_MODE_DECRYPT_CBC);
 	
 	if (retv)
 		return 0x80510311;
@@ -256,7 +244,8 @@ int sceDrmBBMacUpdate(MAC_KEY *mkey, u8 *buf, int size)
 
 		type = (mkey->type == 2) ? 0x3A : 0x38;
 
-		while (size)
+		// The previous pad must be processed even if no new data is left.
+		while (size + p)
 		{
 			ksize = (size + p >= 0x0800) ? 0x0800 : size + p;
 			memcpy(kbuf + p, buf, ksize - p);
@@ -55,6 +55,14 @@ u8 PRNG_DATA[0x14];
 
 char is_kirk_initialized;
 
+// Set by kirk_seed_prng, the PRNG then only depends on the seed.
+static char is_prng_seeded;
+
+// Keystream drawn by kirk_CMD14, AES-CTR under PRNG_DATA, refilled when empty.
+#define KIRK_PRNG_POOL_SIZE 0x1000
+static u8 prng_pool[KIRK_PRNG_POOL_SIZE];
+static u32 prng_pool_pos = KIRK_PRNG_POOL_SIZE;
+
 // Internal functions
 u8* kirk_4_7_get_key(int key_type)
 	{
@@ -263,6 +271,7 @@ int kirk_init2(u8 * rnd_seed, u32 seed_size, u32 fuseid_90, u32 fuseid_94)
 	// in an uninitialized state. This should add unpredicableness to the results as well
 	header->data_size = 0x100;
 	kirk_CMD11(PRNG_DATA, temp, 0x104); 
+	prng_pool_pos = KIRK_PRNG_POOL_SIZE;
 
 	//Set Fuse ID
 	g_fuse90 = fuseid_90;
@@ -275,6 +284,68 @@ int kirk_init2(u8 * rnd_seed, u32 seed_size, u32 fuseid_90, u32 fuseid_94)
 	return 0;
 }
 
+int kirk_seed_prng(u8 *seed, u32 seed_size)
+{
+	u8 *seedbuf = (u8 *) malloc(seed_size + 4);
+	KIRK_SHA1_HEADER *seedheader = (KIRK_SHA1_HEADER *) seedbuf;
+
+	if (seedbuf == NULL)
+		return KIRK_NOT_ENABLED;
+
+	seedheader->data_size = seed_size;
+	memcpy(seedbuf + 4, seed, seed_size);
+	kirk_CMD11(PRNG_DATA, seedbuf, seed_size + 4);
+	free(seedbuf);
+
+	is_prng_seeded = 1;
+	prng_pool_pos = KIRK_PRNG_POOL_SIZE;
+	return KIRK_OPERATION_SUCCESS;
+}
+
+// Fill the pool from PRNG_DATA: its first 16 bytes are the key, the last 4 start the counter.
+static void kirk_fill_prng_pool()
+{
+	AES_ctx ctx;
+	u8 ctr[0x10];
+	u32 i, n;
+
+	AES_set_key(&ctx, PRNG_DATA, 128);
+	memset(ctr, 0, 0x10);
+	memcpy(ctr, PRNG_DATA + 0x10, 4);
+	for (i = 0; i < KIRK_PRNG_POOL_SIZE; i += 0x10)
+	{
+		n = i / 0x10;
+		ctr[12] = (n >> 24) & 0xFF;
+		ctr[13] = (n >> 16) & 0xFF;
+		ctr[14] = (n >> 8) & 0xFF;
+		ctr[15] = n & 0xFF;
+		AES_encrypt(&ctx, ctr, prng_pool + i);
+	}
+}
+
+void kirk_save_prng(u8 *state)
+{
+	memcpy(state, PRNG_DATA, 0x14);
+	state[0x14] = is_prng_seeded;
+	state[0x15] = prng_pool_pos & 0xFF;
+	state[0x16] = (prng_pool_pos >> 8) & 0xFF;
+	state[0x17] = (prng_pool_pos >> 16) & 0xFF;
+	state[0x18] = (prng_pool_pos >> 24) & 0xFF;
+}
+
+void kirk_restore_prng(const u8 *state)
+{
+	memcpy(PRNG_DATA, state, 0x14);
+	is_prng_seeded = state[0x14];
+	prng_pool_pos = state[0x15] | (state[0x16] << 8) | (state[0x17] << 16) | ((u32)state[0x18] << 24);
+
+	// The pool only depends on PRNG_DATA, it is filled again and drawn from where it was.
+	if (prng_pool_pos > KIRK_PRNG_POOL_SIZE)
+		prng_pool_pos = KIRK_PRNG_POOL_SIZE;
+	if (prng_pool_pos < KIRK_PRNG_POOL_SIZE)
+		kirk_fill_prng_pool();
+}
+
 int kirk_CMD0(u8* outbuff, u8* inbuff, int size, int generate_trash)
 {
 	KIRK_CMD1_HEADER* header = (KIRK_CMD1_HEADER*)outbuff;
@@ -381,41 +452,23 @@ int kirk_CMD1_ex(u8* outbuff, u8* inbuff, int size, KIRK_CMD1_HEADER* header)
 int kirk_CMD4(u8* outbuff, u8* inbuff, int size)
 {
 	KIRK_AES128CBC_HEADER *header = (KIRK_AES128CBC_HEADER*)inbuff;
-	u8* key;
-	AES_ctx aesKey;
 
 	if (is_kirk_initialized == 0) return KIRK_NOT_INITIALIZED;
 	if (header->mode != KIRK_MODE_ENCRYPT_CBC) return KIRK_INVALID_MODE;
 	if (header->data_size == 0) return KIRK_DATA_SIZE_ZERO;
 
-	key = kirk_4_7_get_key(header->keyseed);
-	if (key == (u8*)KIRK_INVALID_SIZE) return KIRK_INVALID_SIZE;
-
-	// Set the key
-	AES_set_key(&aesKey, key, 128);
-	AES_cbc_encrypt(&aesKey, inbuff+sizeof(KIRK_AES128CBC_HEADER), outbuff+sizeof(KIRK_AES128CBC_HEADER), size);
-
-	return KIRK_OPERATION_SUCCESS;
+	return kirk_aes_cbc_keyseed(header->keyseed, inbuff+sizeof(KIRK_AES128CBC_HEADER), outbuff+sizeof(KIRK_AES128CBC_HEADER), size, KIRK_MODE_ENCRYPT_CBC);
 }
 
 int kirk_CMD7(u8* outbuff, u8* inbuff, int size)
 {
 	KIRK_AES128CBC_HEADER *header = (KIRK_AES128CBC_HEADER*)inbuff;
-	u8* key;
-	AES_ctx aesKey;
 
 	if (is_kirk_initialized == 0) return KIRK_NOT_INITIALIZED;
 	if (header->mode != KIRK_MODE_DECRYPT_CBC) return KIRK_INVALID_MODE;
 	if (header->data_size == 0) return KIRK_DATA_SIZE_ZERO;
 
-	key = kirk_4_7_get_key(header->keyseed);
-	if (key == (u8*)KIRK_INVALID_SIZE) return KIRK_INVALID_SIZE;
-
-	// Set the key
-	AES_set_key(&aesKey, key, 128);
-	AES_cbc_decrypt(&aesKey, inbuff+sizeof(KIRK_AES128CBC_HEADER), outbuff, size);
-
-	return KIRK_OPERATION_SUCCESS;
+	return kirk_aes_cbc_keyseed(header->keyseed, inbuff+sizeof(KIRK_AES128CBC_HEADER), outbuff, size, KIRK_MODE_DECRYPT_CBC);
 }
 
 int kirk_CMD10(u8* inbuff, int insize)
@@ -455,15 +508,9 @@ int kirk_CMD10(u8* inbuff, int insize)
 int kirk_CMD11(u8* outbuff, u8* inbuff, int size)
 {
 	KIRK_SHA1_HEADER *header = (KIRK_SHA1_HEADER *)inbuff;
-	SHA_CTX sha;
-	if (is_kirk_initialized == 0) return KIRK_NOT_INITIALIZED;
-	if (header->data_size == 0 || size == 0) return KIRK_DATA_SIZE_ZERO;
+	if (size == 0) return KIRK_DATA_SIZE_ZERO;
 
-	SHAInit(&sha);
-	SHAUpdate(&sha, inbuff+sizeof(KIRK_SHA1_HEADER), header->data_size);
-	SHAFinal(outbuff, &sha);
-	
-	return KIRK_OPERATION_SUCCESS;
+	return kirk_sha1(inbuff+sizeof(KIRK_SHA1_HEADER), header->data_size, outbuff);
 }
 
 int kirk_CMD12(u8 * outbuff, int outsize)
@@ -499,7 +546,8 @@ int kirk_CMD13(u8 * outbuff, int outsize,u8 * inbuff, int insize)
 	return KIRK_OPERATION_SUCCESS;
 }
 
-int kirk_CMD14(u8 * outbuff, int outsize)
+// Mix PRNG_DATA once, as each draw used to, and fill the pool from it.
+static void kirk_refill_prng_pool()
 {
 	u8 temp[0x104];
 	KIRK_SHA1_HEADER *header = (KIRK_SHA1_HEADER *) temp;
@@ -507,13 +555,15 @@ int kirk_CMD14(u8 * outbuff, int outsize)
 	// Some randomly selected data for a "key" to add to each randomization
 	u8 key[0x10] = { 0xA7, 0x2E, 0x4C, 0xB6, 0xC3, 0x34, 0xDF, 0x85, 0x70, 0x01, 0x49, 0xFC, 0xC0, 0x87, 0xC4, 0x77 };
 	u32 curtime;
-	
-	if(outsize <=0) return KIRK_OPERATION_SUCCESS;
+
+	// A seeded PRNG must not mix in the time and the stack contents.
+	if (is_prng_seeded)
+		memset(temp, 0, sizeof(temp));
 
 	memcpy(temp+4, PRNG_DATA,0x14);
 	
 	// This uses the standard C time function for portability.
-	curtime=(u32)time(0);
+	curtime = (is_prng_seeded) ? 0 : (u32)time(0);
 	temp[0x18] = curtime &0xFF;
 	temp[0x19] = (curtime>>8) &0xFF;
 	temp[0x1A] = (curtime>>16) &0xFF;
@@ -524,25 +574,31 @@ int kirk_CMD14(u8 * outbuff, int outsize)
 	// in an uninitialized state. This should add unpredicableness to the results as well
 	header->data_size=0x100;
 	kirk_CMD11(PRNG_DATA, temp, 0x104);
-	
-	while(outsize)
+
+	kirk_fill_prng_pool();
+	prng_pool_pos = 0;
+}
+
+int kirk_CMD14(u8 * outbuff, int outsize)
+{
+	int size;
+
+	// Requests are served from the pool, a SHA1 is only run once per refill.
+	while (outsize > 0)
 	{
-		int blockrem = outsize %0x14;
-		int block = outsize /0x14;
-
-		if(block)
-		{
-			memcpy(outbuff, PRNG_DATA, 0x14);
-			outbuff += 0x14;
-			outsize -= 0x14;
-			kirk_CMD14(outbuff, outsize);
-		} else {
-			if(blockrem)
-			{
-				memcpy(outbuff, PRNG_DATA, blockrem);
-				outsize -= blockrem;
-			}
-		}
+		if (prng_pool_pos == KIRK_PRNG_POOL_SIZE)
+			kirk_refill_prng_pool();
+
+		size = KIRK_PRNG_POOL_SIZE - prng_pool_pos;
+		if (size > outsize)
+			size = outsize;
+		memcpy(outbuff, prng_pool + prng_pool_pos, size);
+
+		// Bytes handed out are not kept.
+		memset(prng_pool + prng_pool_pos, 0, size);
+		prng_pool_pos += size;
+		outbuff += size;
+		outsize -= size;
 	}
 	
 	return KIRK_OPERATION_SUCCESS;
@@ -552,21 +608,13 @@ int kirk_CMD16(u8 * outbuff, int outsize, u8 * inbuff, int insize)
 {
 	u8 dec_private[0x20];
 	KIRK_CMD16_BUFFER * signbuf = (KIRK_CMD16_BUFFER *) inbuff;
-	ECDSA_SIG * sig = (ECDSA_SIG *) outbuff;
 	
 	if (insize != 0x34) return KIRK_INVALID_SIZE;
 	if (outsize != 0x28) return KIRK_INVALID_SIZE;
 	
 	decrypt_kirk16_private(dec_private,signbuf->enc_private);
 	
-	// Clear out the padding for safety
-	memset(&dec_private[0x14], 0, 0xC);
-	
-	ecdsa_set_curve(ec_p,ec_a,ec_b2,ec_N2,Gx2,Gy2);
-	ecdsa_set_priv(dec_private);
-	ecdsa_sign(signbuf->message_hash,sig->r, sig->s);
-	
-	return KIRK_OPERATION_SUCCESS;
+	return kirk_ecdsa_sign(dec_private, signbuf->message_hash, outbuff);
 }
 
 int kirk_CMD17(u8 * inbuff, int insize)
@@ -575,10 +623,66 @@ int kirk_CMD17(u8 * inbuff, int insize)
 	
 	if (insize != 0x64) return KIRK_INVALID_SIZE;
 	
+	return kirk_ecdsa_verify(sig->public_key.x, sig->message_hash, sig->signature.r);
+}
+
+// Typed operations
+int kirk_sha1(const u8 *data, int size, u8 *hash)
+{
+	SHA_CTX sha;
+
+	if (is_kirk_initialized == 0) return KIRK_NOT_INITIALIZED;
+	if (size <= 0) return KIRK_DATA_SIZE_ZERO;
+
+	SHAInit(&sha);
+	SHAUpdate(&sha, (u8 *)data, size);
+	SHAFinal(hash, &sha);
+
+	return KIRK_OPERATION_SUCCESS;
+}
+
+int kirk_aes_cbc_keyseed(int keyseed, const u8 *in, u8 *out, int size, int mode)
+{
+	AES_ctx aesKey;
+	u8 *key;
+
+	if (is_kirk_initialized == 0) return KIRK_NOT_INITIALIZED;
+	if (size <= 0) return KIRK_DATA_SIZE_ZERO;
+
+	key = kirk_4_7_get_key(keyseed);
+	if (key == (u8*)KIRK_INVALID_SIZE) return KIRK_INVALID_SIZE;
+
+	AES_set_key(&aesKey, key, 128);
+	if (mode == KIRK_MODE_ENCRYPT_CBC)
+		AES_cbc_encrypt(&aesKey, (u8 *)in, out, size);
+	else if (mode == KIRK_MODE_DECRYPT_CBC)
+		AES_cbc_decrypt(&aesKey, (u8 *)in, out, size);
+	else
+		return KIRK_INVALID_MODE;
+
+	return KIRK_OPERATION_SUCCESS;
+}
+
+int kirk_ecdsa_sign(const u8 *private_key, const u8 *hash, u8 *sig)
+{
+	u8 k[0x14];
+
+	// Copied, the curve code does not take const buffers.
+	memcpy(k, private_key, 0x14);
 	ecdsa_set_curve(ec_p,ec_a,ec_b2,ec_N2,Gx2,Gy2);
-	ecdsa_set_pub(sig->public_key.x);
-	
-	if (ecdsa_verify(sig->message_hash,sig->signature.r,sig->signature.s)) {
+	ecdsa_set_priv(k);
+	ecdsa_sign((u8 *)hash, sig, sig + 0x14);
+	memset(k, 0, 0x14);
+
+	return KIRK_OPERATION_SUCCESS;
+}
+
+int kirk_ecdsa_verify(const u8 *public_key, const u8 *hash, const u8 *sig)
+{
+	ecdsa_set_curve(ec_p,ec_a,ec_b2,ec_N2,Gx2,Gy2);
+	ecdsa_set_pub((u8 *)public_key);
+
+	if (ecdsa_verify((u8 *)hash, (u8 *)sig, (u8 *)sig + 0x14)) {
 		return KIRK_OPERATION_SUCCESS;
 	} else {
 		return KIRK_SIG_CHECK_INVALID;
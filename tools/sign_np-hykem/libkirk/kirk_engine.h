@@ -200,6 +200,12 @@ typedef struct
 
 int kirk_init();
 int kirk_init2(u8 *, u32, u32, u32);
+// Reseed the PRNG from seed only, its output (keys, padding, ECDSA nonces) is then reproducible.
+int kirk_seed_prng(u8 *seed, u32 seed_size);
+// PRNG state and pool position, saved by an interrupted run and restored to continue it with the same output.
+#define KIRK_PRNG_STATE_SIZE 0x19
+void kirk_save_prng(u8 *state);
+void kirk_restore_prng(const u8 *state);
 int kirk_CMD0(u8* outbuff, u8* inbuff, int size, int generate_trash);
 int kirk_CMD1(u8* outbuff, u8* inbuff, int size);
 int kirk_CMD1_ex(u8* outbuff, u8* inbuff, int size, KIRK_CMD1_HEADER* header);
@@ -213,6 +219,20 @@ int kirk_CMD14(u8* outbuff, int outsize);
 int kirk_CMD16(u8* outbuff, int outsize,u8* inbuff, int insize);
 int kirk_CMD17(u8* inbuff, int insize);
 
+/*
+	Typed operations on caller buffers, without the command headers. The
+	emulated commands above (and sceUtilsBufferCopyWithRange) are built on them.
+	They return KIRK_OPERATION_SUCCESS or a KIRK error code.
+*/
+// KIRK_CMD_SHA1_HASH of size bytes.
+int kirk_sha1(const u8 *data, int size, u8 *hash);
+// KIRK_CMD_ENCRYPT_IV_0 or KIRK_CMD_DECRYPT_IV_0 (mode KIRK_MODE_ENCRYPT_CBC or KIRK_MODE_DECRYPT_CBC) with a keyseed key, size is a multiple of 16.
+int kirk_aes_cbc_keyseed(int keyseed, const u8 *in, u8 *out, int size, int mode);
+// KIRK_CMD_ECDSA_SIGN with a plain 0x14 byte private key, sig is r then s (0x28 bytes).
+int kirk_ecdsa_sign(const u8 *private_key, const u8 *hash, u8 *sig);
+// KIRK_CMD_ECDSA_VERIFY with a 0x28 byte public key.
+int kirk_ecdsa_verify(const u8 *public_key, const u8 *hash, const u8 *sig);
+
 // Internal functions
 u8* kirk_4_7_get_key(int key_type);
 void decrypt_kirk16_private(u8 *dA_out, u8 *dA_enc);
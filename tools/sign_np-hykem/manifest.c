@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "manifest.h"
+#include "npumdimg.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*
+	File layout (text, one entry per line, hashes in hex):
+	  # psp-sign-np manifest
+	  version 1
+	  hash xxh64
+	  size <file size>
+	  header <offset> <size> <hash>
+	  table <offset> <size> <hash>
+	  block <index> <offset> <size> <hash>   (one per block)
+*/
+
+// Bytes hashed by a -check-manifest job, at least.
+#define MANIFEST_JOB_SIZE	0x400000
+
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+
+static u64 rotl64(u64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static u64 read64(const u8 *p)
+{
+	u64 v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static u32 read32(const u8 *p)
+{
+	u32 v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static u64 xxh64_round(u64 acc, u64 input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static u64 xxh64_merge(u64 acc, u64 val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+u64 manifest_xxh64(const u8 *data, size_t size, u64 seed)
+{
+	const u8 *p = data;
+	const u8 *end = data + size;
+	u64 h;
+
+	if (size >= 32)
+	{
+		u64 v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		u64 v2 = seed + XXH_PRIME64_2;
+		u64 v3 = seed;
+		u64 v4 = seed - XXH_PRIME64_1;
+
+		do
+		{
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	}
+	else
+		h = seed + XXH_PRIME64_5;
+
+	h += (u64)size;
+
+	for (; p + 8 <= end; p += 8)
+		h = rotl64(h ^ xxh64_round(0, read64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	if (p + 4 <= end)
+	{
+		h = rotl64(h ^ ((u64)read32(p) * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl64(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+char *manifest_name(const char *pbp_name)
+{
+	char *name = (char *) malloc(strlen(pbp_name) + 10);
+
+	strcpy(name, pbp_name);
+	strcat(name, ".manifest");
+	return name;
+}
+
+int manifest_init(MANIFEST *m, long long blocks, long long first)
+{
+	m->blocks = blocks;
+	m->first = first;
+	m->hash = (u64 *) calloc(blocks, sizeof(u64));
+
+	return (m->hash != NULL) ? 0 : -1;
+}
+
+void manifest_free(MANIFEST *m)
+{
+	free(m->hash);
+	m->hash = NULL;
+}
+
+void manifest_block(MANIFEST *m, long long block, const u8 *data, int size)
+{
+	m->hash[block] = manifest_xxh64(data, size, 0);
+}
+
+// Hash size bytes of the file at offset.
+static int hash_range(int fd, long long offset, long long size, u64 *hash)
+{
+	u8 *buf = (u8 *) malloc(size ? size : 1);
+	int ret = -1;
+
+	if (buf != NULL && read_at(fd, buf, size, offset) == 0)
+	{
+		*hash = manifest_xxh64(buf, size, 0);
+		ret = 0;
+	}
+
+	free(buf);
+	return ret;
+}
+
+int manifest_write(MANIFEST *m, const char *path, int fd, long long table_offset, u8 *table_buf)
+{
+	long long np_offset = table_offset - 0x100;
+	long long table_size = m->blocks * 0x20;
+	long long end = table_offset + table_size;
+	long long i;
+	u64 hash;
+	u8 tb[0x20];
+
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+
+	fprintf(f, "# psp-sign-np manifest\nversion %d\nhash xxh64\n", MANIFEST_VERSION);
+
+	// The blocks follow the table, the size of the file comes from the last one.
+	for (i = 0; i < m->blocks; i++)
+	{
+		memcpy(tb, table_buf + i * 0x20, 0x20);
+		encrypt_table(tb);
+		end = np_offset + *(u32*)(tb + 0x10) + ((*(u32*)(tb + 0x14) + 15) &~ 15);
+	}
+	fprintf(f, "size %lld\n", end);
+
+	if (hash_range(fd, 0, table_offset, &hash) != 0)
+		goto fail;
+	fprintf(f, "header 0 %lld %016llx\n", table_offset, (unsigned long long)hash);
+	fprintf(f, "table %lld %lld %016llx\n", table_offset, table_size, (unsigned long long)manifest_xxh64(table_buf, table_size, 0));
+
+	for (i = 0; i < m->blocks; i++)
+	{
+		memcpy(tb, table_buf + i * 0x20, 0x20);
+		encrypt_table(tb);
+		long long offset = np_offset + *(u32*)(tb + 0x10);
+		long long size = (*(u32*)(tb + 0x14) + 15) &~ 15;
+
+		hash = m->hash[i];
+		if (i < m->first && hash_range(fd, offset, size, &hash) != 0)
+			goto fail;
+		fprintf(f, "block %lld %lld %lld %016llx\n", i, offset, size, (unsigned long long)hash);
+	}
+
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+
+fail:
+	fclose(f);
+	remove(path);
+	return -1;
+}
+
+int manifest_update_header(const char *path, int fd)
+{
+	char line[256];
+	long long offset, size;
+	unsigned long long old_hash;
+	u64 hash;
+	int found = 0;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return (errno == ENOENT) ? 1 : -1;
+
+	char *tmp_name = tmp_path(path);
+	FILE *out = (tmp_name != NULL) ? fopen(tmp_name, "w") : NULL;
+	if (out == NULL)
+	{
+		fclose(f);
+		free(tmp_name);
+		return -1;
+	}
+
+	// Copy the manifest, with the header hashed again.
+	while (fgets(line, sizeof(line), f))
+	{
+		if (!found && sscanf(line, "header %lld %lld %llx", &offset, &size, &old_hash) == 3)
+		{
+			if (hash_range(fd, offset, size, &hash) != 0)
+				break;
+			fprintf(out, "header %lld %lld %016llx\n", offset, size, (unsigned long long)hash);
+			found = 1;
+		}
+		else
+			fputs(line, out);
+	}
+
+	int ok = feof(f) && found;
+	fclose(f);
+	if (fclose(out) != 0 || !ok || replace_file(tmp_name, path) != 0)
+	{
+		remove(tmp_name);
+		free(tmp_name);
+		return -1;
+	}
+	free(tmp_name);
+	return 0;
+}
+
+typedef struct {
+	long long offset;
+	long long size;
+	u64 hash;
+	char kind;					// h (header), t (table) or b (block).
+	long long index;
+} MANIFEST_ENTRY;
+
+typedef struct {
+	int fd;
+	const u8 *base;				// The mapped file, NULL to read it.
+	MANIFEST_ENTRY *entries;
+	int n;
+	int bad;					// First entry that does not match, -1 if none.
+} MANIFEST_JOB;
+
+static void manifest_job(void *arg)
+{
+	MANIFEST_JOB *job = (MANIFEST_JOB *) arg;
+	int i;
+
+	for (i = 0; i < job->n && job->bad < 0; i++)
+	{
+		MANIFEST_ENTRY *e = &job->entries[i];
+		u64 hash;
+
+		if (job->base)
+			hash = manifest_xxh64(job->base + e->offset, e->size, 0);
+		else if (hash_range(job->fd, e->offset, e->size, &hash) != 0)
+			hash = ~e->hash;
+
+		if (hash != e->hash)
+			job->bad = i;
+	}
+}
+
+// Read the entries of a manifest, in file order. Returns their number, -1 if it cannot be used.
+static int manifest_read(const char *path, long long *size, MANIFEST_ENTRY **entries)
+{
+	char line[256], kind[16];
+	int version = 0, hashed = 0, n = 0, max = 0;
+	unsigned long long hash;
+	MANIFEST_ENTRY e;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	*size = -1;
+	*entries = NULL;
+	while (fgets(line, sizeof(line), f))
+	{
+		memset(&e, 0, sizeof(e));
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		else if (sscanf(line, "version %d", &version) == 1 || sscanf(line, "size %lld", size) == 1)
+			continue;
+		else if (sscanf(line, "hash %15s", kind) == 1)
+			hashed = !strcmp(kind, "xxh64");
+		else if (sscanf(line, "block %lld %lld %lld %llx", &e.index, &e.offset, &e.size, &hash) == 4)
+			e.kind = 'b';
+		else if (sscanf(line, "%15s %lld %lld %llx", kind, &e.offset, &e.size, &hash) == 4 && (!strcmp(kind, "header") || !strcmp(kind, "table")))
+			e.kind = kind[0];
+		else
+			break;
+
+		if (e.kind == 0)
+			continue;
+		if (n == max)
+		{
+			max = max ? max * 2 : 1024;
+			*entries = (MANIFEST_ENTRY *) realloc(*entries, max * sizeof(MANIFEST_ENTRY));
+		}
+		e.hash = hash;
+		(*entries)[n++] = e;
+	}
+
+	if (!feof(f) || version != MANIFEST_VERSION || !hashed || *size < 0)
+		n = -1;
+	fclose(f);
+
+	if (n < 0)
+	{
+		free(*entries);
+		*entries = NULL;
+	}
+	return n;
+}
+
+const char *manifest_check(const char *name, const char *path, tpool *pool)
+{
+	static char block_msg[32];
+	MANIFEST_ENTRY *entries = NULL;
+	MANIFEST_JOB *jobs = NULL;
+	const u8 *base = NULL;
+	const char *ret = NULL;
+	struct stat st;
+	long long size, pos;
+	int n, i, job_nr;
+
+	int fd = open(name, O_RDONLY | O_BINARY);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return "open";
+	}
+
+	n = manifest_read(path, &size, &entries);
+	if (n <= 0)
+	{
+		ret = "manifest";
+		goto out;
+	}
+	if (st.st_size != size)
+	{
+		ret = "size";
+		goto out;
+	}
+
+	// Every byte of the file is hashed once.
+	for (i = 0, pos = 0; i < n; i++)
+	{
+		if (entries[i].offset != pos || entries[i].size < 0)
+			break;
+		pos += entries[i].size;
+	}
+	if (i < n || pos != size)
+	{
+		ret = "manifest coverage";
+		goto out;
+	}
+
+#ifndef _WIN32
+	base = (const u8 *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == (const u8 *) MAP_FAILED)
+		base = NULL;
+	else
+		madvise((void *) base, size, MADV_SEQUENTIAL);
+#endif
+
+	// Runs of entries of a few MB each.
+	jobs = (MANIFEST_JOB *) calloc(n, sizeof(MANIFEST_JOB));
+	for (i = 0, job_nr = 0; i < n; job_nr++)
+	{
+		MANIFEST_JOB *job = &jobs[job_nr];
+		long long bytes = 0;
+
+		job->fd = fd;
+		job->base = base;
+		job->entries = entries + i;
+		job->bad = -1;
+		while (i < n && (job->n == 0 || bytes < MANIFEST_JOB_SIZE))
+		{
+			bytes += entries[i++].size;
+			job->n++;
+		}
+		tpool_submit(pool, manifest_job, job);
+	}
+	tpool_wait(pool);
+
+	for (i = 0; i < job_nr && ret == NULL; i++)
+	{
+		if (jobs[i].bad < 0)
+			continue;
+
+		MANIFEST_ENTRY *e = &jobs[i].entries[jobs[i].bad];
+		if (e->kind == 'h')
+			ret = "header";
+		else if (e->kind == 't')
+			ret = "table";
+		else
+		{
+			snprintf(block_msg, sizeof(block_msg), "block %lld", e->index);
+			ret = block_msg;
+		}
+	}
+
+#ifndef _WIN32
+	if (base)
+		munmap((void *) base, size);
+#endif
+
+out:
+	free(jobs);
+	free(entries);
+	close(fd);
+	return ret;
+}
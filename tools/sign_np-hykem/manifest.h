@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "tpool.h"
+#include "utils.h"
+
+#define MANIFEST_VERSION 1
+
+/*
+	Hashes of a PBP as it was written, kept in <output>.manifest (--manifest).
+	The file is covered from start to end: the header (PBP header, entries
+	and NPUMDIMG header), the table, then each block as stored. The hashes
+	are XXH64, so the file can be checked at disk speed without any key.
+*/
+typedef struct {
+	long long blocks;
+	long long first;			// Blocks before this one were written by an earlier run, they are read back.
+	u64 *hash;
+} MANIFEST;
+
+// 64-bit xxHash of size bytes.
+u64 manifest_xxh64(const u8 *data, size_t size, u64 seed);
+
+// Name of the manifest of an output, to free.
+char *manifest_name(const char *pbp_name);
+
+int manifest_init(MANIFEST *m, long long blocks, long long first);
+void manifest_free(MANIFEST *m);
+
+// Hash a block as it is written to the output.
+void manifest_block(MANIFEST *m, long long block, const u8 *data, int size);
+
+/*
+	Write the manifest of a finished output. fd is the output, the header is
+	read back from it, table_buf is the table as written. Returns 0 on success.
+*/
+int manifest_write(MANIFEST *m, const char *path, int fd, long long table_offset, u8 *table_buf);
+
+/*
+	Hash the header of fd again after it was rewritten in place (-update-meta),
+	the rest of the manifest is kept. Returns 0 on success, 1 if there is no
+	manifest at path.
+*/
+int manifest_update_header(const char *path, int fd);
+
+/*
+	Check a file against a manifest, the hashes over the pool. Returns NULL
+	if it matches, else the name of the first failed check.
+*/
+const char *manifest_check(const char *name, const char *path, tpool *pool);
+
+#endif
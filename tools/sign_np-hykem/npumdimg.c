@@ -0,0 +1,437 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "npumdimg.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define MB (1024.0 * 1024.0)
+
+u8 npumdimg_public_key[0x28] = {
+		0x01, 0x21, 0xEA, 0x6E, 0xCD, 0xB2, 0x3A, 0x3E,
+		0x23, 0x75, 0x67, 0x1C, 0x53, 0x62, 0xE8, 0xE2,
+		0x8B, 0x1E, 0x78, 0x3B, 0x1A, 0x27, 0x32, 0x15,
+		0x8B, 0x8C, 0xED, 0x98, 0x46, 0x6C, 0x18, 0xA3,
+		0xAC, 0x3B, 0x11, 0x06, 0xAF, 0xB4, 0xEC, 0x3B
+};
+
+typedef struct {
+	NPUMDIMG *np;
+	u8 *data;		// Stored block, decrypted in place.
+	u8 *out;		// Decompression buffer.
+	u8 *result;		// Decoded block (data or out).
+	u32 offset;
+	u32 size;
+	u8 mac[0x10];
+	int last;
+	int out_size;	// Decoded size, -1 for a bad block.
+} NPUMDIMG_JOB;
+
+typedef struct {
+	NPUMDIMG_JOB *jobs;
+	int count;
+	u8 *buf;
+} NPUMDIMG_BATCH;
+
+void encrypt_table(u8 *table)
+{
+	u32 *p = (u32*)table;
+	u32 k0, k1, k2, k3;
+
+	k0 = p[0]^p[1];
+	k1 = p[1]^p[2];
+	k2 = p[0]^p[3];
+	k3 = p[2]^p[3];
+
+	p[4] ^= k3;
+	p[5] ^= k1;
+	p[6] ^= k2;
+	p[7] ^= k0;
+}
+
+int npumdimg_open(NPUMDIMG *np, const char *pbp_name, u8 *version_key)
+{
+	MAC_KEY mkey;
+	CIPHER_KEY ckey;
+	struct stat st;
+	u8 pbp_header[0x28];
+
+	memset(np, 0, sizeof(NPUMDIMG));
+	np->fd = open(pbp_name, O_RDONLY | O_BINARY);
+	if (np->fd < 0 || fstat(np->fd, &st) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot open %s\n", pbp_name);
+		goto fail;
+	}
+	np->pbp_size = st.st_size;
+
+	// DATA.PSAR holds the NPUMDIMG image.
+	if (read_at(np->fd, pbp_header, 0x28, 0) != 0 || *(u32*)pbp_header != PBP_MAGIC)
+	{
+		fprintf(stderr, "ERROR: Invalid PBP header!\n");
+		goto fail;
+	}
+	np->np_offset = *(u32*)(pbp_header + 0x24);
+
+	if (read_at(np->fd, &np->header, 0x100, np->np_offset) != 0 || memcmp(np->header.magic, "NPUMDIMG", 8) != 0)
+	{
+		fprintf(stderr, "ERROR: No NPUMDIMG image in %s\n", pbp_name);
+		goto fail;
+	}
+
+	// Test the header hash, or recover the version key from it.
+	sceDrmBBMacInit(&mkey, 3);
+	sceDrmBBMacUpdate(&mkey, (u8 *)&np->header, 0xC0);
+	if (version_key != NULL && !isEmpty(version_key, 0x10))
+	{
+		memcpy(np->version_key, version_key, 0x10);
+		if (sceDrmBBMacFinal2(&mkey, np->header.header_hash, np->version_key))
+		{
+			fprintf(stderr, "ERROR: Invalid NPUMDIMG header hash!\n");
+			goto fail;
+		}
+	}
+	else
+	{
+		bbmac_getkey(&mkey, np->header.header_hash, np->version_key);
+	}
+
+	// Decrypt NPUMDIMG body.
+	sceDrmBBCipherInit(&ckey, 1, 2, np->header.header_key, np->version_key, 0);
+	sceDrmBBCipherUpdate(&ckey, (u8 *)&np->header + 0x40, 0x60);
+	sceDrmBBCipherFinal(&ckey);
+
+	int block_basis = np->header.block_basis;
+	long long table_offset = np->np_offset + np->header.body.block_entry_offset;
+	if (block_basis <= 0 || block_basis > 0x100 || np->header.body.lba_end >= 0x7FFFFFFF)
+	{
+		fprintf(stderr, "ERROR: Invalid NPUMDIMG header!\n");
+		goto fail;
+	}
+
+	np->block_size = block_basis * 2048;
+	np->block_nr = (np->header.body.lba_end + 1) / block_basis;
+	if (table_offset + (long long)np->block_nr * 0x20 > np->pbp_size)
+	{
+		fprintf(stderr, "ERROR: Truncated NPUMDIMG table!\n");
+		goto fail;
+	}
+
+	np->table = (u8 *) malloc (np->block_nr * 0x20);
+	if (np->table == NULL || read_at(np->fd, np->table, np->block_nr * 0x20, table_offset) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot read NPUMDIMG table\n");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	npumdimg_close(np);
+	return -1;
+}
+
+void npumdimg_close(NPUMDIMG *np)
+{
+	if (np->fd >= 0)
+		close(np->fd);
+	free(np->table);
+	np->fd = -1;
+	np->table = NULL;
+}
+
+int npumdimg_check_table(NPUMDIMG *np)
+{
+	MAC_KEY mkey;
+
+	// Test the table hash (data key).
+	sceDrmBBMacInit(&mkey, 3);
+	sceDrmBBMacUpdate(&mkey, np->table, np->block_nr * 0x20);
+
+	return sceDrmBBMacFinal2(&mkey, np->header.data_key, np->version_key) ? -1 : 0;
+}
+
+int npumdimg_check_signature(NPUMDIMG *np)
+{
+	u8 header[0xD8];
+	u8 hash[0x14];
+
+	// The signature covers the header as stored, with the body encrypted.
+	if (read_at(np->fd, header, 0xD8, np->np_offset) != 0)
+		return -1;
+
+	if (kirk_sha1(header, 0xD8, hash) != 0)
+		return -1;
+
+	return (kirk_ecdsa_verify(npumdimg_public_key, hash, np->header.ecdsa_sig) != 0) ? -1 : 0;
+}
+
+void npumdimg_get_entry(NPUMDIMG *np, int block, u32 *offset, u32 *size, u8 *mac)
+{
+	u8 tb[0x20];
+
+	memcpy(tb, np->table + block * 0x20, 0x20);
+	encrypt_table(tb);
+
+	*offset = *(u32*)(tb + 0x10);
+	*size = *(u32*)(tb + 0x14);
+	if (mac != NULL)
+		memcpy(mac, tb, 0x10);
+}
+
+static int npumdimg_batch_init(NPUMDIMG_BATCH *batch, NPUMDIMG *np, tpool *pool)
+{
+	batch->count = tpool_threads(pool) * 4;
+	batch->jobs = (NPUMDIMG_JOB *) calloc (batch->count, sizeof(NPUMDIMG_JOB));
+	batch->buf = (u8 *) malloc ((long long)batch->count * np->block_size * 2);
+
+	if (batch->jobs == NULL || batch->buf == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot allocate NPUMDIMG buffers\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void npumdimg_batch_free(NPUMDIMG_BATCH *batch)
+{
+	free(batch->jobs);
+	free(batch->buf);
+}
+
+/*
+	Read the blocks [first, first + n) and run func on each of them over the
+	pool. Blocks with an invalid entry or that cannot be read are left with
+	out_size -1.
+*/
+static void npumdimg_batch_run(NPUMDIMG_BATCH *batch, NPUMDIMG *np, int first, int n, tpool_func func, tpool *pool)
+{
+	int j;
+
+	for (j = 0; j < n; j++)
+	{
+		NPUMDIMG_JOB *job = &batch->jobs[j];
+
+		job->np = np;
+		job->data = batch->buf + (long long)j * np->block_size * 2;
+		job->out = job->data + np->block_size;
+		job->result = NULL;
+		job->last = (first + j == np->block_nr - 1);
+		job->out_size = -1;
+		npumdimg_get_entry(np, first + j, &job->offset, &job->size, job->mac);
+
+		if (job->size == 0 || job->size > (u32)np->block_size ||
+			read_at(np->fd, job->data, job->size, np->np_offset + job->offset) != 0)
+			continue;
+
+		tpool_submit(pool, func, job);
+	}
+	tpool_wait(pool);
+}
+
+static void npumdimg_check_block(void *arg)
+{
+	NPUMDIMG_JOB *job = (NPUMDIMG_JOB *) arg;
+	MAC_KEY mkey;
+
+	// Test the block MAC hash.
+	sceDrmBBMacInit(&mkey, 3);
+	sceDrmBBMacUpdate(&mkey, job->data, job->size);
+	if (sceDrmBBMacFinal2(&mkey, job->mac, job->np->version_key) == 0)
+		job->out_size = job->size;
+}
+
+int npumdimg_check_blocks(NPUMDIMG *np, tpool *pool)
+{
+	NPUMDIMG_BATCH batch;
+	int bad = -1;
+	int i, j;
+
+	if (npumdimg_batch_init(&batch, np, pool) != 0)
+	{
+		npumdimg_batch_free(&batch);
+		return 0;
+	}
+
+	// Stop with the batch holding the first bad block.
+	for (i = 0; i < np->block_nr && bad < 0; i += batch.count)
+	{
+		int n = (np->block_nr - i < batch.count) ? np->block_nr - i : batch.count;
+
+		npumdimg_batch_run(&batch, np, i, n, npumdimg_check_block, pool);
+
+		for (j = 0; j < n; j++)
+		{
+			if (batch.jobs[j].out_size < 0)
+			{
+				bad = i + j;
+				break;
+			}
+		}
+	}
+
+	npumdimg_batch_free(&batch);
+	return bad;
+}
+
+static void npumdimg_decode_block(void *arg)
+{
+	NPUMDIMG_JOB *job = (NPUMDIMG_JOB *) arg;
+	NPUMDIMG *np = job->np;
+	MAC_KEY mkey;
+	CIPHER_KEY ckey;
+
+	job->out_size = -1;
+
+	// Test the block MAC hash.
+	sceDrmBBMacInit(&mkey, 3);
+	sceDrmBBMacUpdate(&mkey, job->data, job->size);
+	if (sceDrmBBMacFinal2(&mkey, job->mac, np->version_key))
+		return;
+
+	// Decrypt block.
+	sceDrmBBCipherInit(&ckey, 1, 2, np->header.header_key, np->version_key, job->offset >> 4);
+	sceDrmBBCipherUpdate(&ckey, job->data, job->size);
+	sceDrmBBCipherFinal(&ckey);
+
+	// Full blocks are stored as is, shorter ones are compressed. The last
+	// block can also be stored as is, when it is the ISO tail.
+	if (job->size == (u32)np->block_size)
+	{
+		job->result = job->data;
+		job->out_size = job->size;
+	}
+	else if (lzrc_decompress(job->out, np->block_size, job->data, job->size) == np->block_size)
+	{
+		job->result = job->out;
+		job->out_size = np->block_size;
+	}
+	else if (job->last)
+	{
+		job->result = job->data;
+		job->out_size = job->size;
+	}
+}
+
+// Size of the ISO9660 volume from its primary volume descriptor, or 0.
+static long long npumdimg_volume_size(int fd)
+{
+	u8 pvd[0x800];
+
+	if (read_at(fd, pvd, 0x800, 16 * 0x800) != 0 || pvd[0] != 1 || memcmp(pvd + 1, "CD001", 5) != 0)
+		return 0;
+
+	return (long long)(*(u32*)(pvd + 80)) * 0x800;
+}
+
+int npumdimg_unpack(NPUMDIMG *np, const char *iso_name, tpool *pool, NPUMDIMG_STATS *stats)
+{
+	NPUMDIMG_BATCH batch;
+	int block_size = np->block_size;
+	long long iso_size = 0;
+	int last_packed = 0;
+	int bad = 0, first_bad = -1;
+	double start = get_time();
+	int i, j;
+
+	memset(stats, 0, sizeof(NPUMDIMG_STATS));
+
+	// An existing ISO is only replaced once the new one is complete.
+	char *tmp_name = tmp_path(iso_name);
+	int out_fd = (tmp_name != NULL) ? open(tmp_name, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644) : -1;
+	if (out_fd < 0)
+	{
+		fprintf(stderr, "ERROR: Cannot create %s\n", iso_name);
+		free(tmp_name);
+		return -1;
+	}
+
+	if (npumdimg_batch_init(&batch, np, pool) != 0)
+	{
+		stats->failed = -1;
+		goto out;
+	}
+
+	// Decode a batch of blocks over the pool, then write them.
+	for (i = 0; i < np->block_nr; i += batch.count)
+	{
+		int n = (np->block_nr - i < batch.count) ? np->block_nr - i : batch.count;
+
+		npumdimg_batch_run(&batch, np, i, n, npumdimg_decode_block, pool);
+
+		for (j = 0; j < n; j++)
+		{
+			NPUMDIMG_JOB *job = &batch.jobs[j];
+			long long pos = (long long)(i + j) * block_size;
+
+			if (job->out_size < 0)
+			{
+				if (bad++ == 0)
+					first_bad = i + j;
+				stats->failed++;
+				continue;
+			}
+
+			if (write_at(out_fd, job->result, job->out_size, pos) != 0)
+			{
+				fprintf(stderr, "ERROR: Cannot write %s\n", iso_name);
+				stats->failed = -1;
+				goto out;
+			}
+
+			iso_size = pos + job->out_size;
+			last_packed = (job->result == job->out);
+			stats->bytes += job->out_size;
+		}
+
+		stats->blocks += n;
+	}
+
+	// A compressed last block is zero padded, cut the ISO to its volume size.
+	if (last_packed)
+	{
+		long long volume_size = npumdimg_volume_size(out_fd);
+		if (volume_size > iso_size - block_size && volume_size < iso_size)
+		{
+			stats->bytes -= iso_size - volume_size;
+			iso_size = volume_size;
+		}
+	}
+
+	if (ftruncate(out_fd, iso_size) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot write %s\n", iso_name);
+		stats->failed = -1;
+	}
+
+out:
+	if (close(out_fd) != 0 && stats->failed == 0)
+		stats->failed = -1;
+	if (stats->failed == 0 && replace_file(tmp_name, iso_name) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot write %s\n", iso_name);
+		stats->failed = -1;
+	}
+	else if (stats->failed)
+		remove(tmp_name);
+	free(tmp_name);
+	npumdimg_batch_free(&batch);
+
+	if (bad)
+		fprintf(stderr, "ERROR: %d bad NPUMDIMG block(s), the first is block %d\n", bad, first_bad);
+
+	stats->seconds = get_time() - start;
+	if (stats->failed >= 0)
+	{
+		printf("%d block(s), %d failed, %.2f MB, %.2f MB/s\n", stats->blocks, stats->failed, stats->bytes / MB,
+			(stats->seconds > 0) ? stats->bytes / MB / stats->seconds : 0.0);
+	}
+
+	return stats->failed;
+}
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef NPUMDIMG_H
+#define NPUMDIMG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libkirk/kirk_engine.h"
+#include "libkirk/amctrl.h"
+#include "tlzrc.h"
+#include "tpool.h"
+#include "utils.h"
+
+#define PBP_MAGIC 0x50425000
+
+typedef struct {
+	u16 sector_size; 	// 0x0800
+	u16 unk_2;			// 0xE000
+	u32 unk_4;
+	u32 unk_8;
+	u32 unk_12;
+	u32 unk_16;
+	u32 lba_start;
+	u32 unk_24;
+	u32 nsectors;
+	u32 unk_32;
+	u32 lba_end;
+	u32 unk_40;
+	u32 block_entry_offset;
+	char disc_id[0x10];
+	u32 header_start_offset;
+	u32 unk_68;
+	u8 unk_72;
+	u8 bbmac_param;
+	u8 unk_74;
+	u8 unk_75;
+	u32 unk_76;
+	u32 unk_80;
+	u32 unk_84;
+	u32 unk_88;
+	u32 unk_92;
+} NPUMDIMG_HEADER_BODY;
+
+typedef struct {
+	u8 magic[0x08];  // NPUMDIMG
+	u32 np_flags;
+	u32 block_basis;
+	u8 content_id[0x30];
+	NPUMDIMG_HEADER_BODY body;
+	u8 header_key[0x10];
+	u8 data_key[0x10];
+	u8 header_hash[0x10];
+	u8 padding[0x8];
+	u8 ecdsa_sig[0x28];
+} NPUMDIMG_HEADER;
+
+// An NPUMDIMG image opened from a PBP, with its header body decrypted.
+typedef struct {
+	int fd;
+	long long np_offset;	// NPUMDIMG header offset in the PBP (DATA.PSAR).
+	long long pbp_size;
+	NPUMDIMG_HEADER header;
+	u8 version_key[0x10];
+	int block_size;
+	int block_nr;
+	u8 *table;				// Block table, as stored (encrypted).
+} NPUMDIMG;
+
+typedef struct {
+	int blocks;
+	int failed;
+	long long bytes;
+	double seconds;
+} NPUMDIMG_STATS;
+
+// Key used to check the NPUMDIMG and DATA.PSP signatures.
+extern u8 npumdimg_public_key[0x28];
+
+// Scramble (or unscramble) a block table entry in place.
+void encrypt_table(u8 *table);
+
+/*
+	Open the NPUMDIMG image of a PBP. The header hash is checked with the
+	version key, or the version key is recovered from it when the key is
+	empty. Returns 0 on success.
+*/
+int npumdimg_open(NPUMDIMG *np, const char *pbp_name, u8 *version_key);
+void npumdimg_close(NPUMDIMG *np);
+
+// Test the table hash (data key) and the ECDSA signature of the header.
+int npumdimg_check_table(NPUMDIMG *np);
+int npumdimg_check_signature(NPUMDIMG *np);
+
+/*
+	Test the MAC hash of every block, spread over the pool. Stops with the
+	first bad block and returns its index, or -1 if all the blocks are valid.
+*/
+int npumdimg_check_blocks(NPUMDIMG *np, tpool *pool);
+
+// Unscrambled offset (relative to the header), size and MAC of a block.
+void npumdimg_get_entry(NPUMDIMG *np, int block, u32 *offset, u32 *size, u8 *mac);
+
+/*
+	Decrypt and decompress every block of the image into the ISO file. The
+	blocks are spread over the pool. Returns the number of bad blocks, or -1
+	if the ISO could not be written.
+*/
+int npumdimg_unpack(NPUMDIMG *np, const char *iso_name, tpool *pool, NPUMDIMG_STATS *stats);
+
+#endif
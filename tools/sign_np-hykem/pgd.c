@@ -7,55 +7,45 @@
 static u8 dnas_key1A90[] = {0xED, 0xE2, 0x5D, 0x2D, 0xBB, 0xF8, 0x12, 0xE5, 0x3C, 0x5C, 0x59, 0x32, 0xFA, 0xE3, 0xE2, 0x43};
 static u8 dnas_key1AA0[] = {0x27, 0x74, 0xFB, 0xEB, 0xA4, 0xA0, 0x01, 0xD7, 0x02, 0x56, 0x9E, 0x33, 0x8C, 0x19, 0x57, 0x83};
 
-/*
-	PGD encrypt function.
-*/
-int encrypt_pgd(u8* data, int data_size, int block_size, int key_index, int drm_type, int flag, u8* key, u8* pgd_data)
-{	
-	MAC_KEY mkey;
-	CIPHER_KEY ckey;
-
-	// Additional size variables.
-	int data_offset = 0x90;
-	int align_size = (data_size + 15) &~ 15;
-	int table_offset = data_offset + align_size;
-	int block_nr = ((align_size + block_size - 1) &~ (block_size - 1)) / block_size;
-	int pgd_size = 0x90 + align_size + block_nr * 16;
-	
-	// Build new PGD header.
-	u8* pgd = (u8 *) malloc (pgd_size);
-	memset(pgd, 0, pgd_size);
-	memcpy(pgd + data_offset, data, data_size);
+// Amount of data processed at once by encrypt_pgd_file and decrypt_pgd_file.
+#define PGD_CHUNK_SIZE 0x100000
 
-	// Set magic PGD.
-	pgd[0] = 0x00;
-	pgd[1] = 0x50;
-	pgd[2] = 0x47;
-	pgd[3] = 0x44;
-
-	// Set key index and drm type.
-	*(u32*)(pgd + 4) = key_index;
-	*(u32*)(pgd + 8) = drm_type;
-	
-	// Select the hashing, crypto and open modes.
+typedef struct {
+	u8 *data;
+	u8 *table;
+	int size;
+	int block_size;
+	u32 offset;
 	int mac_type;
 	int cipher_type;
+	u8 *data_key;
+	u8 *key;
+	int error;
+} PGD_JOB;
+
+/*
+	PGD helper functions.
+*/
+static u8 *pgd_select_modes(int drm_type, int key_index, int flag, int *mac_type, int *cipher_type)
+{
 	int open_flag = flag;
+
+	// Select the hashing, crypto and open modes.
 	if (drm_type == 1)
 	{
-		mac_type = 1;
+		*mac_type = 1;
 		open_flag |= 4;
 		if (key_index > 1)
 		{
-			mac_type = 3;
+			*mac_type = 3;
 			open_flag |= 8;
 		}
-		cipher_type = 1;
+		*cipher_type = 1;
 	}
 	else
 	{
-		mac_type = 2;
-		cipher_type = 2;
+		*mac_type = 2;
+		*cipher_type = 2;
 	}
 	
 	// Select the fixed DNAS key.
@@ -66,42 +56,39 @@ int encrypt_pgd(u8* data, int data_size, int block_size, int key_index, int drm_
 		fkey = dnas_key1AA0;
 
 	if (fkey == NULL)
-	{
 		printf("PGD: Invalid PGD DNAS flag! %08x\n", flag);
-		return -1;
-	}
-	
+
+	return fkey;
+}
+
+static void pgd_build_header(u8 *pgd, int data_size, int block_size, int key_index, int drm_type)
+{
+	memset(pgd, 0, 0x90);
+
+	// Set magic PGD.
+	pgd[0] = 0x00;
+	pgd[1] = 0x50;
+	pgd[2] = 0x47;
+	pgd[3] = 0x44;
+
+	// Set key index and drm type.
+	*(u32*)(pgd + 4) = key_index;
+	*(u32*)(pgd + 8) = drm_type;
+
 	// Set the decryption parameters in the decrypted header.
 	*(u32*)(pgd + 0x44) = data_size;
 	*(u32*)(pgd + 0x48) = block_size;
-	*(u32*)(pgd + 0x4C) = data_offset;
+	*(u32*)(pgd + 0x4C) = 0x90;
 	
 	// Generate random header and data keys.
 	sceUtilsBufferCopyWithRange(pgd + 0x10, 0x30, 0, 0, KIRK_CMD_PRNG);
-	
-	// Encrypt the data.
-	sceDrmBBCipherInit(&ckey, cipher_type, 2, pgd + 0x30, key, 0);
-	sceDrmBBCipherUpdate(&ckey, pgd + data_offset, align_size);
-	sceDrmBBCipherFinal(&ckey);
-	
-	// Build data MAC hash.
-	int i;
-	for (i = 0; i < block_nr; i++)
-	{
-		int rsize = align_size - i * block_size;
-		if (rsize > block_size)
-			rsize = block_size;
+}
+
+static void pgd_finish_header(u8 *pgd, int mac_type, int cipher_type, u8 *key, u8 *fkey)
+{
+	MAC_KEY mkey;
+	CIPHER_KEY ckey;
 
-		sceDrmBBMacInit(&mkey, mac_type);
-		sceDrmBBMacUpdate(&mkey, pgd + data_offset + i * block_size, rsize);
-		sceDrmBBMacFinal(&mkey, pgd + table_offset + i * 16, key);
-	}
-	
-	// Build table MAC hash.
-	sceDrmBBMacInit(&mkey, mac_type);
-	sceDrmBBMacUpdate(&mkey, pgd + table_offset, block_nr * 16);
-	sceDrmBBMacFinal(&mkey, pgd + 0x60, key);
-	
 	// Encrypt the PGD header block (0x30 bytes).
 	sceDrmBBCipherInit(&ckey, cipher_type, 2, pgd + 0x10, key, 0);
 	sceDrmBBCipherUpdate(&ckey, pgd + 0x30, 0x30);
@@ -116,13 +103,262 @@ int encrypt_pgd(u8* data, int data_size, int block_size, int key_index, int drm_
 	sceDrmBBMacInit(&mkey, mac_type);
 	sceDrmBBMacUpdate(&mkey, pgd + 0x00, 0x80);
 	sceDrmBBMacFinal(&mkey, pgd + 0x80, fkey);
+}
+
+/*
+	Encrypt and MAC a run of data blocks. The cipher seed only depends on
+	the data offset, so every run can be processed on its own.
+*/
+static void pgd_encrypt_blocks(void *arg)
+{
+	PGD_JOB *job = (PGD_JOB *) arg;
+	MAC_KEY mkey;
+	CIPHER_KEY ckey;
+	int i;
+	
+	// Encrypt the data.
+	sceDrmBBCipherInit(&ckey, job->cipher_type, 2, job->data_key, job->key, job->offset >> 4);
+	sceDrmBBCipherUpdate(&ckey, job->data, job->size);
+	sceDrmBBCipherFinal(&ckey);
+	
+	// Build data MAC hash.
+	for (i = 0; i * job->block_size < job->size; i++)
+	{
+		int rsize = job->size - i * job->block_size;
+		if (rsize > job->block_size)
+			rsize = job->block_size;
+
+		sceDrmBBMacInit(&mkey, job->mac_type);
+		sceDrmBBMacUpdate(&mkey, job->data + i * job->block_size, rsize);
+		sceDrmBBMacFinal(&mkey, job->table + i * 16, job->key);
+	}
+}
+
+/*
+	Decrypt a run of data blocks, checking each block MAC first.
+*/
+static void pgd_decrypt_blocks(void *arg)
+{
+	PGD_JOB *job = (PGD_JOB *) arg;
+	MAC_KEY mkey;
+	CIPHER_KEY ckey;
+	int i;
+
+	// Test data MAC hash.
+	for (i = 0; i * job->block_size < job->size; i++)
+	{
+		int rsize = job->size - i * job->block_size;
+		if (rsize > job->block_size)
+			rsize = job->block_size;
+
+		sceDrmBBMacInit(&mkey, job->mac_type);
+		sceDrmBBMacUpdate(&mkey, job->data + i * job->block_size, rsize);
+		if (sceDrmBBMacFinal2(&mkey, job->table + i * 16, job->key))
+		{
+			job->error = 1;
+			return;
+		}
+	}
+
+	// Decrypt the data.
+	sceDrmBBCipherInit(&ckey, job->cipher_type, 2, job->data_key, job->key, job->offset >> 4);
+	sceDrmBBCipherUpdate(&ckey, job->data, job->size);
+	sceDrmBBCipherFinal(&ckey);
+}
+
+/*
+	Split a chunk of csize bytes (data offset pos) in runs of job_blocks
+	blocks and process them on the pool. Returns the number of failed runs.
+*/
+static int pgd_process_chunk(PGD_JOB *jobs, PGD_JOB *tmpl, u8 *chunk, u8 *table, int csize, int pos, int job_blocks, tpool_func func, tpool *pool)
+{
+	int j, jpos, errors = 0;
+
+	for (j = 0, jpos = 0; jpos < csize; j++, jpos += job_blocks * tmpl->block_size)
+	{
+		jobs[j] = *tmpl;
+		jobs[j].data = chunk + jpos;
+		jobs[j].table = table + j * job_blocks * 16;
+		jobs[j].size = (csize - jpos < job_blocks * tmpl->block_size) ? csize - jpos : job_blocks * tmpl->block_size;
+		jobs[j].offset = pos + jpos;
+		jobs[j].error = 0;
+		tpool_submit(pool, func, &jobs[j]);
+	}
+	tpool_wait(pool);
+
+	while (j--)
+		errors += jobs[j].error;
+
+	return errors;
+}
+
+int pgd_file_size(int data_size, int block_size)
+{
+	int align_size = (data_size + 15) &~ 15;
+	int block_nr = ((align_size + block_size - 1) &~ (block_size - 1)) / block_size;
+
+	return 0x90 + align_size + block_nr * 16;
+}
+
+/*
+	PGD encrypt function.
+*/
+int encrypt_pgd(u8* data, int data_size, int block_size, int key_index, int drm_type, int flag, u8* key, u8* pgd_data)
+{	
+	MAC_KEY mkey;
+	PGD_JOB job;
+
+	// Additional size variables.
+	int data_offset = 0x90;
+	int align_size = (data_size + 15) &~ 15;
+	int table_offset = data_offset + align_size;
+	int block_nr = ((align_size + block_size - 1) &~ (block_size - 1)) / block_size;
+	int pgd_size = 0x90 + align_size + block_nr * 16;
+	
+	// Select the hashing, crypto and open modes.
+	int mac_type;
+	int cipher_type;
+	u8* fkey = pgd_select_modes(drm_type, key_index, flag, &mac_type, &cipher_type);
+	if (fkey == NULL)
+		return -1;
+	
+	// Build new PGD header.
+	u8* pgd = (u8 *) malloc (pgd_size);
+	memset(pgd, 0, pgd_size);
+	pgd_build_header(pgd, data_size, block_size, key_index, drm_type);
+	memcpy(pgd + data_offset, data, data_size);
+	
+	// Encrypt the data and build the data MAC hashes.
+	job.data = pgd + data_offset;
+	job.table = pgd + table_offset;
+	job.size = align_size;
+	job.block_size = block_size;
+	job.offset = 0;
+	job.mac_type = mac_type;
+	job.cipher_type = cipher_type;
+	job.data_key = pgd + 0x30;
+	job.key = key;
+	pgd_encrypt_blocks(&job);
+	
+	// Build table MAC hash.
+	sceDrmBBMacInit(&mkey, mac_type);
+	sceDrmBBMacUpdate(&mkey, pgd + table_offset, block_nr * 16);
+	sceDrmBBMacFinal(&mkey, pgd + 0x60, key);
+	
+	pgd_finish_header(pgd, mac_type, cipher_type, key, fkey);
 	
 	// Copy back the generated PGD file.
 	memcpy(pgd_data, pgd, pgd_size);
+	free(pgd);
 
 	return pgd_size;
 }
 
+/*
+	Streaming PGD encrypt function.
+	Reads data_size bytes from in and writes the PGD file at offset in fd.
+	Data is processed PGD_CHUNK_SIZE bytes at a time, split between the
+	pool threads, and the header is written last.
+*/
+int encrypt_pgd_file(FILE *in, int data_size, int block_size, int key_index, int drm_type, int flag, u8* key, int fd, long long offset, tpool *pool)
+{
+	MAC_KEY mkey;
+	PGD_JOB tmpl;
+	u8 pgd[0x90];
+	int i;
+	int ret = -1;
+
+	// Additional size variables.
+	int data_offset = 0x90;
+	int align_size = (data_size + 15) &~ 15;
+	int table_offset = data_offset + align_size;
+	int block_nr = ((align_size + block_size - 1) &~ (block_size - 1)) / block_size;
+	int pgd_size = 0x90 + align_size + block_nr * 16;
+	
+	// Select the hashing, crypto and open modes.
+	int mac_type;
+	int cipher_type;
+	u8* fkey = pgd_select_modes(drm_type, key_index, flag, &mac_type, &cipher_type);
+	if (fkey == NULL)
+		return -1;
+	
+	pgd_build_header(pgd, data_size, block_size, key_index, drm_type);
+
+	// Split each chunk in a few runs of blocks per thread.
+	int chunk_blocks = (PGD_CHUNK_SIZE > block_size) ? PGD_CHUNK_SIZE / block_size : 1;
+	int job_count = tpool_threads(pool) * 4;
+	if (job_count > chunk_blocks)
+		job_count = chunk_blocks;
+	int job_blocks = (chunk_blocks + job_count - 1) / job_count;
+
+	u8 *chunk = (u8 *) malloc (chunk_blocks * block_size);
+	u8 *table = (u8 *) malloc (chunk_blocks * 16);
+	PGD_JOB *jobs = (PGD_JOB *) malloc (job_count * sizeof(PGD_JOB));
+	if (chunk == NULL || table == NULL || jobs == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot allocate PGD buffers\n");
+		goto out;
+	}
+
+	tmpl.block_size = block_size;
+	tmpl.mac_type = mac_type;
+	tmpl.cipher_type = cipher_type;
+	tmpl.data_key = pgd + 0x30;
+	tmpl.key = key;
+
+	// The table is MAC'ed as it is written out.
+	sceDrmBBMacInit(&mkey, mac_type);
+
+	for (i = 0; i < block_nr; i += chunk_blocks)
+	{
+		int pos = i * block_size;
+		int nblocks = (block_nr - i < chunk_blocks) ? block_nr - i : chunk_blocks;
+		int csize = (align_size - pos < chunk_blocks * block_size) ? align_size - pos : chunk_blocks * block_size;
+		int rsize = (data_size - pos < csize) ? data_size - pos : csize;
+
+		// Read plain data, the last chunk is zero padded.
+		memset(chunk + rsize, 0, csize - rsize);
+		if ((int)fread(chunk, 1, rsize, in) != rsize)
+		{
+			fprintf(stderr, "ERROR: Cannot read PGD input data\n");
+			goto out;
+		}
+
+		// Encrypt the data and build the data MAC hashes.
+		pgd_process_chunk(jobs, &tmpl, chunk, table, csize, pos, job_blocks, pgd_encrypt_blocks, pool);
+
+		sceDrmBBMacUpdate(&mkey, table, nblocks * 16);
+
+		if (write_at(fd, chunk, csize, offset + data_offset + pos) != 0 ||
+			write_at(fd, table, nblocks * 16, offset + table_offset + i * 16) != 0)
+		{
+			fprintf(stderr, "ERROR: Cannot write PGD data\n");
+			goto out;
+		}
+	}
+
+	// Build table MAC hash.
+	sceDrmBBMacFinal(&mkey, pgd + 0x60, key);
+
+	pgd_finish_header(pgd, mac_type, cipher_type, key, fkey);
+
+	// Write the header last.
+	if (write_at(fd, pgd, 0x90, offset) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot write PGD header\n");
+		goto out;
+	}
+
+	ret = pgd_size;
+
+out:
+	free(chunk);
+	free(table);
+	free(jobs);
+
+	return ret;
+}
+
 /*
 	PGD decrypt function.
 */
@@ -248,4 +484,167 @@ int decrypt_pgd(u8* pgd_data, int pgd_size, int flag, u8* key)
 	sceDrmBBCipherFinal(&ckey);
 
 	return pgd.data_size;
-}
\ No newline at end of file
+}
+
+/*
+	Streaming PGD decrypt function.
+	Reads the PGD file of pgd_size bytes at in_offset in in_fd and writes the
+	plain data at offset 0 in out_fd. Unlike decrypt_pgd, every block MAC is
+	checked. If key is empty the version key is recovered and stored in key.
+*/
+int decrypt_pgd_file(int in_fd, long long in_offset, int pgd_size, int flag, u8* key, int out_fd, tpool *pool)
+{
+	MAC_KEY mkey;
+	CIPHER_KEY ckey;
+	PGD_JOB tmpl;
+	u8 pgd[0x90];
+	int i, pos;
+	int ret = -1;
+	u8 *chunk = NULL;
+	u8 *table = NULL;
+	PGD_JOB *jobs = NULL;
+
+	if (pgd_size < 0x90 || read_at(in_fd, pgd, 0x90, in_offset) != 0 || memcmp(pgd, "\0PGD", 4) != 0)
+	{
+		printf("PGD: Invalid PGD header!\n");
+		return -1;
+	}
+
+	// Set the hashing, crypto and open modes.
+	int key_index = *(u32*)(pgd + 4);
+	int drm_type = *(u32*)(pgd + 8);
+	int mac_type;
+	int cipher_type;
+	u8* fkey = pgd_select_modes(drm_type, key_index, flag, &mac_type, &cipher_type);
+	if (fkey == NULL)
+		return -1;
+
+	// Test MAC hash at 0x80 (DNAS hash).
+	sceDrmBBMacInit(&mkey, mac_type);
+	sceDrmBBMacUpdate(&mkey, pgd, 0x80);
+	if (sceDrmBBMacFinal2(&mkey, pgd + 0x80, fkey))
+	{
+		printf("PGD: Invalid PGD 0x80 MAC hash!\n");
+		return -1;
+	}
+
+	// Test MAC hash at 0x70 (key hash), or generate the key from it.
+	sceDrmBBMacInit(&mkey, mac_type);
+	sceDrmBBMacUpdate(&mkey, pgd, 0x70);
+	if (!isEmpty(key, 0x10))
+	{
+		if (sceDrmBBMacFinal2(&mkey, pgd + 0x70, key))
+		{
+			printf("PGD: Invalid PGD 0x70 MAC hash!\n");
+			return -1;
+		}
+	}
+	else
+	{
+		bbmac_getkey(&mkey, pgd + 0x70, key);
+	}
+
+	// Decrypt the PGD header block (0x30 bytes).
+	sceDrmBBCipherInit(&ckey, cipher_type, 2, pgd + 0x10, key, 0);
+	sceDrmBBCipherUpdate(&ckey, pgd + 0x30, 0x30);
+	sceDrmBBCipherFinal(&ckey);
+
+	// Get the decryption parameters from the decrypted header.
+	int data_size = *(u32*)(pgd + 0x44);
+	int block_size = *(u32*)(pgd + 0x48);
+	int data_offset = *(u32*)(pgd + 0x4C);
+
+	if (data_size < 0 || block_size < 16 || (block_size & (block_size - 1)) || data_offset != 0x90)
+	{
+		printf("ERROR: Invalid PGD data size!\n");
+		return -1;
+	}
+
+	// Additional size variables.
+	int align_size = (data_size + 15) &~ 15;
+	int table_offset = data_offset + align_size;
+	int block_nr = ((align_size + block_size - 1) &~ (block_size - 1)) / block_size;
+
+	if ((long long)table_offset + block_nr * 16 > pgd_size)
+	{
+		printf("ERROR: Invalid PGD data size!\n");
+		return -1;
+	}
+
+	int chunk_blocks = (PGD_CHUNK_SIZE > block_size) ? PGD_CHUNK_SIZE / block_size : 1;
+	int job_count = tpool_threads(pool) * 4;
+	if (job_count > chunk_blocks)
+		job_count = chunk_blocks;
+	int job_blocks = (chunk_blocks + job_count - 1) / job_count;
+
+	chunk = (u8 *) malloc (chunk_blocks * block_size);
+	table = (u8 *) malloc (chunk_blocks * 16);
+	jobs = (PGD_JOB *) malloc (job_count * sizeof(PGD_JOB));
+	if (chunk == NULL || table == NULL || jobs == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot allocate PGD buffers\n");
+		goto out;
+	}
+
+	// Test MAC hash at 0x60 (table hash).
+	sceDrmBBMacInit(&mkey, mac_type);
+	for (pos = 0; pos < block_nr * 16; pos += chunk_blocks * 16)
+	{
+		int tsize = (block_nr * 16 - pos < chunk_blocks * 16) ? block_nr * 16 - pos : chunk_blocks * 16;
+
+		if (read_at(in_fd, table, tsize, in_offset + table_offset + pos) != 0)
+		{
+			fprintf(stderr, "ERROR: Cannot read PGD table\n");
+			goto out;
+		}
+		sceDrmBBMacUpdate(&mkey, table, tsize);
+	}
+	if (sceDrmBBMacFinal2(&mkey, pgd + 0x60, key))
+	{
+		printf("ERROR: Invalid PGD 0x60 MAC hash!\n");
+		goto out;
+	}
+
+	tmpl.block_size = block_size;
+	tmpl.mac_type = mac_type;
+	tmpl.cipher_type = cipher_type;
+	tmpl.data_key = pgd + 0x30;
+	tmpl.key = key;
+
+	for (i = 0; i < block_nr; i += chunk_blocks)
+	{
+		pos = i * block_size;
+		int nblocks = (block_nr - i < chunk_blocks) ? block_nr - i : chunk_blocks;
+		int csize = (align_size - pos < chunk_blocks * block_size) ? align_size - pos : chunk_blocks * block_size;
+		int wsize = (data_size - pos < csize) ? data_size - pos : csize;
+
+		if (read_at(in_fd, chunk, csize, in_offset + data_offset + pos) != 0 ||
+			read_at(in_fd, table, nblocks * 16, in_offset + table_offset + i * 16) != 0)
+		{
+			fprintf(stderr, "ERROR: Cannot read PGD data\n");
+			goto out;
+		}
+
+		// Test the data MAC hashes and decrypt the data.
+		if (pgd_process_chunk(jobs, &tmpl, chunk, table, csize, pos, job_blocks, pgd_decrypt_blocks, pool))
+		{
+			printf("ERROR: Invalid PGD data MAC hash!\n");
+			goto out;
+		}
+
+		if (write_at(out_fd, chunk, wsize, pos) != 0)
+		{
+			fprintf(stderr, "ERROR: Cannot write PGD data\n");
+			goto out;
+		}
+	}
+
+	ret = data_size;
+
+out:
+	free(chunk);
+	free(table);
+	free(jobs);
+
+	return ret;
+}
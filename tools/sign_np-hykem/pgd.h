@@ -2,6 +2,9 @@
    SPDX-FileCopyrightText: 2015 Hykem <hykem@hotmail.com>
    SPDX-License-Identifier: GPL-3.0-only */
 
+#ifndef PGD_H
+#define PGD_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +12,7 @@
 #include "libkirk/kirk_engine.h"
 #include "libkirk/amctrl.h"
 #include "utils.h"
+#include "tpool.h"
 
 typedef struct {
 	unsigned char vkey[16];
@@ -29,5 +33,10 @@ typedef struct {
 	unsigned char *buf;
 } PGD_HEADER;
 
+int pgd_file_size(int data_size, int block_size);
 int encrypt_pgd(u8* data, int data_size, int block_size, int key_index, int drm_type, int flag, u8* key, u8* pgd_data);
-int decrypt_pgd(u8* pgd_data, int pgd_size, int flag, u8* key);
\ No newline at end of file
+int encrypt_pgd_file(FILE *in, int data_size, int block_size, int key_index, int drm_type, int flag, u8* key, int fd, long long offset, tpool *pool);
+int decrypt_pgd(u8* pgd_data, int pgd_size, int flag, u8* key);
+int decrypt_pgd_file(int in_fd, long long in_offset, int pgd_size, int flag, u8* key, int out_fd, tpool *pool);
+
+#endif
@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pgdtree.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef __MINGW32__
+#define mkdir(path, mode) mkdir(path)
+#endif
+
+#define MB (1024.0 * 1024.0)
+
+// Largest file that still fits the 32 bit PGD sizes.
+#define PGD_TREE_MAX_SIZE 0x7F000000
+
+static int pgd_tree_file(const char *in_name, const char *out_name, int decrypt, u8 *key, tpool *pool, PGD_TREE_STATS *stats)
+{
+	struct stat st;
+	double start = get_time();
+	int ret = -1;
+
+	if (stat(in_name, &st) != 0 || st.st_size > PGD_TREE_MAX_SIZE)
+	{
+		fprintf(stderr, "ERROR: Cannot process %s\n", in_name);
+		return -1;
+	}
+
+	if (same_file(in_name, out_name))
+	{
+		fprintf(stderr, "ERROR: %s would be its own output\n", in_name);
+		return -1;
+	}
+
+	// An existing output is only replaced once the new one is complete.
+	char *tmp_name = tmp_path(out_name);
+	int out_fd = (tmp_name != NULL) ? open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644) : -1;
+	if (out_fd < 0)
+	{
+		fprintf(stderr, "ERROR: Cannot create %s\n", out_name);
+		free(tmp_name);
+		return -1;
+	}
+
+	if (decrypt)
+	{
+		// The version key may be recovered from each file.
+		u8 file_key[0x10];
+		memcpy(file_key, key, 0x10);
+
+		int in_fd = open(in_name, O_RDONLY | O_BINARY);
+		if (in_fd >= 0)
+		{
+			ret = decrypt_pgd_file(in_fd, 0, (int)st.st_size, 2, file_key, out_fd, pool);
+			close(in_fd);
+		}
+	}
+	else
+	{
+		FILE *in = fopen(in_name, "rb");
+		if (in != NULL)
+		{
+			ret = encrypt_pgd_file(in, (int)st.st_size, PGD_TREE_BLOCK_SIZE, 1, 1, 2, key, out_fd, 0, pool);
+			fclose(in);
+		}
+	}
+
+	if (close(out_fd) != 0)
+		ret = -1;
+
+	if (ret < 0)
+	{
+		fprintf(stderr, "ERROR: Failed to %s %s\n", decrypt ? "decrypt" : "encrypt", in_name);
+		remove(tmp_name);
+		free(tmp_name);
+		return -1;
+	}
+
+	if (replace_file(tmp_name, out_name) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot create %s\n", out_name);
+		free(tmp_name);
+		return -1;
+	}
+	free(tmp_name);
+
+	double seconds = get_time() - start;
+	printf("%s: %.2f MB, %.2f MB/s\n", in_name, st.st_size / MB, (seconds > 0) ? st.st_size / MB / seconds : 0.0);
+
+	stats->bytes += st.st_size;
+	return 0;
+}
+
+// out_root is the output directory once created, it is not walked when inside the input.
+static void pgd_tree_walk(const char *in_name, const char *out_name, int decrypt, u8 *key, tpool *pool, PGD_TREE_STATS *stats, struct stat *out_root)
+{
+	struct stat st;
+
+	if (stat(in_name, &st) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot access %s\n", in_name);
+		stats->failed++;
+		return;
+	}
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		stats->files++;
+		if (pgd_tree_file(in_name, out_name, decrypt, key, pool, stats) != 0)
+			stats->failed++;
+		return;
+	}
+
+	// Inode numbers are all 0 on Windows.
+	if (out_root->st_ino != 0 && st.st_dev == out_root->st_dev && st.st_ino == out_root->st_ino)
+		return;
+
+	if (mkdir(out_name, 0755) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "ERROR: Cannot create directory %s\n", out_name);
+		stats->failed++;
+		return;
+	}
+	if (out_root->st_ino == 0 && stat(out_name, out_root) != 0)
+		memset(out_root, 0, sizeof(struct stat));
+
+	DIR *dir = opendir(in_name);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "ERROR: Cannot open directory %s\n", in_name);
+		stats->failed++;
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		size_t in_len = strlen(in_name) + strlen(ent->d_name) + 2;
+		size_t out_len = strlen(out_name) + strlen(ent->d_name) + 2;
+		char *in_path = (char *) malloc (in_len);
+		char *out_path = (char *) malloc (out_len);
+
+		if (in_path != NULL && out_path != NULL)
+		{
+			snprintf(in_path, in_len, "%s/%s", in_name, ent->d_name);
+			snprintf(out_path, out_len, "%s/%s", out_name, ent->d_name);
+			pgd_tree_walk(in_path, out_path, decrypt, key, pool, stats, out_root);
+		}
+		else
+		{
+			stats->failed++;
+		}
+
+		free(in_path);
+		free(out_path);
+	}
+
+	closedir(dir);
+}
+
+int pgd_tree(const char *input, const char *output, int decrypt, u8 *key, tpool *pool, PGD_TREE_STATS *stats)
+{
+	double start = get_time();
+	struct stat out_root;
+
+	memset(stats, 0, sizeof(PGD_TREE_STATS));
+	memset(&out_root, 0, sizeof(out_root));
+	pgd_tree_walk(input, output, decrypt, key, pool, stats, &out_root);
+	stats->seconds = get_time() - start;
+
+	printf("%d file(s), %d failed, %.2f MB, %.2f MB/s\n", stats->files, stats->failed, stats->bytes / MB,
+		(stats->seconds > 0) ? stats->bytes / MB / stats->seconds : 0.0);
+
+	return stats->failed;
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef PGDTREE_H
+#define PGDTREE_H
+
+#include "pgd.h"
+
+// PGD block size used for the files encrypted by pgd_tree.
+#define PGD_TREE_BLOCK_SIZE 0x800
+
+typedef struct {
+	int files;
+	int failed;
+	long long bytes;
+	double seconds;
+} PGD_TREE_STATS;
+
+/*
+	Encrypt (or decrypt) input into output with the version key. input can be
+	a single file or a directory, which is then processed recursively into
+	the output directory. Files are handled one at a time, their blocks are
+	spread over the pool. Returns the number of files that failed.
+*/
+int pgd_tree(const char *input, const char *output, int decrypt, u8 *key, tpool *pool, PGD_TREE_STATS *stats);
+
+#endif
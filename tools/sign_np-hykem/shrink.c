@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <ctype.h>
+#include <stdio.h>
+
+#include "shrink.h"
+#include "isoreader.h"
+
+// Volume descriptors are read from sector 16 up to the terminator.
+#define SHRINK_MAX_DESCRIPTORS 32
+
+typedef struct {
+	SHRINK *s;
+	const char *pattern;
+	u32 end;					// First sector past everything referenced.
+	int zero_max;
+} SHRINK_WALK;
+
+static u32 sectors(u32 size)
+{
+	return (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+static u32 get_be32(const u8 *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static u32 get_le32(const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+// Wildcard match of len pattern characters, * and ? as in a shell.
+static int match(const char *pattern, int len, const char *str)
+{
+	if (len == 0)
+		return *str == 0;
+
+	if (*pattern == '*')
+	{
+		for (;; str++)
+		{
+			if (match(pattern + 1, len - 1, str))
+				return 1;
+			if (*str == 0)
+				return 0;
+		}
+	}
+
+	if (*str == 0 || (*pattern != '?' && toupper((u8)*pattern) != toupper((u8)*str)))
+		return 0;
+
+	return match(pattern + 1, len - 1, str + 1);
+}
+
+static int match_list(const char *list, const char *path)
+{
+	const char *name = strrchr(path, '/');
+
+	name = name ? name + 1 : path;
+	while (*list)
+	{
+		const char *comma = strchr(list, ',');
+		int len = comma ? (int)(comma - list) : (int)strlen(list);
+
+		// Patterns with a directory match the whole path.
+		if (len > 0 && match(list, len, memchr(list, '/', len) ? path : name))
+			return 1;
+
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+
+	return 0;
+}
+
+static int shrink_record(const char *path, Iso9660DirectoryRecord *rec, void *arg)
+{
+	SHRINK_WALK *w = (SHRINK_WALK *) arg;
+	SHRINK *s = w->s;
+	u32 end = rec->lsbStart + sectors(rec->lsbDataLength);
+
+	if (end > w->end)
+		w->end = end;
+
+	if (!(rec->fileFlags & ISO9660_FILEFLAGS_DIR) && rec->lsbDataLength > 0 && match_list(w->pattern, path))
+	{
+		if (s->zero_nr == w->zero_max)
+		{
+			// Stops the walk, shrink_scan frees the ranges so far.
+			int max = w->zero_max ? w->zero_max * 2 : 16;
+			SHRINK_RANGE *zero = (SHRINK_RANGE *) realloc(s->zero, max * sizeof(SHRINK_RANGE));
+			if (zero == NULL)
+				return -1;
+			s->zero = zero;
+			w->zero_max = max;
+		}
+		s->zero[s->zero_nr].start = (long long)rec->lsbStart * SECTOR_SIZE;
+		s->zero[s->zero_nr].end = (long long)end * SECTOR_SIZE;
+		s->zero_nr++;
+		s->files++;
+	}
+
+	return 0;
+}
+
+static int compare_range(const void *a, const void *b)
+{
+	const SHRINK_RANGE *ra = (const SHRINK_RANGE *) a;
+	const SHRINK_RANGE *rb = (const SHRINK_RANGE *) b;
+
+	return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+int shrink_scan(SHRINK *s, const char *iso_name, long long iso_size, const char *pad_pattern)
+{
+	SHRINK_WALK w;
+	u8 sector[SECTOR_SIZE];
+	u32 lba;
+	int i, n;
+
+	memset(s, 0, sizeof(SHRINK));
+	memset(&w, 0, sizeof(w));
+	w.s = s;
+	w.pattern = pad_pattern;
+
+	if (isoOpen(iso_name) < 0)
+		return -1;
+
+	// Volume descriptors and the path tables of the primary one.
+	for (lba = 16; lba < 16 + SHRINK_MAX_DESCRIPTORS; lba++)
+	{
+		if (isoRead(sector, lba, 0, SECTOR_SIZE) != SECTOR_SIZE)
+			break;
+		w.end = lba + 1;
+		if (sector[0] == 1 && s->pvd == 0)
+		{
+			s->pvd = (long long)lba * SECTOR_SIZE;
+			u32 table_size = get_le32(sector + 132);
+			u32 tables[4] = {get_le32(sector + 140), get_le32(sector + 144), get_be32(sector + 148), get_be32(sector + 152)};
+			for (i = 0; i < 4; i++)
+			{
+				if (tables[i] != 0 && tables[i] + sectors(table_size) > w.end)
+					w.end = tables[i] + sectors(table_size);
+			}
+		}
+		else if (sector[0] == 255)
+			break;
+	}
+
+	if (isoWalk(shrink_record, &w) < 0)
+	{
+		isoClose();
+		shrink_free(s);
+		return -1;
+	}
+	isoClose();
+
+	s->iso_size = (long long)w.end * SECTOR_SIZE;
+	if (s->iso_size > iso_size)
+		s->iso_size = iso_size;
+	s->cut = iso_size - s->iso_size;
+
+	// Merge the ranges and keep them inside the image.
+	if (s->zero_nr > 0)
+		qsort(s->zero, s->zero_nr, sizeof(SHRINK_RANGE), compare_range);
+	for (i = 0, n = 0; i < s->zero_nr; i++)
+	{
+		SHRINK_RANGE r = s->zero[i];
+		if (r.end > s->iso_size)
+			r.end = s->iso_size;
+		if (r.start >= r.end)
+			continue;
+		if (n > 0 && r.start <= s->zero[n - 1].end)
+		{
+			if (r.end > s->zero[n - 1].end)
+				s->zero[n - 1].end = r.end;
+		}
+		else
+			s->zero[n++] = r;
+	}
+	s->zero_nr = n;
+	for (i = 0; i < n; i++)
+		s->zeroed += s->zero[i].end - s->zero[i].start;
+
+	return 0;
+}
+
+void shrink_free(SHRINK *s)
+{
+	free(s->zero);
+	s->zero = NULL;
+	s->zero_nr = 0;
+}
+
+void shrink_apply(SHRINK *s, u8 *buf, long long pos, int size)
+{
+	long long volume = s->pvd + 80;
+	u32 sectors = s->iso_size / SECTOR_SIZE;
+	int i;
+
+	// Volume space size, both endian.
+	if (s->cut > 0 && s->pvd > 0 && volume >= pos && volume + 8 <= pos + size)
+	{
+		u8 *p = buf + (volume - pos);
+		p[0] = sectors; p[1] = sectors >> 8; p[2] = sectors >> 16; p[3] = sectors >> 24;
+		p[4] = sectors >> 24; p[5] = sectors >> 16; p[6] = sectors >> 8; p[7] = sectors;
+	}
+
+	for (i = 0; i < s->zero_nr && s->zero[i].start < pos + size; i++)
+	{
+		long long start = (s->zero[i].start > pos) ? s->zero[i].start : pos;
+		long long end = (s->zero[i].end < pos + size) ? s->zero[i].end : pos + size;
+
+		if (start < end)
+			memset(buf + (start - pos), 0, end - start);
+	}
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef SHRINK_H
+#define SHRINK_H
+
+#include "utils.h"
+
+// Padding files of retail images, matched on the file name (--pad-pattern).
+#define SHRINK_PAD_PATTERN "DUMMY*.DAT"
+
+// A byte range of the ISO.
+typedef struct {
+	long long start;
+	long long end;
+} SHRINK_RANGE;
+
+/*
+	ISO shrinking pre-pass of -pbp (--shrink). The image is cut after its
+	last sector referenced by the volume descriptors, path tables,
+	directories or files, and the sectors of the padding files are read as
+	zeros. The volume size in the primary volume descriptor is lowered to
+	the cut. The ISO itself is not modified.
+*/
+typedef struct {
+	long long iso_size;			// Size of the image once cut.
+	long long cut;				// Bytes dropped from the end.
+	SHRINK_RANGE *zero;			// Padding file ranges, sorted.
+	int zero_nr;
+	long long zeroed;			// Bytes in the padding files.
+	int files;					// Padding files.
+	long long pvd;				// Offset of the primary volume descriptor, 0 if none.
+} SHRINK;
+
+/*
+	Walk the ISO9660 tree of the image. pad_pattern is a comma separated
+	list of names with * and ? wildcards, case insensitive, matched on the
+	whole path when it has a /. Returns 0 on success.
+*/
+int shrink_scan(SHRINK *s, const char *iso_name, long long iso_size, const char *pad_pattern);
+void shrink_free(SHRINK *s);
+
+// Zero the padding file bytes of the size bytes read from the ISO at pos.
+void shrink_apply(SHRINK *s, u8 *buf, long long pos, int size);
+
+#endif
@@ -5,6 +5,9 @@
 
 #define DEFAULT_DEVKIT_VER (620)
 
+// Stage timers of the -pbp mode (--stats).
+static SIGN_STATS sign_stats;
+
 #define TO_DEVKIT_VER(ver)              \
     ( (((ver) / 100) << 24)         +   \
       ((((ver) % 100) / 10) << 16)  +   \
@@ -96,20 +99,36 @@ int sfo_put_key(u8 *sfo_buf, char *name, void *value)
 	return -1;
 }
 
-void encrypt_table(u8 *table)
+// Set a string key of PARAM.SFO, within the space reserved for its value.
+int sfo_put_string(u8 *sfo_buf, char *name, const char *value)
 {
-	u32 *p = (u32*)table;
-	u32 k0, k1, k2, k3;
+	u32 i, offset;
+	u32 size = strlen(value) + 1;
+	SFO_Header *sfo = (SFO_Header*)sfo_buf;
+	SFO_Entry *sfo_keys = (SFO_Entry*)(sfo_buf + 0x14);
 
-	k0 = p[0]^p[1];
-	k1 = p[1]^p[2];
-	k2 = p[0]^p[3];
-	k3 = p[2]^p[3];
+	if (sfo->magic != PSF_MAGIC)
+		return -1;
+
+	for (i = 0; i < sfo->key_count; i++)
+	{
+		offset = sfo_keys[i].name_offset;
+		offset += sfo->key_offset;
+		
+		if (strcmp((char*)sfo_buf + offset, name) == 0)
+		{
+			if (size > sfo_keys[i].align_size)
+				return -1;
+			offset = sfo_keys[i].data_offset;
+			offset += sfo->val_offset;
+			memset(sfo_buf + offset, 0, sfo_keys[i].align_size);
+			memcpy(sfo_buf + offset, value, size);
+			sfo_keys[i].val_size = size;
+			return 0;
+		}
+	}
 
-	p[4] ^= k3;
-	p[5] ^= k1;
-	p[6] ^= k2;
-	p[7] ^= k0;
+	return -1;
 }
 
 NPUMDIMG_HEADER* forge_npumdimg(int iso_size, int iso_blocks, int block_basis, char *content_id, int np_flags, u8 *version_key, u8 *header_key, u8 *data_key)
@@ -205,71 +224,68 @@ NPUMDIMG_HEADER* forge_npumdimg(int iso_size, int iso_blocks, int block_basis, c
 	sceDrmBBMacFinal(&mck, np_header->header_hash, version_key);
 	bbmac_build_final2(3, np_header->header_hash);
 	
-	// Prepare the signature hash input buffer.
-	u8 npumdimg_sha1_inbuf[0xD8 + 0x4];
+	// Hash the header up to the signature.
 	u8 npumdimg_sha1_outbuf[0x14];
-	memset(npumdimg_sha1_inbuf, 0, 0xD8 + 0x4);
-	memset(npumdimg_sha1_outbuf, 0, 0x14);
-	
-	// Set SHA1 data size.
-	npumdimg_sha1_inbuf[0] = 0xD8;
-	memcpy(npumdimg_sha1_inbuf + 0x4, (u8 *)np_header, 0xD8);
-	
-	// Hash the input buffer.
-	if (sceUtilsBufferCopyWithRange(npumdimg_sha1_outbuf, 0x14, npumdimg_sha1_inbuf, 0xD8 + 0x4, KIRK_CMD_SHA1_HASH) != 0)
+	if (kirk_sha1((u8 *)np_header, 0xD8, npumdimg_sha1_outbuf) != 0)
 	{
 		fprintf(stderr, "ERROR: Failed to generate SHA1 hash for NPUMDIMG header!\n");
 		return NULL;
 	}
 	
-	// Prepare ECDSA signature buffer.
-	u8 npumdimg_sign_buf_in[0x34];
-	u8 npumdimg_sign_buf_out[0x28];
-	memset(npumdimg_sign_buf_in, 0, 0x34);
-	memset(npumdimg_sign_buf_out, 0, 0x28);
-	
-	// Create ECDSA key pair.
-	u8 npumdimg_keypair[0x3C];
-	memcpy(npumdimg_keypair, npumdimg_private_key, 0x14);
-	memcpy(npumdimg_keypair + 0x14, npumdimg_public_key, 0x28);
-		
-	// Encrypt NPUMDIMG private key.
-	u8 npumdimg_private_key_enc[0x20];
-	memset(npumdimg_private_key_enc, 0, 0x20);
-	encrypt_kirk16_private(npumdimg_private_key_enc, npumdimg_keypair);
-	
-	// Generate ECDSA signature.
-	memcpy(npumdimg_sign_buf_in, npumdimg_private_key_enc, 0x20);
-	memcpy(npumdimg_sign_buf_in + 0x20, npumdimg_sha1_outbuf, 0x14);
-	if (sceUtilsBufferCopyWithRange(npumdimg_sign_buf_out, 0x28, npumdimg_sign_buf_in, 0x34, KIRK_CMD_ECDSA_SIGN) != 0)
+	// Generate ECDSA signature, straight into the header.
+	double ecdsa_time = stats_begin(&sign_stats);
+	if (kirk_ecdsa_sign(npumdimg_private_key, npumdimg_sha1_outbuf, np_header->ecdsa_sig) != 0)
 	{
 		fprintf(stderr, "ERROR: Failed to generate ECDSA signature for NPUMDIMG header!\n");
 		return NULL;
 	}
 	
 	// Verify the generated ECDSA signature.
-	u8 test_npumdimg_sign[0x64];
-	memcpy(test_npumdimg_sign, npumdimg_public_key, 0x28);
-    memcpy(test_npumdimg_sign + 0x28, npumdimg_sha1_outbuf, 0x14);
-    memcpy(test_npumdimg_sign + 0x3C, npumdimg_sign_buf_out, 0x28);
-    if (sceUtilsBufferCopyWithRange(0, 0, test_npumdimg_sign, 0x64, KIRK_CMD_ECDSA_VERIFY) != 0)
+	if (kirk_ecdsa_verify(npumdimg_public_key, npumdimg_sha1_outbuf, np_header->ecdsa_sig) != 0)
 	{
 		fprintf(stderr, "ERROR: ECDSA signature for NPUMDIMG header is invalid!\n");
 		return NULL;
 	}
-	else
+	stats_end(&sign_stats, STATS_ECDSA, ecdsa_time, 0);
+	
+	return np_header;
+}
+
+// Sign PARAM.SFO and the content ID at 0x560 of DATA.PSP into its first 0x28 bytes.
+static int sign_data_psp(u8 *data_psp_buf, u8 *param_sfo_buf, int param_sfo_size)
+{
+	// Hash PARAM.SFO followed by the content ID, as KIRK_CMD_SHA1_HASH would, straight from the buffers.
+	u8 data_psp_sha1_outbuf[0x14];
+	SHA_CTX sha;
+	SHAInit(&sha);
+	SHAUpdate(&sha, param_sfo_buf, param_sfo_size);
+	SHAUpdate(&sha, data_psp_buf + 0x560, 0x30);
+	SHAFinal(data_psp_sha1_outbuf, &sha);
+	
+	// Generate ECDSA signature, straight into DATA.PSP.
+	double ecdsa_time = stats_begin(&sign_stats);
+	if (kirk_ecdsa_sign(npumdimg_private_key, data_psp_sha1_outbuf, data_psp_buf) != 0)
+	{
+		fprintf(stderr, "ERROR: Failed to generate ECDSA signature for DATA.PSP!\n");
+		return -1;
+	}
+	
+	// Verify the generated ECDSA signature.
+	if (kirk_ecdsa_verify(npumdimg_public_key, data_psp_sha1_outbuf, data_psp_buf) != 0)
 	{
-		// printf("ECDSA signature for NPUMDIMG header is valid!\n");
+		fprintf(stderr, "ERROR: ECDSA signature for DATA.PSP is invalid!\n");
+		return -1;
 	}
-
-	// Store the signature.
-	memcpy(np_header->ecdsa_sig, npumdimg_sign_buf_out, 0x28);
+	stats_end(&sign_stats, STATS_ECDSA, ecdsa_time, 0);
 	
-	return np_header;
+	return 0;
 }
 
-int write_pbp(FILE *f, char *iso_name, char *content_id, int np_flags, u8 *startdat_buf, int startdat_size, u8 *pgd_buf, int pgd_size)
+int write_pbp(FILE *f, char *iso_name, char *content_id, int np_flags, u8 *startdat_buf, int startdat_size, FILE *opnssmp, int opnssmp_size, u8 *version_key, int reserve, tpool *pool)
 {
+	int ret = 0;
+	int i;
+	
 	// Get all data files.
 	int param_sfo_size = 0;
 	int icon0_size = 0;
@@ -299,169 +315,496 @@ int write_pbp(FILE *f, char *iso_name, char *content_id, int np_flags, u8 *start
 	// Change category in PARAM.SFO.
 	sfo_put_key(param_sfo_buf, "CATEGORY", "EG");
 	
+	// OPNSSMP file is encrypted straight into the output file.
+	int pgd_block_size = 2048;
+	int pgd_size = (opnssmp) ? pgd_file_size(opnssmp_size, pgd_block_size) : 0;
+	
 	// Build DATA.PSP (content ID + flags).
 	// printf("Building DATA.PSP...\n");
 	int data_psp_size = 0x594 + ((startdat_size) ? startdat_size + 0xC : 0) + pgd_size;
-	u8 *data_psp_buf = (u8 *) malloc (data_psp_size);
-	memset(data_psp_buf, 0, data_psp_size);
+	int data_psp_head = data_psp_size - pgd_size;
+	u8 *data_psp_buf = (u8 *) malloc (data_psp_head);
+	memset(data_psp_buf, 0, data_psp_head);
 	memcpy(data_psp_buf + 0x560, content_id, strlen(content_id));
 	*(u32 *)(data_psp_buf + 0x590) = se32(np_flags);
 	
 	// DATA.PSP contains PARAM.SFO signature.
-	u8 *data_psp_param_buf = (u8 *) malloc (param_sfo_size + 0x30);
-	memset(data_psp_param_buf, 0, param_sfo_size + 0x30);
-	memcpy(data_psp_param_buf, param_sfo_buf, param_sfo_size);
-	memcpy(data_psp_param_buf + param_sfo_size, data_psp_buf + 0x560, 0x30);
-	
-	// Prepare the signature hash input buffer.
-	u8 *data_psp_sha1_inbuf = (u8 *) malloc (param_sfo_size + 0x30 + 0x4);
-	u8 data_psp_sha1_outbuf[0x14];
-	memset(data_psp_sha1_inbuf, 0, param_sfo_size + 0x30 + 0x4);
-	memset(data_psp_sha1_outbuf, 0, 0x14);
-	
-	// Set SHA1 data size.
-	*(u32 *)data_psp_sha1_inbuf = param_sfo_size + 0x30;
-	memcpy(data_psp_sha1_inbuf + 0x4, (u8*)data_psp_param_buf, param_sfo_size + 0x30);
-	
-	// Hash the input buffer.
-	if (sceUtilsBufferCopyWithRange(data_psp_sha1_outbuf, 0x14, data_psp_sha1_inbuf, param_sfo_size + 0x30 + 0x4, KIRK_CMD_SHA1_HASH) != 0)
-	{
-		fprintf(stderr, "ERROR: Failed to generate SHA1 hash for DATA.PSP!\n");
-		return 0;
-	}
-	
-	// Prepare ECDSA signature buffer.
-	u8 data_psp_sign_buf_in[0x34];
-	u8 data_psp_sign_buf_out[0x28];
-	memset(data_psp_sign_buf_in, 0, 0x34);
-	memset(data_psp_sign_buf_out, 0, 0x28);
-	
-	// Create ECDSA key pair.
-	u8 data_psp_keypair[0x3C];
-	memcpy(data_psp_keypair, npumdimg_private_key, 0x14);
-	memcpy(data_psp_keypair + 0x14, npumdimg_public_key, 0x28);
-	
-	// Encrypt NPUMDIMG private key.
-	u8 data_psp_private_key_enc[0x20];
-	memset(data_psp_private_key_enc, 0, 0x20);
-	encrypt_kirk16_private(data_psp_private_key_enc, data_psp_keypair);
-	
-	// Generate ECDSA signature.
-	memcpy(data_psp_sign_buf_in, data_psp_private_key_enc, 0x20);
-	memcpy(data_psp_sign_buf_in + 0x20, data_psp_sha1_outbuf, 0x14);
-	if (sceUtilsBufferCopyWithRange(data_psp_sign_buf_out, 0x28, data_psp_sign_buf_in, 0x34, KIRK_CMD_ECDSA_SIGN) != 0)
-	{
-		fprintf(stderr, "ERROR: Failed to generate ECDSA signature for DATA.PSP!\n");
-		return 0;
-	}
-	
-	// Verify the generated ECDSA signature.
-	u8 test_data_psp_sign[0x64];
-	memcpy(test_data_psp_sign, npumdimg_public_key, 0x28);
-    memcpy(test_data_psp_sign + 0x28, data_psp_sha1_outbuf, 0x14);
-    memcpy(test_data_psp_sign + 0x3C, data_psp_sign_buf_out, 0x28);
-    if (sceUtilsBufferCopyWithRange(0, 0, test_data_psp_sign, 0x64, KIRK_CMD_ECDSA_VERIFY) != 0)
-	{
-		fprintf(stderr, "ERROR: ECDSA signature for DATA.PSP is invalid!\n");
-		return 0;
-	}
-	else
-	{
-		// printf("ECDSA signature for DATA.PSP is valid!\n");
-	}
-
-	// Store the signature.
-	memcpy(data_psp_buf, data_psp_sign_buf_out, 0x28);
+	if (sign_data_psp(data_psp_buf, param_sfo_buf, param_sfo_size) != 0)
+		goto out;
 	
 	// Append STARTDAT file to DATA.PSP, if provided.
 	if (startdat_size)
 	{
 		int startdat_offset = 0x594 + 0xC;
 		memcpy(data_psp_buf + startdat_offset, startdat_buf, startdat_size);
-		
-		free(startdat_buf);
 	}
 	
 	// Append encrypted OPNSSMP file to DATA.PSP, if provided.
 	if (pgd_size)
 	{
 		int pgd_offset = (startdat_size) ? (0x594 + 0xC + startdat_size) : 0x594;
-		memcpy(data_psp_buf + pgd_offset, pgd_buf, pgd_size);
 		
 		// Store OPNSSMP offset and size.
 		*(u32 *)(data_psp_buf + 0x28 + 0x8) = pgd_offset;
 		*(u32 *)(data_psp_buf + 0x28 + 0x8 + 0x4) = pgd_size;
-		
-		free(pgd_buf);
 	}
 	
-	// Build empty DATA.PSAR.
+	// Set the PBP header: magic, then PARAM.SFO, ICON0.PNG, ICON1.PMF, PIC0.PNG, PIC1.PNG, SND0.AT3 and DATA.PSP.
+	u8 pbp_header[0x28];
+	memset(pbp_header, 0, 0x28);
+	*(u32*)(pbp_header + 0) = 0x50425000;
+	*(u32*)(pbp_header + 4) = 0x00010001;
+	
+	// The entries are written from their own buffers, one after the other.
+	u8 *entry_bufs[7] = {param_sfo_buf, icon0_buf, icon1_buf, pic0_buf, pic1_buf, snd0_buf, data_psp_buf};
+	int entry_sizes[7] = {param_sfo_size, icon0_size, icon1_size, pic0_size, pic1_size, snd0_size, data_psp_head};
+	struct iovec iov[8];
+	int header_offset = 0x28;
+	iov[0].iov_base = pbp_header;
+	iov[0].iov_len = 0x28;
+	for (i = 0; i < 7; i++)
+	{
+		*(u32*)(pbp_header + 0x08 + i * 4) = header_offset;
+		iov[i + 1].iov_base = entry_bufs[i];
+		iov[i + 1].iov_len = entry_sizes[i];
+		header_offset += entry_sizes[i];
+	}
+	
+	// DATA.PSAR is 0x100 aligned.
+	int pgd_pos = header_offset;
+	int data_psar_offset = ((pgd_pos + pgd_size) + 15) &~ 15;
+	while (data_psar_offset % 0x100) 
+		data_psar_offset += 0x10;
+
+	// A reserved header keeps DATA.PSAR in place when the entries before it change.
+	if (reserve > 0 && data_psar_offset > reserve)
+	{
+		fprintf(stderr, "ERROR: The PBP header needs 0x%X bytes, more than the 0x%X reserved\n", data_psar_offset, reserve);
+		goto out;
+	}
+	if (reserve > 0)
+		data_psar_offset = reserve;
+
+	*(u32*)(pbp_header + 0x24) = data_psar_offset;
+
+	// Write PBP up to the OPNSSMP PGD.
+	fflush(f);
+	if (writev_at(fileno(f), iov, 8, 0) != 0)
+	{
+		fprintf(stderr, "ERROR: Failed to write the PBP header!\n");
+		goto out;
+	}
+	
+	// Encrypt OPNSSMP file with version_key.
+	if (pgd_size && encrypt_pgd_file(opnssmp, opnssmp_size, pgd_block_size, 1, 1, 2, version_key, fileno(f), pgd_pos, pool) != pgd_size)
+	{
+		fprintf(stderr, "ERROR: Failed to encrypt OPNSSMP file!\n");
+		goto out;
+	}
+
+	// Write the padding and an empty DATA.PSAR.
 	int data_psar_size = 0x100;
-	u8 *data_psar_buf = (u8 *) malloc (data_psar_size);	
-	memset(data_psar_buf, 0, data_psar_size);
+	int pad_size = data_psar_offset - (pgd_pos + pgd_size);
+	u8 *pad_buf = (u8 *) calloc (1, pad_size + data_psar_size);
+	if (pad_buf == NULL || write_at(fileno(f), pad_buf, pad_size + data_psar_size, pgd_pos + pgd_size) != 0)
+	{
+		fprintf(stderr, "ERROR: Failed to write DATA.PSAR!\n");
+		free(pad_buf);
+		goto out;
+	}
+	free(pad_buf);
+	ret = data_psar_offset + data_psar_size;
+	fseeko64(f, ret, SEEK_SET);
+	
+out:
+	// Clean up.
+	free(param_sfo_buf);
+	free(icon0_buf);
+	free(icon1_buf);
+	free(pic0_buf);
+	free(pic1_buf);
+	free(snd0_buf);
+	free(data_psp_buf);
 
-	// Calculate header size.
-	int header_size = icon0_size + icon1_size + pic0_size + pic1_size + snd0_size + param_sfo_size + data_psp_size;
+	return ret;
+}
 
-	// Allocate PBP header.
-	u8 *pbp_header = malloc(header_size + 4096);
-	memset(pbp_header, 0, header_size + 4096);
+// Read a whole file, to free.
+static u8 *load_file(const char *name, int *size)
+{
+	FILE *f = fopen(name, "rb");
+	u8 *buf = NULL;
+	
+	if (f == NULL)
+		return NULL;
+	
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (*size >= 0 && *size <= PBP_RESERVE_MAX)
+		buf = (u8 *) malloc (*size + 1);
+	if (buf != NULL && (int)fread(buf, 1, *size, f) != *size)
+	{
+		free(buf);
+		buf = NULL;
+	}
+	
+	fclose(f);
+	return buf;
+}
 
-	// Write magic.
-	*(u32*)(pbp_header + 0) = 0x50425000;
-	*(u32*)(pbp_header + 4) = 0x00010001;
+// Bytes of DATA.PSP in use: the header, then STARTDAT and the OPNSSMP PGD if present.
+static int data_psp_used(u8 *data_psp_buf, int size)
+{
+	STARTDAT_HEADER *sd_header = (STARTDAT_HEADER *)(data_psp_buf + 0x594 + 0xC);
+	u32 pgd_offset = *(u32 *)(data_psp_buf + 0x28 + 0x8);
+	u32 pgd_size = *(u32 *)(data_psp_buf + 0x28 + 0x8 + 0x4);
+	long long used = 0x594;
+	
+	if (size >= 0x594 + 0xC + 0x50 && !memcmp(sd_header->magic, "STARTDAT", 8))
+		used = 0x594 + 0xC + (long long)sd_header->header_size + sd_header->data_size;
+	if (pgd_size > 0 && (long long)pgd_offset + pgd_size > used)
+		used = (long long)pgd_offset + pgd_size;
+	
+	return (used > size) ? -1 : (int)used;
+}
 
-	// Set header offset.
-	int header_offset = 0x28;
+/*
+	Replace header entries of a PSN EBOOT.PBP in place (-update-meta). files
+	has the new PARAM.SFO, ICON0, ICON1, PIC0, PIC1 and SND0, NULL to keep
+	an entry. DATA.PSP is moved after them and signed again if PARAM.SFO
+	changed. DATA.PSAR does not move, the entries must fit before it, see
+	--reserve-header. Returns 0 on success.
+*/
+int update_meta(const char *pbp_name, char **files, const char *title)
+{
+	static const char *entry_names[PBP_META_ENTRIES] = {"PARAM.SFO", "ICON0.PNG", "ICON1.PMF", "PIC0.PNG", "PIC1.PNG", "SND0.AT3"};
+	u8 *entries[PBP_META_ENTRIES + 1];
+	int sizes[PBP_META_ENTRIES + 1];
+	u8 header[0x28];
+	u8 magic[8];
+	u8 *pbp_header = NULL;
+	int ret = -1;
+	int i, pos;
+	
+	memset(entries, 0, sizeof(entries));
+	FILE *f = fopen(pbp_name, "r+b");
+	if (f == NULL)
+	{
+		fprintf(stderr, "ERROR: Please check your input file!\n");
+		return -1;
+	}
+	int fd = fileno(f);
+	
+	// PARAM.SFO, ICON0.PNG, ICON1.PMF, PIC0.PNG, PIC1.PNG, SND0.AT3, DATA.PSP and DATA.PSAR offsets.
+	u32 *offsets = (u32 *)(header + 0x08);
+	fseeko64(f, 0, SEEK_END);
+	long long pbp_size = ftello64(f);
+	if (read_at(fd, header, 0x28, 0) != 0 || *(u32 *)header != PBP_MAGIC || offsets[0] != 0x28)
+	{
+		fprintf(stderr, "ERROR: %s is not a PBP file\n", pbp_name);
+		goto out;
+	}
+	for (i = 1; i < 8; i++)
+	{
+		if (offsets[i] < offsets[i - 1] || offsets[i] > pbp_size)
+		{
+			fprintf(stderr, "ERROR: Invalid PBP header in %s\n", pbp_name);
+			goto out;
+		}
+	}
+	if (read_at(fd, magic, 8, offsets[7]) != 0 || memcmp(magic, "NPUMDIMG", 8) || offsets[7] - offsets[6] < 0x594)
+	{
+		fprintf(stderr, "ERROR: %s has no NPUMDIMG image\n", pbp_name);
+		goto out;
+	}
+	
+	// The entries, new or as they are, then DATA.PSP without its padding.
+	for (i = 0; i <= PBP_META_ENTRIES; i++)
+	{
+		if (i < PBP_META_ENTRIES && files[i] != NULL)
+		{
+			entries[i] = load_file(files[i], &sizes[i]);
+			if (entries[i] == NULL)
+			{
+				fprintf(stderr, "ERROR: Cannot read %s\n", files[i]);
+				goto out;
+			}
+			continue;
+		}
+		sizes[i] = offsets[i + 1] - offsets[i];
+		entries[i] = (u8 *) malloc (sizes[i] + 1);
+		if (entries[i] == NULL || read_at(fd, entries[i], sizes[i], offsets[i]) != 0)
+		{
+			fprintf(stderr, "ERROR: Cannot read %s\n", pbp_name);
+			goto out;
+		}
+	}
+	u8 *data_psp_buf = entries[PBP_META_ENTRIES];
+	sizes[PBP_META_ENTRIES] = data_psp_used(data_psp_buf, sizes[PBP_META_ENTRIES]);
+	if (sizes[PBP_META_ENTRIES] < 0)
+	{
+		fprintf(stderr, "ERROR: Invalid DATA.PSP in %s\n", pbp_name);
+		goto out;
+	}
+	
+	// A new PARAM.SFO gets the disc ID and category of the image, as in -pbp.
+	u8 *param_sfo_buf = entries[0];
+	if (sizes[0] < 0x14 || ((SFO_Header *)param_sfo_buf)->magic != PSF_MAGIC)
+	{
+		fprintf(stderr, "ERROR: Invalid PARAM.SFO\n");
+		goto out;
+	}
+	if (files[0] != NULL)
+	{
+		u8 disc_id[0x10];
+		memset(disc_id, 0, 0x10);
+		memcpy(disc_id, data_psp_buf + 0x560 + 0x7, 0x9);
+		sfo_put_key(param_sfo_buf, "DISC_ID", disc_id);
+		sfo_put_key(param_sfo_buf, "CATEGORY", "EG");
+	}
+	if (title != NULL && sfo_put_string(param_sfo_buf, "TITLE", title) != 0)
+	{
+		fprintf(stderr, "ERROR: The title does not fit in PARAM.SFO\n");
+		goto out;
+	}
+	if ((files[0] != NULL || title != NULL) && sign_data_psp(data_psp_buf, param_sfo_buf, sizes[0]) != 0)
+		goto out;
+	
+	// Lay the entries out again, DATA.PSAR stays where it is.
+	long long header_size = 0x28;
+	for (i = 0; i <= PBP_META_ENTRIES; i++)
+		header_size += sizes[i];
+	if (header_size > offsets[7])
+	{
+		fprintf(stderr, "ERROR: The header needs 0x%"INT64_FORMAT"X bytes, DATA.PSAR is at 0x%X, convert the ISO again with a larger --reserve-header\n", header_size, offsets[7]);
+		goto out;
+	}
+	
+	pbp_header = (u8 *) malloc (offsets[7]);
+	memset(pbp_header, 0, offsets[7]);
+	memcpy(pbp_header, header, 0x28);
+	for (i = 0, pos = 0x28; i <= PBP_META_ENTRIES; i++)
+	{
+		*(u32 *)(pbp_header + 0x08 + i * 4) = pos;
+		memcpy(pbp_header + pos, entries[i], sizes[i]);
+		pos += sizes[i];
+	}
+	
+	// The padding up to DATA.PSAR is cleared with the rest.
+	if (write_at(fd, pbp_header, offsets[7], 0) != 0 || ckpt_sync(f) != 0)
+	{
+		fprintf(stderr, "ERROR: Cannot write %s\n", pbp_name);
+		goto out;
+	}
+	
+	for (i = 0; i < PBP_META_ENTRIES; i++)
+	{
+		if (files[i] != NULL)
+			printf("%s: %s replaced (%d bytes)\n", pbp_name, entry_names[i], sizes[i]);
+	}
+	if (title != NULL)
+		printf("%s: TITLE set to \"%s\"\n", pbp_name, title);
+	printf("%s: header 0x%X of 0x%X bytes used\n", pbp_name, pos, offsets[7]);
+	
+	// The --manifest of the output follows its new header.
+	char *manifest_path = manifest_name(pbp_name);
+	int updated = manifest_update_header(manifest_path, fd);
+	if (updated < 0)
+		fprintf(stderr, "ERROR: Cannot update %s\n", manifest_path);
+	else if (updated == 0)
+		printf("%s: header hash updated\n", manifest_path);
+	free(manifest_path);
+	if (updated < 0)
+		goto out;
+	ret = 0;
+	
+out:
+	for (i = 0; i <= PBP_META_ENTRIES; i++)
+		free(entries[i]);
+	free(pbp_header);
+	fclose(f);
+	return ret;
+}
 
-	*(u32*)(pbp_header + 0x08) = header_offset;
-	memcpy(pbp_header + header_offset, param_sfo_buf, param_sfo_size);
-	header_offset += param_sfo_size;
+void close_outputs(PBP_OUTPUT *outputs, int output_nr)
+{
+	int i;
+	
+	for (i = 0; i < output_nr; i++)
+	{
+		if (outputs[i].pbp)
+			fclose(outputs[i].pbp);
+		free(outputs[i].table_buf);
+		manifest_free(&outputs[i].manifest);
+	}
+	free(outputs);
+}
 
-	*(u32*)(pbp_header + 0x0C) = header_offset;
-	memcpy(pbp_header + header_offset, icon0_buf, icon0_size);
-	header_offset += icon0_size;
+static void hash_file(SHA_CTX *sha, const char *file_name)
+{
+	u8 buf[0x10000];
+	size_t n;
+	FILE *f = fopen(file_name, "rb");
 	
-	*(u32*)(pbp_header + 0x10) = header_offset;
-	memcpy(pbp_header + header_offset, icon1_buf, icon1_size);
-	header_offset += icon1_size;
+	if (f == NULL)
+		return;
+	
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		SHAUpdate(sha, buf, (int)n);
+	fclose(f);
+}
+
+// A --seed is content, or 1 to 32 bytes in hex.
+static int is_seed(const char *seed_arg)
+{
+	int len = strlen(seed_arg);
 	
-	*(u32*)(pbp_header + 0x14) = header_offset;
-	memcpy(pbp_header + header_offset, pic0_buf, pic0_size);
-	header_offset += pic0_size;
+	return !strcmp(seed_arg, "content") || (len > 0 && len <= 0x40 && !(len % 2) && is_hex(seed_arg, len));
+}
+
+/*
+	Seed the PRNG for --seed: either the given hex bytes, or a SHA1 of
+	everything the output depends on (ISO, content IDs, keys and optional files).
+	Returns 0 on success.
+*/
+int seed_outputs(const char *seed_arg, const char *iso_name, PBP_OUTPUT *outputs, int output_nr, const char *startdat_name, const char *opnssmp_name)
+{
+	u8 seed[0x20];
+	int seed_size;
+	int i;
 	
-	*(u32*)(pbp_header + 0x18) = header_offset;
-	memcpy(pbp_header + header_offset, pic1_buf, pic1_size);
-	header_offset += pic1_size;
+	if (!strcmp(seed_arg, "content"))
+	{
+		SHA_CTX sha;
+		SHAInit(&sha);
+		hash_file(&sha, iso_name);
+		for (i = 0; i < output_nr; i++)
+		{
+			SHAUpdate(&sha, (u8 *)outputs[i].cid, strlen(outputs[i].cid) + 1);
+			SHAUpdate(&sha, (u8 *)outputs[i].vk, strlen(outputs[i].vk) + 1);
+		}
+		if (startdat_name)
+			hash_file(&sha, startdat_name);
+		if (opnssmp_name)
+			hash_file(&sha, opnssmp_name);
+		SHAFinal(seed, &sha);
+		seed_size = 0x14;
+	}
+	else
+	{
+		if (!is_seed(seed_arg))
+			return -1;
+		seed_size = strlen(seed_arg);
+		hex_to_bytes(seed, seed_arg, seed_size);
+		seed_size /= 2;
+	}
 	
-	*(u32*)(pbp_header + 0x1C) = header_offset;
-	memcpy(pbp_header + header_offset, snd0_buf, snd0_size);
-	header_offset += snd0_size;
+	kirk_seed_prng(seed, seed_size);
+	return 0;
+}
 
-	*(u32*)(pbp_header + 0x20) = header_offset;
-	memcpy(pbp_header + header_offset, data_psp_buf, data_psp_size);
-	header_offset += data_psp_size;
+// The last block of the checkpoint must be the same in the ISO.
+static int check_ckpt_iso(FILE *iso, CKPT *c, int block_size, SHRINK *shrink)
+{
+	u8 *buf = (u8 *) malloc(block_size);
+	u8 hash[0x14];
+	SHA_CTX sha;
+	int ok;
 	
-	// DATA.PSAR is 0x100 aligned.
-	header_offset = (header_offset + 15) &~ 15;
-	while (header_offset % 0x100) 
-		header_offset += 0x10;
+	fseeko64(iso, (long long)(c->blocks - 1) * block_size, SEEK_SET);
+	ok = (fread(buf, block_size, 1, iso) == 1);
+	if (ok)
+	{
+		if (shrink)
+			shrink_apply(shrink, buf, (long long)(c->blocks - 1) * block_size, block_size);
+		SHAInit(&sha);
+		SHAUpdate(&sha, buf, block_size);
+		SHAFinal(hash, &sha);
+		ok = !memcmp(hash, c->last_hash, 0x14);
+	}
+	
+	free(buf);
+	fseeko64(iso, 0, SEEK_SET);
+	return ok;
+}
 
-	*(u32*)(pbp_header + 0x24) = header_offset;
-	memcpy(pbp_header + header_offset, data_psar_buf, data_psar_size);
-	header_offset += data_psar_size;
+static void hash_version_key(u8 *hash, u8 *version_key)
+{
+	SHA_CTX sha;
+	
+	SHAInit(&sha);
+	SHAUpdate(&sha, version_key, 0x10);
+	SHAFinal(hash, &sha);
+}
 
-	// Write PBP.
-	fwrite(pbp_header, header_offset, 1, f);
+// Take the keys and table entries of an output from the checkpoint, and drop the blocks written after it.
+static int resume_output(PBP_OUTPUT *out, CKPT *c, int o, long long table_size)
+{
+	CKPT_OUTPUT *co = &c->outputs[o];
+	u8 key_hash[0x14];
 	
-	// Clean up.
-	free(data_psar_buf);
-	free(data_psp_buf);
-	free(data_psp_param_buf);
-	free(data_psp_sha1_inbuf);
-	free(pbp_header);
+	// Block offsets are from the NPUMDIMG header.
+	long long end = co->table_offset - 0x100 + c->iso_offset;
+	
+	hash_version_key(key_hash, out->version_key);
+	if (memcmp(co->content_id, out->content_id, 0x30) || memcmp(co->key_hash, key_hash, 0x14))
+		return -1;
+	
+	fseeko64(out->pbp, 0, SEEK_END);
+	if (ftello64(out->pbp) < end || ckpt_rewind(out->pbp, end) != 0)
+		return -1;
+	
+	memcpy(out->header_key, co->header_key, 0x10);
+	out->table_offset = co->table_offset;
+	out->table_buf = realloc(co->table_buf, table_size);
+	memset(out->table_buf + (long long)c->blocks * 0x20, 0, table_size - (long long)c->blocks * 0x20);
+	co->table_buf = NULL;
+	
+	return 0;
+}
+
+// Checkpoint of the outputs, the table entries are those of the outputs.
+static void ckpt_prepare(CKPT *c, PBP_OUTPUT *outputs, int output_nr, long long iso_size, int block_basis, int compress)
+{
+	int o;
+	
+	memset(c, 0, sizeof(CKPT));
+	c->iso_size = iso_size;
+	c->block_basis = block_basis;
+	c->compress = compress;
+	c->output_nr = output_nr;
+	c->outputs = (CKPT_OUTPUT *) calloc(output_nr, sizeof(CKPT_OUTPUT));
+	for (o = 0; o < output_nr; o++)
+	{
+		memcpy(c->outputs[o].content_id, outputs[o].content_id, 0x30);
+		hash_version_key(c->outputs[o].key_hash, outputs[o].version_key);
+		memcpy(c->outputs[o].header_key, outputs[o].header_key, 0x10);
+		c->outputs[o].table_offset = outputs[o].table_offset;
+		c->outputs[o].table_buf = outputs[o].table_buf;
+	}
+}
 
-	return header_offset;
+// Commit the blocks written so far: the outputs reach the disk before the checkpoint does.
+static int write_ckpt(const char *path, CKPT *c, PBP_OUTPUT *outputs, int blocks, long long iso_offset, u8 *iso_buf, int block_size)
+{
+	SHA_CTX sha;
+	int o;
+	
+	for (o = 0; o < c->output_nr; o++)
+	{
+		if (ckpt_sync(outputs[o].pbp) != 0)
+			return -1;
+	}
+	
+	c->blocks = blocks;
+	c->iso_offset = iso_offset;
+	SHAInit(&sha);
+	SHAUpdate(&sha, iso_buf, block_size);
+	SHAFinal(c->last_hash, &sha);
+	kirk_save_prng(c->prng);
+	
+	return ckpt_write(path, c);
 }
 
 //TODO add option -v / --verbose for the commented printf statements
@@ -469,15 +812,43 @@ void print_usage()
 {
 	printf("psp-sign-np v1.0.4 by Hykem\n"
 	       "Convert PSP ISOs to signed PSN PBPs.\n\n"
-	       "Usage: psp-sign-np -pbp [-c] <input> <output> <cid> <key> [<startdat> [<opnssmp>]]\n"
+	       "Usage: psp-sign-np -pbp [-c] [-j <threads>] [--cache <file> [--cache-size <MB>]] [--fanout <output> <cid> <key>]... [--stats[=json]] [--estimate[=json]] [--shrink [--pad-pattern <names>]] [--block-basis <sectors>] [--ratio-limit <percent>] [--level <1-10>] [--time-budget <seconds>] [--min-mbps <MB/s>] [--checkpoint <blocks>] [--resume] [--reserve-header <bytes>] [--manifest] [--seed <hex|content>] <input> <output> <cid> <key> [<startdat> [<opnssmp>]]\n"
+	       "       psp-sign-np -update-meta [--sfo <file>] [--title <title>] [--icon0 <file>] [--icon1 <file>] [--pic0 <file>] [--pic1 <file>] [--snd0 <file>] <input>\n"
 	       "       psp-sign-np -elf <input> <output> <tag> [<devkit_ver>]\n"
+	       "       psp-sign-np -pgd [-d] [-j <threads>] <input> <output> <key>\n"
+	       "       psp-sign-np -unpack [-j <threads>] <input> <output> [<key>]\n"
+	       "       psp-sign-np -verify [-j <threads>] [-k <key>] <input> [<input> ...]\n"
+	       "       psp-sign-np -check-manifest [-j <threads>] <input> [<manifest>]\n"
 	       "\n"
 	       "- Modes:\n"
 	       "[-pbp]: Encrypt and sign a PSP ISO into a PSN EBOOT.PBP\n"
 	       "[-elf]: Encrypt and sign a ELF file into an EBOOT.BIN\n"
+	       "[-pgd]: Encrypt or decrypt PGD files, a single file or a directory tree\n"
+	       "[-unpack]: Decrypt and decompress a PSN EBOOT.PBP back into a PSP ISO\n"
+	       "[-update-meta]: Replace the PARAM.SFO, icons or sound of a PSN EBOOT.PBP in place, without encrypting the image again\n"
+	       "[-verify]: Check the signatures and hashes of EBOOT.PBP and EBOOT.BIN files\n"
+	       "[-check-manifest]: Check an EBOOT.PBP against the block hashes of --manifest (default: <input>.manifest), without any key\n"
 	       "\n"
 	       "- PBP mode:\n"
 	       "[-c]: Compress data.\n"
+	       "[-j <threads>]: Number of worker threads (default: one per CPU)\n"
+	       "[--cache <file>]: Reuse the compressed blocks of previous runs from this file\n"
+	       "[--cache-size <MB>]: Size of the block cache file (default: 1024)\n"
+	       "[--fanout <output> <cid> <key>]: Also write this PBP from the same compressed data, can be repeated\n"
+	       "[--stats[=text|json]]: Print the time, throughput and block counts of each stage\n"
+	       "[--estimate[=text|json]]: Print the expected PBP size and time from a sample of the blocks, without writing the PBP\n"
+	       "[--shrink]: Cut the sectors past the last one referenced by the ISO9660 tree, and zero the padding files\n"
+	       "[--pad-pattern <names>]: Padding files of --shrink, comma separated, * and ? wildcards (default: DUMMY*.DAT)\n"
+	       "[--block-basis <sectors>]: Sectors per NPUMDIMG block, a power of two up to 0x40 (default: 0x10, as retail images)\n"
+	       "[--ratio-limit <percent>]: Store blocks raw when compressed to this percentage of their size or more (default: 90)\n"
+	       "[--level <1-10>]: Compression level, 10 is the slowest and smallest (default: 9)\n"
+	       "[--time-budget <seconds>]: Lower the compression effort of each block as needed to finish in time\n"
+	       "[--min-mbps <MB/s>]: Lower the compression effort of each block as needed to keep this throughput\n"
+	       "[--checkpoint <blocks>]: Save the progress to <output>.ckpt every this many blocks\n"
+	       "[--resume]: Continue an interrupted conversion from <output>.ckpt, checkpoints every 1024 blocks if not set\n"
+	       "[--reserve-header <bytes>]: Place DATA.PSAR at this offset, so that -update-meta can later change the header in place\n"
+	       "[--manifest]: Also write <output>.manifest, fast hashes of the header, table and each block as written\n"
+	       "[--seed <hex|content>]: Derive the keys and signatures from this seed, or from a hash of the inputs, for byte-identical output\n"
 	       "<input>: A valid PSP ISO image with a signed EBOOT.BIN\n"
 	       "<output>: Resulting signed EBOOT.PBP file\n"
 	       "<cid>: Content ID (XXYYYY-AAAABBBBB_CC-DDDDDDDDDDDDDDDD)\n"
@@ -485,6 +856,30 @@ void print_usage()
 	       "<startdat>: PNG image to be used as boot screen (optional)\n"
 	       "<opnssmp>: OPNSSMP.BIN module (optional)\n"
 	       "\n"
+	       "- PGD mode:\n"
+	       "[-d]: Decrypt PGD files instead of encrypting them\n"
+	       "[-j <threads>]: Number of worker threads (default: one per CPU)\n"
+	       "<input>: File or directory to process\n"
+	       "<output>: Resulting file or directory\n"
+	       "<key>: Version key (16 bytes), or 0 to recover it from each file when decrypting\n"
+	       "\n"
+	       "- Unpack mode:\n"
+	       "[-j <threads>]: Number of worker threads (default: one per CPU)\n"
+	       "<input>: A PSN EBOOT.PBP with an NPUMDIMG image\n"
+	       "<output>: Resulting PSP ISO\n"
+	       "<key>: Version key (16 bytes), recovered from the image if omitted (optional)\n"
+	       "\n"
+	       "- Verify mode:\n"
+	       "[-j <threads>]: Number of worker threads (default: one per CPU)\n"
+	       "[-k <key>]: Version key (16 bytes), else the fixed key or the recovered key\n"
+	       "<input>: Files to check, one PASS or FAIL line is printed for each\n"
+	       "\n"
+	       "- Update meta mode:\n"
+	       "[--sfo <file>]: New PARAM.SFO, its DISC_ID and CATEGORY are set as in PBP mode\n"
+	       "[--title <title>]: Set the TITLE of PARAM.SFO\n"
+	       "[--icon0 <file>], [--icon1 <file>], [--pic0 <file>], [--pic1 <file>], [--snd0 <file>]: New ICON0.PNG, ICON1.PMF, PIC0.PNG, PIC1.PNG or SND0.AT3\n"
+	       "<input>: A PSN EBOOT.PBP, the new header must fit before its DATA.PSAR (see --reserve-header)\n"
+	       "\n"
 	       "- ELF mode:\n"
 	       "<input>: A valid ELF file\n"
 	       "<output>: Resulting signed EBOOT.BIN file\n"
@@ -510,7 +905,7 @@ void print_usage()
 
 int main(int argc, char *argv[])
 {
-	if ((argc <= 1) || (argc > 9))
+	if (argc <= 1)
 	{
 		print_usage();
 		return 0;
@@ -608,98 +1003,628 @@ int main(int argc, char *argv[])
 		
 		return 0;
 	}
-	else if (!strcmp(argv[arg_offset + 1], "-pbp") && (argc > (arg_offset + 5)))  // EBOOT signing mode.
+	else if (!strcmp(argv[arg_offset + 1], "-pgd") && (argc > (arg_offset + 4)))  // PGD mode.
 	{
 		// Skip the mode argument.
 		arg_offset++;
 		
-		// Check if the data must be compressed.
-		int compress = 0;
-		if (!strcmp(argv[arg_offset + 1], "-c"))
+		// Check the PGD mode options.
+		int decrypt = 0;
+		int threads = 0;
+		while (argc > (arg_offset + 1))
 		{
-			compress = 1;
-			arg_offset++;
+			if (!strcmp(argv[arg_offset + 1], "-d"))
+			{
+				decrypt = 1;
+				arg_offset++;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "-j") && (argc > (arg_offset + 2)))  // Number of threads.
+			{
+				threads = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else
+			{
+				break;
+			}
 		}
 		
-		// Check for enough arguments after the compression flag.
-		if (argc < (arg_offset + 5))
+		// Check for enough arguments after the options.
+		if (argc < (arg_offset + 4))
 		{
 			print_usage();
 			return 0;
 		}
 		
-		// Open files.
-		char *iso_name = argv[arg_offset + 1];
-		char *pbp_name = argv[arg_offset + 2];
-		FILE* iso = fopen(iso_name, "rb");
-		FILE* pbp = fopen(pbp_name, "wb");
-		
-		// Get Content ID from input.
-		char *cid = argv[arg_offset + 3];
-		char content_id[0x30];
-		memset(content_id, 0, 0x30);
-		memcpy(content_id, cid, strlen(cid));
+		char *in_name = argv[arg_offset + 1];
+		char *out_name = argv[arg_offset + 2];
 		
-		// Set version, header and data keys.
-		int use_version_key = 0;
+		// Read version key from input.
 		u8 version_key[0x10];
-		u8 header_key[0x10];
-		u8 data_key[0x10];
 		memset(version_key, 0, 0x10);
-		memset(header_key, 0, 0x10);
-		memset(data_key, 0, 0x10);
-		
-		// Read version key from input.
-		char *vk = argv[arg_offset + 4];
+		char *vk = argv[arg_offset + 3];
 		if (is_hex(vk, 0x20))
 		{
-			unsigned char user_key[0x10];
-			hex_to_bytes(user_key, vk, 0x20);
-			memcpy(version_key, user_key, 0x10);
-			use_version_key = 1;
-		}		
-		
-		// Check input file.
-		if (iso == NULL)
-		{
-			fprintf(stderr, "ERROR: Please check your input file!\n");
-			fclose(iso);
-			fclose(pbp);
-			return 0;
+			hex_to_bytes(version_key, vk, 0x20);
 		}
-		
-		// Check output file.
-		if (pbp == NULL)
+		else if (!decrypt)
 		{
-			fprintf(stderr, "ERROR: Please check your output file!\n");
-			fclose(iso);
-			fclose(pbp);
-			return 0;
+			fprintf(stderr, "ERROR: PGD encryption needs a version key!\n");
+			return 1;
 		}
-			
-		// Get ISO size.
-		fseeko64(iso, 0, SEEK_END);
-		long long iso_size = ftello64(iso);
-		fseeko64(iso, 0, SEEK_SET);
 		
 		kirk_init();
 		
-		// Set keys' context.
-		MAC_KEY mkey;
-		CIPHER_KEY ckey;
-			
-		// Set flags and block size data.
-		int np_flags = (use_version_key) ? 0x2 : (0x3 | (0x01000000));
-		int block_basis = 0x10;
-		int block_size = block_basis * 2048;
-		long long iso_blocks = (iso_size + block_size - 1) / block_size;
+		// Files are processed one after the other, sharing the pool.
+		tpool *pool = (threads == 1) ? NULL : tpool_create(threads);
+		PGD_TREE_STATS stats;
+		int failed = pgd_tree(in_name, out_name, decrypt, version_key, pool, &stats);
+		tpool_destroy(pool);
 		
-		// Generate random header key.
-		sceUtilsBufferCopyWithRange(header_key, 0x10, 0, 0, KIRK_CMD_PRNG);
+		return (failed) ? 1 : 0;
+	}
+	else if (!strcmp(argv[arg_offset + 1], "-verify") && (argc > (arg_offset + 2)))  // Verification mode.
+	{
+		// Skip the mode argument.
+		arg_offset++;
+		
+		// Check the verification mode options.
+		int threads = 0;
+		u8 version_key[0x10];
+		memset(version_key, 0, 0x10);
+		while (argc > (arg_offset + 1))
+		{
+			if (!strcmp(argv[arg_offset + 1], "-j") && (argc > (arg_offset + 2)))  // Number of threads.
+			{
+				threads = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "-k") && (argc > (arg_offset + 2)))  // Version key.
+			{
+				if (!is_hex(argv[arg_offset + 2], 0x20))
+				{
+					fprintf(stderr, "ERROR: Invalid version key!\n");
+					return 1;
+				}
+				hex_to_bytes(version_key, argv[arg_offset + 2], 0x20);
+				arg_offset += 2;
+			}
+			else
+			{
+				break;
+			}
+		}
+		
+		// Check for at least one file after the options.
+		if (argc < (arg_offset + 2))
+		{
+			print_usage();
+			return 0;
+		}
+		
+		kirk_init();
+		
+		// Files are checked one after the other, their blocks over the pool.
+		tpool *pool = (threads == 1) ? NULL : tpool_create(threads);
+		int failed = verify_files(argv + arg_offset + 1, argc - arg_offset - 1, version_key, pool);
+		tpool_destroy(pool);
+		
+		return (failed) ? 1 : 0;
+	}
+	else if (!strcmp(argv[arg_offset + 1], "-check-manifest") && (argc > (arg_offset + 2)))  // Manifest check mode.
+	{
+		// Skip the mode argument.
+		arg_offset++;
+		
+		// Check the manifest check options.
+		int threads = 0;
+		while (argc > (arg_offset + 1))
+		{
+			if (!strcmp(argv[arg_offset + 1], "-j") && (argc > (arg_offset + 2)))  // Number of threads.
+			{
+				threads = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else
+			{
+				break;
+			}
+		}
+		
+		// Check for the file and its optional manifest after the options.
+		if (argc < (arg_offset + 2) || argc > (arg_offset + 3))
+		{
+			print_usage();
+			return 0;
+		}
+		
+		char *pbp_name = argv[arg_offset + 1];
+		char *manifest_path = (argc > (arg_offset + 2)) ? strdup(argv[arg_offset + 2]) : manifest_name(pbp_name);
+		
+		// The entries are hashed over the pool.
+		tpool *pool = (threads == 1) ? NULL : tpool_create(threads);
+		const char *failed = manifest_check(pbp_name, manifest_path, pool);
+		tpool_destroy(pool);
+		free(manifest_path);
+		
+		if (failed)
+			printf("FAIL\t%s\t%s\n", pbp_name, failed);
+		else
+			printf("PASS\t%s\n", pbp_name);
+		
+		return (failed) ? 1 : 0;
+	}
+	else if (!strcmp(argv[arg_offset + 1], "-unpack") && (argc > (arg_offset + 3)))  // EBOOT unpacking mode.
+	{
+		// Skip the mode argument.
+		arg_offset++;
+		
+		// Check the unpack mode options.
+		int threads = 0;
+		while (argc > (arg_offset + 1))
+		{
+			if (!strcmp(argv[arg_offset + 1], "-j") && (argc > (arg_offset + 2)))  // Number of threads.
+			{
+				threads = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else
+			{
+				break;
+			}
+		}
+		
+		// Check for enough arguments after the options.
+		if (argc < (arg_offset + 3))
+		{
+			print_usage();
+			return 0;
+		}
+		
+		char *pbp_name = argv[arg_offset + 1];
+		char *iso_name = argv[arg_offset + 2];
+		
+		if (same_file(pbp_name, iso_name))
+		{
+			fprintf(stderr, "ERROR: %s would be its own output\n", pbp_name);
+			return 1;
+		}
+		
+		// Read the optional version key from input.
+		u8 version_key[0x10];
+		memset(version_key, 0, 0x10);
+		if (argc > (arg_offset + 3) && is_hex(argv[arg_offset + 3], 0x20))
+			hex_to_bytes(version_key, argv[arg_offset + 3], 0x20);
+		
+		kirk_init();
+		
+		NPUMDIMG np;
+		if (npumdimg_open(&np, pbp_name, version_key) != 0)
+			return 1;
+		if (npumdimg_check_table(&np) != 0)
+		{
+			fprintf(stderr, "ERROR: Invalid NPUMDIMG table hash!\n");
+			npumdimg_close(&np);
+			return 1;
+		}
+		
+		tpool *pool = (threads == 1) ? NULL : tpool_create(threads);
+		NPUMDIMG_STATS stats;
+		int failed = npumdimg_unpack(&np, iso_name, pool, &stats);
+		tpool_destroy(pool);
+		npumdimg_close(&np);
+		
+		return (failed) ? 1 : 0;
+	}
+	else if (!strcmp(argv[arg_offset + 1], "-update-meta") && (argc > (arg_offset + 2)))  // Header update mode.
+	{
+		// Skip the mode argument.
+		arg_offset++;
+		
+		// Check the header update options, one per entry.
+		static const char *entry_options[PBP_META_ENTRIES] = {"--sfo", "--icon0", "--icon1", "--pic0", "--pic1", "--snd0"};
+		char *files[PBP_META_ENTRIES];
+		char *title = NULL;
+		int changes = 0;
+		int i;
+		memset(files, 0, sizeof(files));
+		while (argc > (arg_offset + 2))
+		{
+			for (i = 0; i < PBP_META_ENTRIES && strcmp(argv[arg_offset + 1], entry_options[i]); i++)
+				;
+			if (i < PBP_META_ENTRIES)  // A new header entry.
+			{
+				files[i] = argv[arg_offset + 2];
+				changes++;
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--title"))  // TITLE of PARAM.SFO.
+			{
+				title = argv[arg_offset + 2];
+				changes++;
+				arg_offset += 2;
+			}
+			else
+			{
+				break;
+			}
+		}
+		
+		// Check for the PBP after the options.
+		if (argc != (arg_offset + 2) || changes == 0)
+		{
+			print_usage();
+			return 0;
+		}
+		
+		kirk_init();
+		
+		return (update_meta(argv[arg_offset + 1], files, title) != 0) ? 1 : 0;
+	}
+	else if (!strcmp(argv[arg_offset + 1], "-pbp") && (argc > (arg_offset + 5)))  // EBOOT signing mode.
+	{
+		// Skip the mode argument.
+		arg_offset++;
+		
+		// Check the PBP mode options.
+		int compress = 0;
+		int threads = 0;
+		char *cache_name = NULL;
+		char *seed_arg = NULL;
+		int block_basis = BLOCK_BASIS;
+		int ratio_limit = RATIO_LIMIT;
+		double time_budget = 0;
+		double min_mbps = 0;
+		int level_max = LZRC_LEVEL_DEFAULT;
+		int ckpt_every = 0;
+		int resume = 0;
+		int reserve = 0;
+		int manifest = 0;
+		char *ckpt_path = NULL;
+		CKPT ckpt;
+		int resumed = 0;
+		ESTIMATE est;
+		int estimate = 0;
+		int shrink = 0;
+		char *pad_pattern = SHRINK_PAD_PATTERN;
+		SHRINK shrink_ctl;
+		SHRINK *shrunk = NULL;
+		ADAPT adapt_ctl;
+		ADAPT *adapt = NULL;
+		long long cache_size = BLKCACHE_DEFAULT_SIZE;
+		SIGN_STATS *st = &sign_stats;
+		double t;
+		
+		// The first output comes from the main arguments, the others from --fanout.
+		PBP_OUTPUT *outputs = (PBP_OUTPUT *) calloc (argc / 4 + 1, sizeof(PBP_OUTPUT));
+		int output_nr = 1;
+		int o;
+		while (argc > (arg_offset + 1))
+		{
+			// Check if the data must be compressed.
+			if (!strcmp(argv[arg_offset + 1], "-c"))
+			{
+				compress = 1;
+				arg_offset++;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--cache") && (argc > (arg_offset + 2)))  // Compressed block cache.
+			{
+				cache_name = argv[arg_offset + 2];
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--cache-size") && (argc > (arg_offset + 2)))  // Cache size in MB.
+			{
+				cache_size = strtoll(argv[arg_offset + 2], NULL, 10) * 1024 * 1024;
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "-j") && (argc > (arg_offset + 2)))  // Number of threads.
+			{
+				threads = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else if (!strncmp(argv[arg_offset + 1], "--stats", 7) && (argv[arg_offset + 1][7] == 0 || argv[arg_offset + 1][7] == '='))  // Stage timers.
+			{
+				if (stats_init(st, (argv[arg_offset + 1][7] == '=') ? argv[arg_offset + 1] + 8 : NULL) != 0)
+				{
+					fprintf(stderr, "ERROR: Unknown stats format %s\n", argv[arg_offset + 1] + 8);
+					free(outputs);
+					return 0;
+				}
+				arg_offset++;
+			}
+			else if (!strncmp(argv[arg_offset + 1], "--estimate", 10) && (argv[arg_offset + 1][10] == 0 || argv[arg_offset + 1][10] == '='))  // Dry run.
+			{
+				if (estimate_init(&est, (argv[arg_offset + 1][10] == '=') ? argv[arg_offset + 1] + 11 : NULL) != 0)
+				{
+					fprintf(stderr, "ERROR: Unknown estimate format %s\n", argv[arg_offset + 1] + 11);
+					free(outputs);
+					return 0;
+				}
+				estimate = 1;
+				arg_offset++;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--shrink"))  // ISO shrinking pre-pass.
+			{
+				shrink = 1;
+				arg_offset++;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--pad-pattern") && (argc > (arg_offset + 2)))  // Padding files of --shrink.
+			{
+				pad_pattern = argv[arg_offset + 2];
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--block-basis") && (argc > (arg_offset + 2)))  // Sectors per block.
+			{
+				block_basis = strtol(argv[arg_offset + 2], NULL, 0);
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--ratio-limit") && (argc > (arg_offset + 2)))  // Compression threshold.
+			{
+				ratio_limit = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--level") && (argc > (arg_offset + 2)))  // Compression level.
+			{
+				level_max = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--time-budget") && (argc > (arg_offset + 2)))  // Adaptive compression level.
+			{
+				time_budget = strtod(argv[arg_offset + 2], NULL);  // "60" or "60s".
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--min-mbps") && (argc > (arg_offset + 2)))  // Adaptive compression level.
+			{
+				min_mbps = strtod(argv[arg_offset + 2], NULL);
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--checkpoint") && (argc > (arg_offset + 2)))  // Blocks between checkpoints.
+			{
+				ckpt_every = strtol(argv[arg_offset + 2], NULL, 10);
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--resume"))  // Continue from the checkpoint.
+			{
+				resume = 1;
+				arg_offset++;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--reserve-header") && (argc > (arg_offset + 2)))  // Room for -update-meta.
+			{
+				reserve = strtol(argv[arg_offset + 2], NULL, 0);
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--manifest"))  // Block hashes next to each output.
+			{
+				manifest = 1;
+				arg_offset++;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--seed") && (argc > (arg_offset + 2)))  // Reproducible output.
+			{
+				seed_arg = argv[arg_offset + 2];
+				arg_offset += 2;
+			}
+			else if (!strcmp(argv[arg_offset + 1], "--fanout") && (argc > (arg_offset + 4)))  // Another output of the same ISO.
+			{
+				outputs[output_nr].pbp_name = argv[arg_offset + 2];
+				outputs[output_nr].cid = argv[arg_offset + 3];
+				outputs[output_nr].vk = argv[arg_offset + 4];
+				output_nr++;
+				arg_offset += 4;
+			}
+			else
+			{
+				break;
+			}
+		}
 		
-		// Generate fixed key, if necessary.
-		if (!use_version_key)
-			sceNpDrmGetFixedKey(version_key, content_id, np_flags);
+		// Check for enough arguments after the compression flag.
+		if (argc < (arg_offset + 5))
+		{
+			free(outputs);
+			print_usage();
+			return 0;
+		}
+		
+		// Check the block layout options.
+		if (block_basis <= 0 || block_basis > BLOCK_BASIS_MAX || (block_basis & (block_basis - 1)))
+		{
+			fprintf(stderr, "ERROR: Block basis must be a power of two from 1 to 0x%X sectors\n", BLOCK_BASIS_MAX);
+			free(outputs);
+			return 0;
+		}
+		if (block_basis > BLOCK_BASIS)
+			fprintf(stderr, "Warning: Retail images use a block basis of 0x%X, larger blocks may not load on every firmware\n", BLOCK_BASIS);
+		if (ratio_limit < 1 || ratio_limit > 99)
+		{
+			fprintf(stderr, "ERROR: Ratio limit must be from 1 to 99 percent\n");
+			free(outputs);
+			return 0;
+		}
+		if (level_max < 1 || level_max > LZRC_LEVEL_MAX)
+		{
+			fprintf(stderr, "ERROR: Compression level must be from 1 to %d\n", LZRC_LEVEL_MAX);
+			free(outputs);
+			return 0;
+		}
+		if (ckpt_every < 0)
+		{
+			fprintf(stderr, "ERROR: Invalid checkpoint interval %d\n", ckpt_every);
+			free(outputs);
+			return 0;
+		}
+		if (reserve < 0 || reserve > PBP_RESERVE_MAX)
+		{
+			fprintf(stderr, "ERROR: Reserved header size must be from 0 to 0x%X bytes\n", PBP_RESERVE_MAX);
+			free(outputs);
+			return 0;
+		}
+		reserve = (reserve + 0xFF) & ~0xFF;  // DATA.PSAR is 0x100 aligned.
+		if (seed_arg && !is_seed(seed_arg))
+		{
+			fprintf(stderr, "ERROR: Seed must be content or 1 to 32 bytes in hex\n");
+			free(outputs);
+			return 0;
+		}
+		if (estimate)
+		{
+			// Nothing is written, there is nothing to resume.
+			ckpt_every = 0;
+			resume = 0;
+		}
+		if (resume && ckpt_every == 0)
+			ckpt_every = CKPT_EVERY;
+		if ((level_max != LZRC_LEVEL_DEFAULT || time_budget > 0 || min_mbps > 0) && !compress)
+			fprintf(stderr, "Warning: --level, --time-budget and --min-mbps only apply with -c\n");
+		
+		// Open input file.
+		char *iso_name = argv[arg_offset + 1];
+		FILE* iso = fopen(iso_name, "rb");
+		outputs[0].pbp_name = argv[arg_offset + 2];
+		outputs[0].cid = argv[arg_offset + 3];
+		outputs[0].vk = argv[arg_offset + 4];
+		
+		// Check input file.
+		if (iso == NULL)
+		{
+			fprintf(stderr, "ERROR: Please check your input file!\n");
+			free(outputs);
+			return 0;
+		}
+			
+		// Get ISO size.
+		fseeko64(iso, 0, SEEK_END);
+		long long iso_size = ftello64(iso);
+		fseeko64(iso, 0, SEEK_SET);
+		
+		// Cut the unreferenced end of the image, padding files are read as zeros.
+		if (shrink)
+		{
+			if (shrink_scan(&shrink_ctl, iso_name, iso_size, pad_pattern) != 0)
+			{
+				fprintf(stderr, "ERROR: Cannot read the ISO9660 directory tree\n");
+				fclose(iso);
+				free(outputs);
+				return 0;
+			}
+			shrunk = &shrink_ctl;
+			iso_size = shrunk->iso_size;
+			if (!(estimate && est.json) && !st->json)
+				printf("Shrink: %"INT64_FORMAT"d bytes cut from the end, %"INT64_FORMAT"d bytes of %d padding file(s) zeroed, %"INT64_FORMAT"d bytes saved\n",
+					shrunk->cut, shrunk->zeroed, shrunk->files, shrunk->cut + shrunk->zeroed);
+		}
+		
+		// Set block size data.
+		int block_size = block_basis * 2048;
+		long long iso_blocks = (iso_size + block_size - 1) / block_size;
+		
+		// Pick up an interrupted run, its settings must not have changed.
+		memset(&ckpt, 0, sizeof(ckpt));
+		if (ckpt_every > 0)
+			ckpt_path = ckpt_name(outputs[0].pbp_name);
+		if (resume)
+		{
+			int ret = ckpt_read(ckpt_path, &ckpt);
+			if (ret == 0 && (ckpt.iso_size != iso_size || ckpt.block_basis != block_basis || ckpt.compress != compress
+				|| ckpt.output_nr != output_nr || ckpt.blocks <= 0 || ckpt.blocks >= iso_blocks || !check_ckpt_iso(iso, &ckpt, block_size, shrunk)))
+			{
+				fprintf(stderr, "ERROR: Checkpoint %s is not of this ISO and options\n", ckpt_path);
+				ret = -1;
+			}
+			else if (ret < 0)
+				fprintf(stderr, "ERROR: Cannot read the checkpoint %s\n", ckpt_path);
+			
+			if (ret < 0)
+			{
+				ckpt_free(&ckpt);
+				free(ckpt_path);
+				fclose(iso);
+				free(outputs);
+				return 0;
+			}
+			resumed = (ret == 0);
+			if (resumed)
+				printf("Resuming from block %d of %"INT64_FORMAT"d\n", ckpt.blocks, iso_blocks);
+			else
+				printf("No checkpoint, starting from the first block\n");
+		}
+		else if (ckpt_path)
+			remove(ckpt_path);  // Of another run, the output is written again.
+		
+		// The budget covers the whole run, from here.
+		if (compress && !estimate && (time_budget > 0 || min_mbps > 0))
+		{
+			adapt_init(&adapt_ctl, iso_size - (long long)ckpt.blocks * block_size, level_max, time_budget, min_mbps);
+			adapt = &adapt_ctl;
+		}
+		
+		kirk_init();
+		
+		// Set keys' context.
+		MAC_KEY mkey;
+		CIPHER_KEY ckey;
+		
+		// Set up the outputs, each one has its own content ID and keys.
+		for (o = 0; o < output_nr; o++)
+		{
+			PBP_OUTPUT *out = &outputs[o];
+			
+			// Get Content ID from input.
+			memset(out->content_id, 0, 0x30);
+			memcpy(out->content_id, out->cid, strlen(out->cid));
+			
+			// Read version key from input.
+			int use_version_key = 0;
+			memset(out->version_key, 0, 0x10);
+			if (is_hex(out->vk, 0x20))
+			{
+				hex_to_bytes(out->version_key, out->vk, 0x20);
+				use_version_key = 1;
+			}
+			
+			// Set flags.
+			out->np_flags = (use_version_key) ? 0x2 : (0x3 | (0x01000000));
+			
+			// Generate fixed key, if necessary.
+			if (!use_version_key)
+				sceNpDrmGetFixedKey(out->version_key, out->content_id, out->np_flags);
+			
+			// Check output file.
+			if (estimate)
+				out->pbp = tmpfile();  // Only the header is written, to time it.
+			else
+				out->pbp = fopen(out->pbp_name, resumed ? "r+b" : "w+b");  // The header is read back for --manifest.
+			if (out->pbp == NULL)
+			{
+				fprintf(stderr, "ERROR: Please check your output file!\n");
+				ckpt_free(&ckpt);
+				free(ckpt_path);
+				fclose(iso);
+				close_outputs(outputs, output_nr);
+				return 0;
+			}
+			
+			// The checkpoint has the keys and table entries written so far.
+			if (resumed && resume_output(out, &ckpt, o, iso_blocks * 0x20) != 0)
+			{
+				fprintf(stderr, "ERROR: Checkpoint %s does not match %s\n", ckpt_path, out->pbp_name);
+				ckpt_free(&ckpt);
+				free(ckpt_path);
+				fclose(iso);
+				close_outputs(outputs, output_nr);
+				return 0;
+			}
+			
+			// The blocks of an earlier run are hashed from the output at the end.
+			if (manifest && !estimate && manifest_init(&out->manifest, iso_blocks, resumed ? ckpt.blocks : 0) != 0)
+			{
+				fprintf(stderr, "ERROR: Not enough memory for the manifest of %s\n", out->pbp_name);
+				ckpt_free(&ckpt);
+				free(ckpt_path);
+				fclose(iso);
+				close_outputs(outputs, output_nr);
+				return 0;
+			}
+		}
 		
 		// Check for optional files.
 		char *startdat_name = NULL;
@@ -724,7 +1649,7 @@ int main(int argc, char *argv[])
 					fprintf(stderr, "ERROR: Cannot read optional file 1\n");
 					fclose(ex_file1);
 					fclose(iso);
-					fclose(pbp);
+					close_outputs(outputs, output_nr);
 					return 0;
 				}
 			
@@ -745,7 +1670,7 @@ int main(int argc, char *argv[])
 				{
 					fprintf(stderr, "ERROR: Please check your optional files!\n");
 					fclose(iso);
-					fclose(pbp);
+					close_outputs(outputs, output_nr);
 					return 0;
 				}
 			}
@@ -762,7 +1687,7 @@ int main(int argc, char *argv[])
 					fprintf(stderr, "ERROR: Cannot read optional file 2\n");
 					fclose(ex_file2);
 					fclose(iso);
-					fclose(pbp);
+					close_outputs(outputs, output_nr);
 					return 0;
 				}
 				
@@ -783,19 +1708,36 @@ int main(int argc, char *argv[])
 				{
 					fprintf(stderr, "ERROR: Please check your optional files!\n");
 					fclose(iso);
-					fclose(pbp);
+					close_outputs(outputs, output_nr);
 					return 0;
 				}
 			}
 		}
 		
+		// Make the keys, padding and signatures reproducible.
+		if (seed_arg && !resumed && seed_outputs(seed_arg, iso_name, outputs, output_nr, startdat_name, opnssmp_name) != 0)
+		{
+			fprintf(stderr, "ERROR: Invalid seed %s\n", seed_arg);
+			ckpt_free(&ckpt);
+			free(ckpt_path);
+			fclose(iso);
+			close_outputs(outputs, output_nr);
+			return 0;
+		}
+		
+		// Generate random header keys, or carry on with those of the checkpoint.
+		if (resumed)
+			kirk_restore_prng(ckpt.prng);
+		for (o = 0; o < output_nr && !resumed; o++)
+			sceUtilsBufferCopyWithRange(outputs[o].header_key, 0x10, 0, 0, KIRK_CMD_PRNG);
+		
 		// Check for custom OPNSSMP file.
-		u8 *pgd_buf = NULL;
-		int pgd_size = 0;
+		FILE* opnssmp = NULL;
+		int opnssmp_size = 0;
 		if (opnssmp_name)
 		{
 			// Open file.
-			FILE* opnssmp = fopen(opnssmp_name, "rb");
+			opnssmp = fopen(opnssmp_name, "rb");
 			
 			// Check for valid file.
 			if (opnssmp == NULL)
@@ -803,37 +1745,14 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "ERROR: Please check your OPNSSMP file!\n");
 				fclose(opnssmp);
 				fclose(iso);
-				fclose(pbp);
+				close_outputs(outputs, output_nr);
 				return 0;
 			}
 
-			// Get OPNSSMP file size.
+			// Get OPNSSMP file size, it is read while writing the PBP.
 			fseek(opnssmp, 0, SEEK_END);
-			int opnssmp_size = ftell(opnssmp);
+			opnssmp_size = ftell(opnssmp);
 			fseek(opnssmp, 0, SEEK_SET);
-			
-			// Prepare PGD buffers.
-			int pgd_block_size = 2048;
-			int pgd_blocks = ((opnssmp_size + pgd_block_size - 1) &~ (pgd_block_size - 1)) / pgd_block_size;
-			pgd_buf = (u8 *) malloc (0x90 + opnssmp_size + pgd_blocks * 16);
-		
-			// Read OPNSSMP file.
-			u8 *opnssmp_buf = (u8 *) malloc (opnssmp_size);
-			if ((int)fread(opnssmp_buf, 1, opnssmp_size, opnssmp) != opnssmp_size)
-			{
-				fprintf(stderr, "ERROR: Cannot read OPNSSMP file\n");
-				fclose(opnssmp);
-				fclose(iso);
-				fclose(pbp);
-				return 0;
-			}
-		
-			// Encrypt OPNSSMP file with version_key.
-			pgd_size = encrypt_pgd(opnssmp_buf, opnssmp_size, pgd_block_size, 1, 1, 2, version_key, pgd_buf);
-			
-			// Clean up.
-			fclose(opnssmp);
-			free(opnssmp_buf);
 		}
 		
 		// Check for custom STARTDAT file.
@@ -850,7 +1769,7 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "ERROR: Please check your STARTDAT file!\n");
 				fclose(png);
 				fclose(iso);
-				fclose(pbp);
+				close_outputs(outputs, output_nr);
 				return 0;
 			}
 
@@ -902,35 +1821,105 @@ int main(int argc, char *argv[])
 			fclose(png);
 		}
 		
+		// Start the worker threads.
+		tpool *pool = (threads == 1) ? NULL : tpool_create(threads);
+		
+		// Compressed blocks only depend on the ISO data, they can be reused between runs.
+		BLKCACHE *cache = (compress && cache_name) ? blkcache_open(cache_name, cache_size) : NULL;
+		
 		// Write PBP data.
 		// printf("Writing PBP data...\n");
-		long long table_offset = write_pbp(pbp, iso_name, content_id, np_flags, startdat_buf, startdat_size, pgd_buf, pgd_size);
+		est.header_time = get_time();
+		for (o = 0; o < output_nr && !resumed; o++)
+		{
+			PBP_OUTPUT *out = &outputs[o];
+			
+			if (opnssmp)
+				fseek(opnssmp, 0, SEEK_SET);
+			t = stats_begin(st);
+			out->table_offset = write_pbp(out->pbp, iso_name, out->content_id, out->np_flags, startdat_buf, startdat_size, opnssmp, opnssmp_size, out->version_key, reserve, pool);
+			stats_end(st, STATS_HEADER, t, 0);
+			if (out->table_offset == 0)
+				break;
+		}
+		est.header_time = get_time() - est.header_time;
+		if (opnssmp)
+			fclose(opnssmp);
+		free(startdat_buf);
+		if (o < output_nr && !resumed)
+		{
+			ckpt_free(&ckpt);
+			free(ckpt_path);
+			blkcache_close(cache);
+			tpool_destroy(pool);
+			fclose(iso);
+			close_outputs(outputs, output_nr);
+			return 0;
+		}
 		long long table_size = iso_blocks * 0x20;
-		long long np_offset = table_offset - 0x100;
 		int np_size = 0x100;
 		
+		// Dry run: compress a sample of the blocks and extrapolate.
+		if (estimate)
+		{
+			est.compress = compress;
+			est.level = level_max;
+			est.outputs = output_nr;
+			est.header_size = outputs[0].table_offset - 0x100;
+			if (estimate_blocks(&est, iso, iso_size, block_size, ratio_limit, shrunk, outputs[0].header_key, outputs[0].version_key) == 0)
+				estimate_print(&est, stdout);
+			else
+				fprintf(stderr, "ERROR: Cannot read the ISO blocks\n");
+			if (shrunk)
+				shrink_free(shrunk);
+			blkcache_close(cache);
+			tpool_destroy(pool);
+			fclose(iso);
+			close_outputs(outputs, output_nr);
+			return 0;
+		}
+		
 		// Write NPUMDIMG table.
 		// printf("NPUMDIMG table size: %"INT64_FORMAT"d\n", table_size);
 		// printf("Writing NPUMDIMG table...\n\n");
-		u8 *table_buf = malloc(table_size);
-		memset(table_buf, 0, table_size);
-		fwrite(table_buf, table_size, 1, pbp);
+		for (o = 0; o < output_nr && !resumed; o++)
+		{
+			outputs[o].table_buf = malloc(table_size);
+			memset(outputs[o].table_buf, 0, table_size);
+			fwrite(outputs[o].table_buf, table_size, 1, outputs[o].pbp);
+		}
 		
 		// Write ISO blocks.
 		// printf("ISO size: %"INT64_FORMAT"d\n", iso_size);
 		// printf("ISO blocks: %"INT64_FORMAT"d\n", iso_blocks);
-		long long iso_offset = 0x100 + table_size;
+		long long iso_offset = (resumed) ? ckpt.iso_offset : 0x100 + table_size;
 		u8 *iso_buf = malloc(block_size * 2);
 		u8 *lzrc_buf = malloc(block_size * 2);
+		u8 *enc_buf = malloc(block_size * 2);
 		
-		int i;
-		for(i = 0; i < iso_blocks; i++)
+		// Repeated blocks (zero fill, padding, duplicated files) are compressed once.
+		DEDUP *dedup = compress ? dedup_create((int)iso_blocks, iso, shrunk) : NULL;
+		
+		// Checkpoints save the outputs state every ckpt_every blocks.
+		CKPT save_ctl;
+		CKPT *save = NULL;
+		if (ckpt_every > 0)
+		{
+			ckpt_prepare(&save_ctl, outputs, output_nr, iso_size, block_basis, compress);
+			save = &save_ctl;
+		}
+		
+		int i = (resumed) ? ckpt.blocks : 0;
+		fseeko64(iso, (long long)i * block_size, SEEK_SET);
+		for(; i < iso_blocks; i++)
 		{
-			u8 *tb = table_buf + i * 0x20;
 			u8 *wbuf;
 			int wsize, lzrc_size, ratio;
+			int level = (adapt) ? adapt_level(adapt) : level_max;
+			int used_level = -1;
 
 			// Read ISO block.
+			t = stats_begin(st);
 			memset(iso_buf, 0, block_size);
 			if ((ftello64(iso) + block_size) > iso_size)
 			{
@@ -945,6 +1934,10 @@ int main(int argc, char *argv[])
 					fprintf(stderr, "Warning: Error reading ISO block\n");
 				wsize = block_size;
 			}
+			if (shrunk)
+				shrink_apply(shrunk, iso_buf, (long long)i * block_size, wsize);
+			stats_end(st, STATS_READ, t, wsize);
+			st->bytes_in += wsize;
 			
 			// Set write buffer.
 			wbuf = iso_buf;
@@ -952,88 +1945,236 @@ int main(int argc, char *argv[])
 			// Compress data.
 			if (compress == 1)
 			{
-				lzrc_size = lzrc_compress(lzrc_buf, block_size * 2, iso_buf, block_size);
+				BLKCACHE_KEY key;
+				DEDUP_KEY dkey;
+				int raw = 0;
+				
+				lzrc_size = -1;
+				if (dedup)
+				{
+					t = stats_begin(st);
+					dedup_key(&dkey, iso_buf, wsize);
+					lzrc_size = dedup_get(dedup, &dkey, iso_buf, lzrc_buf, block_size * 2, &raw);
+					stats_end(st, STATS_DEDUP, t, wsize);
+				}
+				
+				if (lzrc_size < 0 && level == 0)
+				{
+					// Not worth trying, see adapt_level.
+					lzrc_size = block_size;
+					raw = 1;
+					used_level = 0;
+				}
+				
+				if (lzrc_size < 0 && cache)
+				{
+					t = stats_begin(st);
+					blkcache_key(&key, iso_buf, block_size, level);
+					lzrc_size = blkcache_get(cache, &key, lzrc_buf, block_size * 2, &raw);
+					
+					// Stored raw by a run with a lower ratio limit, compress it again.
+					if (raw && (lzrc_size * 100) / block_size < ratio_limit)
+					{
+						lzrc_size = -1;
+						raw = 0;
+					}
+					stats_end(st, STATS_CACHE, t, block_size);
+				}
+				
+				if (lzrc_size < 0)
+				{
+					t = stats_begin(st);
+					lzrc_size = lzrc_compress_level(lzrc_buf, block_size * 2, iso_buf, block_size, level);
+					stats_end(st, STATS_COMPRESS, t, block_size);
+					used_level = level;
+					ratio = (lzrc_size * 100) / block_size;
+					if (cache)
+					{
+						t = stats_begin(st);
+						blkcache_put(cache, &key, (ratio < ratio_limit) ? lzrc_buf : NULL, lzrc_size);
+						stats_end(st, STATS_CACHE, t, 0);
+					}
+				}
+				
 				memset(lzrc_buf + lzrc_size, 0, 16);
 				ratio = (lzrc_size * 100) / block_size;
 				
-				if (ratio < RATIO_LIMIT)
+				if (ratio < ratio_limit && !raw)
 				{
 					wbuf = lzrc_buf;
 					wsize = (lzrc_size + 15) &~ 15;
 				}
+				else
+				{
+					raw = 1;
+				}
+				
+				if (dedup)
+					dedup_put(dedup, &dkey, (long long)i * block_size, lzrc_buf, lzrc_size, raw);
 			}
 
-			// Set table entry.
-			*(u32*)(tb + 0x10) = iso_offset;
-			*(u32*)(tb + 0x14) = wsize;
-			*(u32*)(tb + 0x18) = 0;
-			*(u32*)(tb + 0x1C) = 0;
+			if (wbuf == lzrc_buf)
+				st->compressed++;
+			else
+				st->stored++;
+			
+			// Each output encrypts and MACs its own copy of the block.
+			int asize = (wsize + 15) &~ 15;
+			for (o = 0; o < output_nr; o++)
+			{
+				PBP_OUTPUT *out = &outputs[o];
+				u8 *tb = out->table_buf + i * 0x20;
+				
+				// Set table entry.
+				*(u32*)(tb + 0x10) = iso_offset;
+				*(u32*)(tb + 0x14) = wsize;
+				*(u32*)(tb + 0x18) = 0;
+				*(u32*)(tb + 0x1C) = 0;
 
-			// Encrypt block.
-			sceDrmBBCipherInit(&ckey, 1, 2, header_key, version_key, (iso_offset >> 4));
-			sceDrmBBCipherUpdate(&ckey, wbuf, wsize);
-			sceDrmBBCipherFinal(&ckey);
+				// Encrypt block.
+				t = stats_begin(st);
+				memcpy(enc_buf, wbuf, asize);
+				sceDrmBBCipherInit(&ckey, 1, 2, out->header_key, out->version_key, (iso_offset >> 4));
+				sceDrmBBCipherUpdate(&ckey, enc_buf, wsize);
+				sceDrmBBCipherFinal(&ckey);
+				stats_end(st, STATS_CIPHER, t, wsize);
 
-			// Build MAC.
-			sceDrmBBMacInit(&mkey, 3);
-			sceDrmBBMacUpdate(&mkey, wbuf, wsize);
-			sceDrmBBMacFinal(&mkey, tb, version_key);
-			bbmac_build_final2(3, tb);
+				// Build MAC.
+				t = stats_begin(st);
+				sceDrmBBMacInit(&mkey, 3);
+				sceDrmBBMacUpdate(&mkey, enc_buf, wsize);
+				sceDrmBBMacFinal(&mkey, tb, out->version_key);
+				bbmac_build_final2(3, tb);
+				stats_end(st, STATS_MAC, t, wsize);
 
-			// Encrypt table.
-			encrypt_table(tb);
+				// Encrypt table.
+				encrypt_table(tb);
 
-			// Write ISO data.
-			wsize = (wsize + 15) &~ 15;
-			fwrite(wbuf, wsize, 1, pbp);
+				// Write ISO data.
+				t = stats_begin(st);
+				fwrite(enc_buf, asize, 1, out->pbp);
+				stats_end(st, STATS_WRITE, t, asize);
+				
+				if (out->manifest.hash)
+					manifest_block(&out->manifest, i, enc_buf, asize);
+			}
 
 			// Update offset.
-			iso_offset += wsize;
+			iso_offset += asize;
+			
+			if (adapt)
+				adapt_update(adapt, used_level, block_size, (used_level > 0) ? ratio : -1, ratio_limit);
+			
+			if (save && ((i + 1) % ckpt_every) == 0 && (i + 1) < iso_blocks)
+			{
+				t = stats_begin(st);
+				if (write_ckpt(ckpt_path, save, outputs, i + 1, iso_offset, iso_buf, block_size) != 0)
+					fprintf(stderr, "Warning: Cannot write the checkpoint %s\n", ckpt_path);
+				stats_end(st, STATS_WRITE, t, 0);
+			}
 			// printf("\rWriting ISO blocks: %02" INT64_FORMAT "d%%", i * 100 / iso_blocks);
 		}
 		// printf("\rWriting ISO blocks: 100%%\n\n");
 		
-		// Generate data key.
-		sceDrmBBMacInit(&mkey, 3);
-		sceDrmBBMacUpdate(&mkey, table_buf, table_size);
-		sceDrmBBMacFinal(&mkey, data_key, version_key);
-		bbmac_build_final2(3, data_key);
-		
-		// Forge NPUMDIMG header.
-		// printf("Forging NPUMDIMG header...\n");
-		NPUMDIMG_HEADER* npumdimg = forge_npumdimg((int)iso_size, (int)iso_blocks, block_basis, content_id, np_flags, version_key, header_key, data_key);
-		// printf("NPUMDIMG flags: 0x%08X\n", np_flags);
-		// printf("NPUMDIMG block basis: 0x%08X\n", block_basis);
-		// printf("NPUMDIMG version key: 0x");
-		// for (i = 0; i < 0x10; i++)
-			// printf("%02X", version_key[i]);	
-		// printf("\n");
-		// printf("NPUMDIMG header key: 0x");
-		// for (i = 0; i < 0x10; i++)
-			// printf("%02X", npumdimg->header_key[i]);
-		// printf("\n");
-		// printf("NPUMDIMG header hash: 0x");
-		// for (i = 0; i < 0x10; i++)
-			// printf("%02X", npumdimg->header_hash[i]);
-		// printf("\n");
-		// printf("NPUMDIMG data key: 0x");
-		// for (i = 0; i < 0x10; i++)
-			// printf("%02X", npumdimg->data_key[i]);
-		// printf("\n\n");
-	
-		// Update NPUMDIMG header and NP table.
-		fseeko64(pbp, np_offset, SEEK_SET);
-		fwrite(npumdimg, np_size, 1, pbp);
-		fseeko64(pbp, table_offset, SEEK_SET);
-		fwrite(table_buf, table_size, 1, pbp);
+		for (o = 0; o < output_nr; o++)
+		{
+			PBP_OUTPUT *out = &outputs[o];
+			long long np_offset = out->table_offset - 0x100;
+			u8 data_key[0x10];
+			
+			st->bytes_out += ftello64(out->pbp);
+			t = stats_begin(st);
+			
+			// Generate data key.
+			sceDrmBBMacInit(&mkey, 3);
+			sceDrmBBMacUpdate(&mkey, out->table_buf, table_size);
+			sceDrmBBMacFinal(&mkey, data_key, out->version_key);
+			bbmac_build_final2(3, data_key);
+			
+			// Forge NPUMDIMG header.
+			// printf("Forging NPUMDIMG header...\n");
+			NPUMDIMG_HEADER* npumdimg = forge_npumdimg((int)iso_size, (int)iso_blocks, block_basis, out->content_id, out->np_flags, out->version_key, out->header_key, data_key);
+			// printf("NPUMDIMG flags: 0x%08X\n", out->np_flags);
+			// printf("NPUMDIMG block basis: 0x%08X\n", block_basis);
+			// printf("NPUMDIMG version key: 0x");
+			// for (i = 0; i < 0x10; i++)
+				// printf("%02X", out->version_key[i]);
+			// printf("\n");
+			// printf("NPUMDIMG header key: 0x");
+			// for (i = 0; i < 0x10; i++)
+				// printf("%02X", npumdimg->header_key[i]);
+			// printf("\n");
+			// printf("NPUMDIMG header hash: 0x");
+			// for (i = 0; i < 0x10; i++)
+				// printf("%02X", npumdimg->header_hash[i]);
+			// printf("\n");
+			// printf("NPUMDIMG data key: 0x");
+			// for (i = 0; i < 0x10; i++)
+				// printf("%02X", npumdimg->data_key[i]);
+			// printf("\n\n");
+			
+			// Update NPUMDIMG header and NP table.
+			fseeko64(out->pbp, np_offset, SEEK_SET);
+			fwrite(npumdimg, np_size, 1, out->pbp);
+			fseeko64(out->pbp, out->table_offset, SEEK_SET);
+			fwrite(out->table_buf, table_size, 1, out->pbp);
+			free(npumdimg);
+			
+			if (out->manifest.hash)
+			{
+				char *manifest_path = manifest_name(out->pbp_name);
+				fflush(out->pbp);
+				if (manifest_write(&out->manifest, manifest_path, fileno(out->pbp), out->table_offset, out->table_buf) != 0)
+					fprintf(stderr, "Warning: Cannot write the manifest %s\n", manifest_path);
+				free(manifest_path);
+			}
+			stats_end(st, STATS_FINALIZE, t, 0);
+		}
+		
+		if (dedup && !st->enabled)
+			printf("Duplicate blocks: %d of %"INT64_FORMAT"d served from the dedup map\n", dedup_hits(dedup), iso_blocks);
+		
+		if (adapt && !st->enabled)
+			printf("Adaptive compression: average level %.1f, %"INT64_FORMAT"d block(s) stored without compressing\n", adapt_average(adapt), adapt->blocks[0]);
+		
+		if (cache && !st->enabled)
+		{
+			long long hits, misses;
+			blkcache_counters(cache, &hits, &misses);
+			printf("Block cache: %lld hit(s), %lld miss(es)\n", hits, misses);
+		}
+		
+		if (st->enabled)
+		{
+			long long misses;
+			st->blocks = iso_blocks;
+			st->dedup_hits = dedup_hits(dedup);
+			blkcache_counters(cache, &st->cache_hits, &misses);
+			st->outputs = output_nr;
+			st->threads = tpool_threads(pool);
+			tpool_wait_times(pool, &st->queue_wait, &st->join_wait);
+			stats_print(st, stdout);
+		}
+		
+		// The outputs are complete, there is nothing to resume.
+		if (ckpt_path)
+			remove(ckpt_path);
 		
 		// Clean up.
+		if (save)
+			free(save->outputs);
+		if (shrunk)
+			shrink_free(shrunk);
+		ckpt_free(&ckpt);
+		free(ckpt_path);
+		dedup_free(dedup);
+		blkcache_close(cache);
+		tpool_destroy(pool);
 		fclose(iso);
-		fclose(pbp);
-		free(table_buf);
+		close_outputs(outputs, output_nr);
 		free(iso_buf);
 		free(lzrc_buf);
-		free(npumdimg);
+		free(enc_buf);
 		
 		return 0;
 	}
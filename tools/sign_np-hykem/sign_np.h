@@ -4,13 +4,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef __MINGW32__
+#include <sys/uio.h>
+#endif
 
 #include "libkirk/kirk_engine.h"
 #include "libkirk/amctrl.h"
+#include "libkirk/sha1.h"
+#include "adapt.h"
+#include "blkcache.h"
+#include "ckpt.h"
+#include "dedup.h"
+#include "estimate.h"
 #include "isoreader.h"
 #include "eboot.h"
+#include "manifest.h"
+#include "npumdimg.h"
 #include "pgd.h"
+#include "pgdtree.h"
+#include "shrink.h"
+#include "stats.h"
 #include "tlzrc.h"
+#include "verify.h"
 #include "utils.h"
 
 #ifdef __MINGW32__ 
@@ -21,17 +36,21 @@
 #define ftello64 ftello
 #endif 
 
+// NPUMDIMG block size in sectors: a power of two, retail images use 0x10 (32 KiB).
+#define BLOCK_BASIS 0x10
+#define BLOCK_BASIS_MAX 0x40
+
+// Blocks compressed to this percentage of their size or more are stored raw (1 to 99).
 #define RATIO_LIMIT 90
+
+// Largest --reserve-header, room for the header entries before DATA.PSAR.
+#define PBP_RESERVE_MAX 0x1000000
+
+// PBP header entries replaced by -update-meta: PARAM.SFO, ICON0, ICON1, PIC0, PIC1 and SND0.
+#define PBP_META_ENTRIES 6
 #define PSF_MAGIC 0x46535000
 
 static u8 npumdimg_private_key[0x14] = {0x14, 0xB0, 0x22, 0xE8, 0x92, 0xCF, 0x86, 0x14, 0xA4, 0x45, 0x57, 0xDB, 0x09, 0x5C, 0x92, 0x8D, 0xE9, 0xB8, 0x99, 0x70};
-static u8 npumdimg_public_key[0x28] = {
-		0x01, 0x21, 0xEA, 0x6E, 0xCD, 0xB2, 0x3A, 0x3E,
-		0x23, 0x75, 0x67, 0x1C, 0x53, 0x62, 0xE8, 0xE2,
-		0x8B, 0x1E, 0x78, 0x3B, 0x1A, 0x27, 0x32, 0x15,
-		0x8B, 0x8C, 0xED, 0x98, 0x46, 0x6C, 0x18, 0xA3,
-		0xAC, 0x3B, 0x11, 0x06, 0xAF, 0xB4, 0xEC, 0x3B
-};
 
 typedef struct {
 	u32 magic;
@@ -58,43 +77,17 @@ typedef struct {
 	u32				 data_size;
 } STARTDAT_HEADER;
 
+// An EBOOT.PBP written from the ISO, with its own content ID and keys.
 typedef struct {
-	u16 sector_size; 	// 0x0800
-	u16 unk_2;			// 0xE000
-	u32 unk_4;
-	u32 unk_8;
-	u32 unk_12;
-	u32 unk_16;
-	u32 lba_start;
-	u32 unk_24;
-	u32 nsectors;
-	u32 unk_32;
-	u32 lba_end;
-	u32 unk_40;
-	u32 block_entry_offset;
-	char disc_id[0x10];
-	u32 header_start_offset;
-	u32 unk_68;
-	u8 unk_72;
-	u8 bbmac_param;
-	u8 unk_74;
-	u8 unk_75;
-	u32 unk_76;
-	u32 unk_80;
-	u32 unk_84;
-	u32 unk_88;
-	u32 unk_92;
-} NPUMDIMG_HEADER_BODY;
-
-typedef struct {
-	u8 magic[0x08];  // NPUMDIMG
-	u32 np_flags;
-	u32 block_basis;
-	u8 content_id[0x30];
-	NPUMDIMG_HEADER_BODY body;	
+	char *pbp_name;
+	char *cid;
+	char *vk;
+	FILE *pbp;
+	char content_id[0x30];
+	int np_flags;
+	u8 version_key[0x10];
 	u8 header_key[0x10];
-	u8 data_key[0x10];
-	u8 header_hash[0x10];
-	u8 padding[0x8];
-	u8 ecdsa_sig[0x28];
-} NPUMDIMG_HEADER;
\ No newline at end of file
+	long long table_offset;
+	u8 *table_buf;
+	MANIFEST manifest;			// --manifest, hashes of the blocks as written.
+} PBP_OUTPUT;
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include "stats.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+static const char *stats_names[STATS_COUNT] = {
+	"read",
+	"dedup",
+	"cache",
+	"compress",
+	"cipher",
+	"mac",
+	"write",
+	"ecdsa",
+	"header",
+	"finalize",
+};
+
+int stats_init(SIGN_STATS *st, const char *format)
+{
+	memset(st, 0, sizeof(SIGN_STATS));
+
+	if (format != NULL && strcmp(format, "text") && strcmp(format, "json"))
+		return -1;
+
+	st->enabled = 1;
+	st->json = (format != NULL && !strcmp(format, "json"));
+	st->start = get_time();
+
+	return 0;
+}
+
+double stats_begin(SIGN_STATS *st)
+{
+	return (st != NULL && st->enabled) ? get_time() : 0;
+}
+
+void stats_end(SIGN_STATS *st, int stage, double begin, long long bytes)
+{
+	if (st == NULL || !st->enabled)
+		return;
+
+	st->time[stage] += get_time() - begin;
+	st->calls[stage]++;
+	st->bytes[stage] += bytes;
+}
+
+long long stats_peak_rss(void)
+{
+#ifndef _WIN32
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		return ru.ru_maxrss;  // KB on Linux.
+#endif
+
+	return 0;
+}
+
+static double stats_mbps(long long bytes, double seconds)
+{
+	return (seconds > 0) ? bytes / (1024.0 * 1024.0) / seconds : 0;
+}
+
+void stats_print(SIGN_STATS *st, FILE *f)
+{
+	double total = get_time() - st->start;
+	long long rss = stats_peak_rss();
+	int i;
+
+	if (st->json)
+	{
+		fprintf(f, "{\"total_seconds\":%.6f,\"outputs\":%d,\"threads\":%d,", total, st->outputs, st->threads);
+		fprintf(f, "\"blocks\":%lld,\"compressed\":%lld,\"stored\":%lld,\"dedup_hits\":%lld,\"cache_hits\":%lld,",
+			st->blocks, st->compressed, st->stored, st->dedup_hits, st->cache_hits);
+		fprintf(f, "\"bytes_in\":%lld,\"bytes_out\":%lld,\"peak_rss_kb\":%lld,", st->bytes_in, st->bytes_out, rss);
+		fprintf(f, "\"queue_wait_seconds\":%.6f,\"join_wait_seconds\":%.6f,\"stages\":{", st->queue_wait, st->join_wait);
+		for (i = 0; i < STATS_COUNT; i++)
+		{
+			fprintf(f, "%s\"%s\":{\"seconds\":%.6f,\"calls\":%lld,\"bytes\":%lld%s}", (i > 0) ? "," : "",
+				stats_names[i], st->time[i], st->calls[i], st->bytes[i], (i == STATS_ECDSA) ? ",\"nested\":true" : "");
+		}
+		fprintf(f, "}}\n");
+		return;
+	}
+
+	fprintf(f, "Total: %.3f s, %d output(s), %d thread(s), peak RSS %.1f MB\n", total, st->outputs, st->threads, rss / 1024.0);
+	fprintf(f, "Blocks: %lld (%lld compressed, %lld stored, %lld duplicate, %lld cached)\n",
+		st->blocks, st->compressed, st->stored, st->dedup_hits, st->cache_hits);
+	fprintf(f, "Data: %.2f MB in, %.2f MB out, %.2f MB/s\n", st->bytes_in / (1024.0 * 1024.0),
+		st->bytes_out / (1024.0 * 1024.0), stats_mbps(st->bytes_in, total));
+	fprintf(f, "Pool: %.3f s queued, %.3f s waited\n", st->queue_wait, st->join_wait);
+	for (i = 0; i < STATS_COUNT; i++)
+	{
+		if (st->calls[i] == 0 || i == STATS_ECDSA)
+			continue;
+
+		fprintf(f, "  %-9s %9.3f s %5.1f%% %10lld call(s)", stats_names[i], st->time[i],
+			(total > 0) ? st->time[i] * 100 / total : 0, st->calls[i]);
+		if (st->bytes[i])
+			fprintf(f, " %9.2f MB/s", stats_mbps(st->bytes[i], st->time[i]));
+		fprintf(f, "\n");
+	}
+
+	// The signatures are made within the header and finalize stages, they have no share of their own.
+	if (st->calls[STATS_ECDSA])
+	{
+		fprintf(f, "    %-7s %9.3f s        %10lld call(s), within header and finalize\n", stats_names[STATS_ECDSA],
+			st->time[STATS_ECDSA], st->calls[STATS_ECDSA]);
+	}
+}
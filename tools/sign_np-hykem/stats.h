@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#include "utils.h"
+
+// Stages of the -pbp pipeline.
+enum {
+	STATS_READ,			// ISO reads.
+	STATS_DEDUP,		// Duplicate block lookups.
+	STATS_CACHE,		// Block cache lookups and updates.
+	STATS_COMPRESS,		// lzrc_compress.
+	STATS_CIPHER,		// BBCipher of the blocks.
+	STATS_MAC,			// BBMac of the blocks.
+	STATS_WRITE,		// PBP writes.
+	STATS_ECDSA,		// DATA.PSP and NPUMDIMG signatures, part of the header and finalize time.
+	STATS_HEADER,		// PBP header (PARAM.SFO, DATA.PSP, OPNSSMP).
+	STATS_FINALIZE,		// Data key, NPUMDIMG header and table.
+	STATS_COUNT
+};
+
+typedef struct {
+	int enabled;
+	int json;
+	double start;
+	double time[STATS_COUNT];
+	long long calls[STATS_COUNT];
+	long long bytes[STATS_COUNT];
+	long long blocks;
+	long long compressed;		// Blocks stored compressed.
+	long long stored;			// Blocks stored raw.
+	long long dedup_hits;
+	long long cache_hits;
+	long long bytes_in;
+	long long bytes_out;
+	int outputs;
+	int threads;
+	double queue_wait;			// Time the pool jobs spent queued.
+	double join_wait;			// Time spent waiting for the pool.
+} SIGN_STATS;
+
+/*
+	Parse the --stats option value: NULL or "text" for a summary, "json"
+	for a single JSON object. Returns 0 on success.
+*/
+int stats_init(SIGN_STATS *st, const char *format);
+
+// Stage timer, both are no-ops when the stats are disabled.
+double stats_begin(SIGN_STATS *st);
+void stats_end(SIGN_STATS *st, int stage, double begin, long long bytes);
+
+// Peak resident set size in KB, 0 if unknown.
+long long stats_peak_rss(void);
+
+// Print the summary (or the JSON object) to f.
+void stats_print(SIGN_STATS *st, FILE *f);
+
+#endif
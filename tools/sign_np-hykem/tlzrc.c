@@ -11,14 +11,23 @@ static int t_len, t_pos;
 static int prev[65536], next[65536];
 static int root[65536];
 
+// Match finder effort of each level: candidates compared (0: all) and length to stop at.
+static const struct {
+	int max_chain;
+	int nice_len;
+} lzrc_levels[LZRC_LEVEL_MAX + 1] = {
+	{0, 255}, {4, 16}, {8, 24}, {16, 32}, {32, 48}, {64, 64}, {128, 128}, {256, 255}, {1024, 255}, {0, 255}, {0, 255},
+};
+static int max_chain, nice_len;
+
 /* 
 	LZRC decoder
 */
 static u8 rc_getbyte(LZRC_DECODE *rc)
 {
-	if (rc->in_ptr == rc->in_len) {
-		printf("End of input!\n");
-		exit(-1);
+	if (rc->in_ptr >= rc->in_len) {
+		rc->error = 1;
+		return 0;
 	}
 
 	return rc->input[rc->in_ptr++];
@@ -27,8 +36,8 @@ static u8 rc_getbyte(LZRC_DECODE *rc)
 static void rc_putbyte(LZRC_DECODE *rc, u8 byte)
 {
 	if (rc->out_ptr == rc->out_len) {
-		printf("Output overflow!\n");
-		exit(-1);
+		rc->error = 1;
+		return;
 	}
 
 	rc->output[rc->out_ptr++] = byte;
@@ -45,6 +54,7 @@ static void rc_init(LZRC_DECODE *rc, void *out, int out_len, void *in, int in_le
 	rc->out_ptr = 0;
 
 	rc->range = 0xffffffff;
+	rc->error = 0;
 	rc->lc = rc_getbyte(rc);
 	rc->code =  (rc_getbyte(rc)<<24) |
 				(rc_getbyte(rc)<<16) | 
@@ -63,7 +73,8 @@ static void normalize(LZRC_DECODE *rc)
 {
 	if (rc->range < 0x01000000) {
 		rc->range <<= 8;
-		rc->code = (rc->code << 8) + rc->input[rc->in_ptr];
+		// Past the end of the input, read the zero padding of the block.
+		rc->code = (rc->code << 8) + ((rc->in_ptr < rc->in_len) ? rc->input[rc->in_ptr] : 0);
 		rc->in_ptr++;
 	}
 }
@@ -146,9 +157,14 @@ int lzrc_decompress(void *out, int out_len, void *in, int in_len)
 	u8 *match_src;
 	int round = -1;
 
+	// Malformed input makes the decoder return -1.
 	rc_init(&rc, out, out_len, in, in_len);
+	if (rc.error)
+		return -1;
 
 	if (rc.lc & 0x80) {
+		if (rc.code > (u32)out_len || rc.code > (u32)(in_len - 5))
+			return -1;
 		memcpy(rc.output, rc.input + 5, rc.code);
 		return rc.code; 
 	}
@@ -209,16 +225,18 @@ int lzrc_decompress(void *out, int out_len, void *in, int in_len)
 				match_dist = 1;
 			}
 
-			if (match_dist > rc.out_ptr || match_dist < 0) {
-				printf("match_dist out of range! %08x\n", match_dist);
+			if (match_dist > rc.out_ptr || match_dist < 0)
 				return -1;
-			}
 			match_src = rc.output + rc.out_ptr - match_dist;
 			for (i = 0; i < match_len + 1; i++) {
 				rc_putbyte(&rc, *match_src++);
 			}
 			rc_state = 6 + ((rc.out_ptr + 1) & 1);
 		}
+
+		if (rc.error)
+			return -1;
+
 		last_byte = rc.output[rc.out_ptr - 1];
 	}
 }
@@ -272,6 +290,18 @@ static void re_init(LZRC_DECODE *re, void *out, int out_len, void *in, int in_le
 
 static void re_flush(LZRC_DECODE *re)
 {
+	// Propagate a pending carry, as re_normalize does.
+	if (re->out_code != 0xffffffff && re->out_code > 255)
+	{
+		int p, old_c;
+		p = re->out_ptr - 1;
+		do {
+			old_c = re->output[p];
+			re->output[p] += 1;
+			p -= 1;
+		} while (old_c == 0xff);
+	}
+
 	re_putbyte(re, (re->out_code) & 0xff);
 	re_putbyte(re, (re->code >> 24) & 0xff);
 	re_putbyte(re, (re->code >> 16) & 0xff);
@@ -471,29 +501,37 @@ static int insert_node(LZRC_DECODE *re, int pos, int *match_len, int *match_dist
 	if (p != -1)
 		prev[p] = pos;
 
+	int chain = 0;
 	while (do_cmp == 1 && p != -1)
 	{
+		if (max_chain && chain++ == max_chain)
+			break;
+
 		for (i = 0; (i < 255 && i < content_size); i++) {
 			if (src[i] != text_buf[p + i])
 				break;
 		}
 
+		// Distance in the ring buffer, inputs over 65280 bytes wrap around.
+		int mp = pos - p;
+		if (mp < 0)
+			mp += 65280;
+
 		if (i > t_len) {
 			t_len = i;
-			t_pos = pos - p;
+			t_pos = mp;
 		} else if (i == t_len) {
-			int mp = pos - p;
-			if (mp < 0)
-				mp += 65280;
 			if (mp < t_pos) {
 				t_len = i;
-				t_pos = pos-p;
+				t_pos = mp;
 			}
 		}
 		if (i == 255) {
 			remove_node(re, p);
 			break;
 		}
+		if (t_len >= nice_len)
+			break;
 
 		p = next[p];
 	}
@@ -603,7 +641,488 @@ static void re_find_match(LZRC_DECODE *re, int *match_len, int *match_dist)
 	}
 }
 
+/*
+	Optimal parse (LZRC_LEVEL_OPTIMAL), in the style of LZMA: the cheapest
+	sequence of literals and matches over a window of the input is found
+	with the bit prices of the current probabilities, then encoded, which
+	updates the probabilities for the next window.
+*/
+#define OPT_WINDOW		16384		// Farthest match distance, as the greedy parse.
+#define OPT_MAX_LEN		255
+#define OPT_CHUNK		512			// Positions parsed with the same prices.
+#define OPT_MAX_CHAIN	256
+#define OPT_NICE_LEN	128			// Long enough to be taken as is.
+#define PRICE_BITS		6			// Prices in 1/64 bit.
+#define PRICE_INF		0x3FFFFFFF
+
+typedef struct {
+	int cost;
+	int prev;		// Position the step comes from.
+	int len;		// 1 for a literal.
+	int dist;
+	int state;
+} OPT_NODE;
+
+typedef struct {
+	int len;
+	int dist;
+} OPT_MATCH;
+
+// Prices of the current probabilities, refreshed for each chunk.
+typedef struct {
+	int match[8][4][OPT_MAX_LEN + 1];	// Flag and length, by state and position & 3.
+	int match_valid[8][4];				// Rows are filled when first used.
+	int dist_bits[16][15];				// By length class (len_bits * 2 + long) and dist_bits.
+	int dist_low[15][16];				// Last 3 bits (all of them under 4 dist_bits).
+	int dist_high[15][4];				// The bits coded with prob[3], over 3 dist_bits.
+} OPT_PRICES;
+
+static int price_tab[257];		// -log2(p / 256) in 1/64 bit.
+
+static void init_prices(void)
+{
+	int i, k;
+
+	if (price_tab[1])
+		return;
+
+	// Binary logarithm, one fraction bit per squaring.
+	for (i = 1; i <= 256; i++)
+	{
+		double x = i / 256.0, bit = 0.5, l = 0;
+
+		while (x < 1) {
+			x *= 2;
+			l -= 1;
+		}
+		for (k = 0; k < 16; k++, bit /= 2) {
+			x *= x;
+			if (x >= 2) {
+				x /= 2;
+				l += bit;
+			}
+		}
+		price_tab[i] = (int)(-l * (1 << PRICE_BITS) + 0.5);
+	}
+	price_tab[0] = price_tab[1];
+}
+
+// Price of a bit coded with prob, the probability of a 1 out of 256.
+static inline int price_bit(u8 prob, int bit)
+{
+	return price_tab[bit ? prob : 256 - prob];
+}
+
+static int price_bittree(u8 *probs, int limit, int number)
+{
+	int n, tmp, price = 0;
+
+	number += limit;
+	tmp = number;
+	n = 0;
+	while (tmp > 1) {
+		tmp >>= 1;
+		n++;
+	}
+
+	do {
+		price += price_bit(probs[number >> n], (number >> (n - 1)) & 1);
+		n -= 1;
+	} while (n);
+
+	return price;
+}
+
+// Mirrors re_number.
+static int price_number(u8 *prob, int n, int number)
+{
+	int i = 1, price = 0;
+
+	if (n > 3) {
+		price += price_bit(prob[3], (number >> (n - i)) & 1);
+		i += 1;
+		if (n > 4) {
+			price += price_bit(prob[3], (number >> (n - i)) & 1);
+			i += 1;
+			if (n > 5) {
+				price += (n - 5) << PRICE_BITS;
+				i = n - 2;
+			}
+		}
+	}
+
+	if (n > 0) {
+		price += price_bit(prob[0], (number >> (n - i - 0)) & 1);
+		if (n > 1) {
+			price += price_bit(prob[1], (number >> (n - i - 1)) & 1);
+			if (n > 2)
+				price += price_bit(prob[2], (number >> (n - i - 2)) & 1);
+		}
+	}
+
+	return price;
+}
+
+static int len_bits_of(int len)
+{
+	int len_bits = 0;
+
+	while (len_bits < 7 && (len - 1) >= (2 << len_bits))
+		len_bits++;
+
+	return len_bits;
+}
+
+static int dist_bits_of(int dist)
+{
+	int dist_bits = 0;
+
+	while ((dist >> dist_bits) != 1)
+		dist_bits++;
+
+	return dist_bits;
+}
+
+static int price_literal(LZRC_DECODE *re, int state, int last_byte, int byte)
+{
+	return price_bit(re->bm_match[state][0], 0) +
+		price_bittree(&re->bm_literal[((last_byte >> re->lc) & 0x07)][0], 0x100, byte);
+}
+
+// Everything but the distance of a match of len at pos.
+static int price_match_len(LZRC_DECODE *re, int state, int pos, int len)
+{
+	int len_bits = len_bits_of(len);
+	int i, price;
+
+	price = price_bit(re->bm_match[state][0], 1);
+	for (i = 1; i <= len_bits; i++)
+		price += price_bit(re->bm_match[state][i], 1);
+	if (len_bits < 7)
+		price += price_bit(re->bm_match[state][len_bits + 1], 0);
+
+	if (len_bits > 0)
+		price += price_number(&re->bm_len[state][((len_bits - 1) << 2) + ((pos << (len_bits - 1)) & 0x03)], len_bits, len - 1);
+
+	return price;
+}
+
+static int len_class(int len)
+{
+	return (len_bits_of(len) << 1) | (len > 3);
+}
+
+static void opt_update_prices(LZRC_DECODE *re, OPT_PRICES *pr)
+{
+	int i, len, dist_bits, bits;
+
+	memset(pr->match_valid, 0, sizeof(pr->match_valid));
+
+	// The first length of each class.
+	static const int class_lens[] = {2, 3, 4, 5, 9, 17, 33, 65, 129};
+	for (i = 0; i < 9; i++)
+	{
+		len = class_lens[i];
+		u8 *probs = (len > 3) ? &re->bm_dist_bits[len_bits_of(len)][7] : &re->bm_dist_bits[len_bits_of(len)][0];
+		for (dist_bits = 0; dist_bits < 15; dist_bits++)
+			pr->dist_bits[len_class(len)][dist_bits] = (len > 3 || dist_bits < 8) ? price_bittree(probs, (len > 3) ? 44 : 8, dist_bits) : PRICE_INF;
+	}
+
+	// price_number split in its prob[3] bits, direct bits and last bits.
+	for (dist_bits = 1; dist_bits < 15; dist_bits++)
+	{
+		u8 *prob = &re->bm_dist[dist_bits][0];
+		if (dist_bits <= 3)
+		{
+			for (bits = 0; bits < (1 << dist_bits); bits++)
+				pr->dist_low[dist_bits][bits] = price_number(prob, dist_bits, (1 << dist_bits) | bits);
+			continue;
+		}
+
+		for (bits = 0; bits < 8; bits++)
+			pr->dist_low[dist_bits][bits] = price_bit(prob[0], (bits >> 2) & 1) + price_bit(prob[1], (bits >> 1) & 1) + price_bit(prob[2], bits & 1);
+		for (bits = 0; bits < 4; bits++)
+		{
+			pr->dist_high[dist_bits][bits] = price_bit(prob[3], (bits >> 1) & 1);
+			if (dist_bits > 4)
+				pr->dist_high[dist_bits][bits] += price_bit(prob[3], bits & 1) + ((dist_bits - 5) << PRICE_BITS);
+		}
+	}
+}
+
+static int opt_match_price(LZRC_DECODE *re, OPT_PRICES *pr, int state, int pos, int len, int dist)
+{
+	int dist_bits = dist_bits_of(dist);
+	int price;
+
+	if (!pr->match_valid[state][pos & 3])
+	{
+		int l;
+		for (l = 2; l <= OPT_MAX_LEN; l++)
+			pr->match[state][pos & 3][l] = price_match_len(re, state, pos, l);
+		pr->match_valid[state][pos & 3] = 1;
+	}
+
+	price = pr->match[state][pos & 3][len] + pr->dist_bits[len_class(len)][dist_bits];
+	if (dist_bits > 3)
+		price += pr->dist_high[dist_bits][(dist >> (dist_bits - 2)) & 3] + pr->dist_low[dist_bits][dist & 7];
+	else if (dist_bits > 0)
+		price += pr->dist_low[dist_bits][dist & ((1 << dist_bits) - 1)];
+
+	return price;
+}
+
+// Same symbols as the greedy parse, the state follows the decoder.
+static void re_literal(LZRC_DECODE *re, int *state)
+{
+	int last_byte = (re->in_ptr > 0) ? re->input[re->in_ptr - 1] : 0;
+
+	re_bit(re, &re->bm_match[*state][0], 0);
+	if (*state > 0)
+		*state -= 1;
+
+	re_bittree(re, &re->bm_literal[((last_byte >> re->lc) & 0x07)][0], 0x100, re->input[re->in_ptr]);
+	re->in_ptr += 1;
+}
+
+static void re_match(LZRC_DECODE *re, int *state, int len, int dist)
+{
+	int len_bits = len_bits_of(len);
+	int dist_bits = dist_bits_of(dist);
+	int i;
+
+	re_bit(re, &re->bm_match[*state][0], 1);
+	for (i = 1; i <= len_bits; i++)
+		re_bit(re, &re->bm_match[*state][i], 1);
+	if (len_bits < 7)
+		re_bit(re, &re->bm_match[*state][len_bits + 1], 0);
+
+	if (len_bits > 0)
+		re_number(re, &re->bm_len[*state][((len_bits - 1) << 2) + ((re->in_ptr << (len_bits - 1)) & 0x03)], len_bits, len - 1);
+
+	if (len > 3)
+		re_bittree(re, &re->bm_dist_bits[len_bits][7], 44, dist_bits);
+	else
+		re_bittree(re, &re->bm_dist_bits[len_bits][0], 8, dist_bits);
+
+	if (dist_bits > 0)
+		re_number(re, &re->bm_dist[dist_bits][0], dist_bits, dist);
+
+	re->in_ptr += len;
+	*state = 6 + ((re->in_ptr + 1) & 1);
+}
+
+/*
+	Matches at pos, by increasing length (each with its smallest distance),
+	from hash chains of the 2 byte prefixes. Returns their number.
+*/
+static void opt_insert(u8 *in, int in_len, int pos, int *head, int *chain)
+{
+	int h;
+
+	if (in_len - pos < 2)
+		return;
+
+	h = (in[pos] << 8) | in[pos + 1];
+	chain[pos] = head[h];
+	head[h] = pos;
+}
+
+static int opt_find_matches(u8 *in, int in_len, int pos, int *head, int *chain, OPT_MATCH *matches)
+{
+	int max_len = (in_len - pos < OPT_MAX_LEN) ? in_len - pos : OPT_MAX_LEN;
+	int count = 0, best = 1, depth = 0;
+	int h, p;
+
+	if (max_len < 2)
+		return 0;
+
+	h = (in[pos] << 8) | in[pos + 1];
+	p = head[h];
+	chain[pos] = p;
+	head[h] = pos;
+
+	for (; p >= 0 && pos - p <= OPT_WINDOW && depth < OPT_MAX_CHAIN; p = chain[p], depth++)
+	{
+		int len = 2;
+
+		if (in[p + best] != in[pos + best])
+			continue;
+		while (len < max_len && in[p + len] == in[pos + len])
+			len++;
+
+		// Short matches are only coded up to 255 bytes away.
+		if (len > best && (len > 3 || pos - p <= 255))
+		{
+			best = len;
+			matches[count].len = len;
+			matches[count].dist = pos - p;
+			count++;
+			if (len == max_len)
+				break;
+		}
+	}
+
+	return count;
+}
+
+static int lzrc_compress_optimal(void *out, int out_len, void *in, int in_len)
+{
+	LZRC_DECODE re;
+	u8 *input = (u8 *) in;
+	int *head = (int *) malloc(65536 * sizeof(int));
+	int *chain = (int *) malloc((in_len + 1) * sizeof(int));
+	OPT_NODE *nodes = (OPT_NODE *) malloc((OPT_CHUNK + OPT_MAX_LEN + 1) * sizeof(OPT_NODE));
+	OPT_MATCH matches[OPT_MAX_LEN];
+	int *path = (int *) malloc((OPT_CHUNK + OPT_MAX_LEN + 1) * sizeof(int));
+	OPT_PRICES *pr = (OPT_PRICES *) malloc(sizeof(OPT_PRICES));
+	int state = 0;
+	int i, pos, end, reach, skip;
+
+	if (head == NULL || chain == NULL || nodes == NULL || path == NULL || pr == NULL)
+	{
+		free(head);
+		free(chain);
+		free(nodes);
+		free(path);
+		free(pr);
+		return -1;
+	}
+
+	init_prices();
+	memset(head, 0xFF, 65536 * sizeof(int));
+	re_init(&re, out, out_len, in, in_len);
+
+	pos = 0;
+	while (pos < in_len)
+	{
+		end = (in_len - pos < OPT_CHUNK) ? in_len : pos + OPT_CHUNK;
+		reach = (in_len - end < OPT_MAX_LEN) ? in_len : end + OPT_MAX_LEN;
+
+		for (i = 0; i <= reach - pos; i++)
+			nodes[i].cost = PRICE_INF;
+		nodes[0].cost = 0;
+		nodes[0].state = state;
+		opt_update_prices(&re, pr);
+
+		/*
+			Cheapest way to reach each position of the chunk. Matches may run past
+			its end, the chunk is then extended with literals up to the furthest one.
+		*/
+		for (i = pos, skip = pos, reach = end; i < reach; i++)
+		{
+			OPT_NODE *node = &nodes[i - pos];
+			int last_byte = (i > 0) ? input[i - 1] : 0;
+			int count, m, len, cost;
+
+			// Inside a long match, see below.
+			if (i < skip)
+			{
+				opt_insert(input, in_len, i, head, chain);
+				continue;
+			}
+
+			cost = node->cost + price_literal(&re, node->state, last_byte, input[i]);
+			if (cost < nodes[i + 1 - pos].cost)
+			{
+				nodes[i + 1 - pos].cost = cost;
+				nodes[i + 1 - pos].prev = i;
+				nodes[i + 1 - pos].len = 1;
+				nodes[i + 1 - pos].state = (node->state > 0) ? node->state - 1 : 0;
+			}
+
+			if (i >= end)
+			{
+				opt_insert(input, in_len, i, head, chain);
+				continue;
+			}
+
+			count = opt_find_matches(input, in_len, i, head, chain, matches);
+			if (count == 0)
+				continue;
+
+			// A long match is taken as is, the positions it covers are only indexed.
+			if (matches[count - 1].len >= OPT_NICE_LEN)
+			{
+				len = matches[count - 1].len;
+				cost = node->cost + opt_match_price(&re, pr, node->state, i, len, matches[count - 1].dist);
+				if (cost < nodes[i + len - pos].cost)
+				{
+					nodes[i + len - pos].cost = cost;
+					nodes[i + len - pos].prev = i;
+					nodes[i + len - pos].len = len;
+					nodes[i + len - pos].dist = matches[count - 1].dist;
+					nodes[i + len - pos].state = 6 + ((i + len + 1) & 1);
+				}
+				skip = i + len;
+				if (skip > reach)
+					reach = skip;
+				continue;
+			}
+
+			for (m = 0, len = 2; m < count; m++)
+			{
+				for (; len <= matches[m].len; len++)
+				{
+					// Short matches need a short distance, see opt_find_matches.
+					if (len < 4 && matches[m].dist > 255)
+						continue;
+
+					cost = node->cost + opt_match_price(&re, pr, node->state, i, len, matches[m].dist);
+					if (cost < nodes[i + len - pos].cost)
+					{
+						nodes[i + len - pos].cost = cost;
+						nodes[i + len - pos].prev = i;
+						nodes[i + len - pos].len = len;
+						nodes[i + len - pos].dist = matches[m].dist;
+						nodes[i + len - pos].state = 6 + ((i + len + 1) & 1);
+					}
+				}
+				if (i + len - 1 > reach)
+					reach = i + len - 1;
+			}
+		}
+
+		// Walk back from the end of the chunk, then encode forward.
+		int steps = 0;
+		for (i = reach; i > pos; i = nodes[i - pos].prev)
+			path[steps++] = i;
+
+		while (steps > 0)
+		{
+			OPT_NODE *node = &nodes[path[--steps] - pos];
+			if (node->len == 1)
+				re_literal(&re, &state);
+			else
+				re_match(&re, &state, node->len, node->dist);
+		}
+
+		pos = reach;
+	}
+
+	// End marker: a match of 256 bytes.
+	re_bit(&re, &re.bm_match[state][0], 1);
+	for (i = 1; i < 8; i++)
+		re_bit(&re, &re.bm_match[state][i], 1);
+	re_number(&re, &re.bm_len[state][(6 << 2) + ((re.in_ptr << 6) & 0x03)], 7, 0xFF);
+	re_normalize(&re);
+	re_flush(&re);
+
+	free(head);
+	free(chain);
+	free(nodes);
+	free(path);
+	free(pr);
+
+	return re.out_ptr;
+}
+
 int lzrc_compress(void *out, int out_len, void *in, int in_len)
+{
+	return lzrc_compress_level(out, out_len, in, in_len, LZRC_LEVEL_DEFAULT);
+}
+
+int lzrc_compress_level(void *out, int out_len, void *in, int in_len, int level)
 {
 	LZRC_DECODE re;
 	int match_step, re_state, len_state, dist_state;
@@ -612,6 +1131,18 @@ int lzrc_compress(void *out, int out_len, void *in, int in_len)
 	int match_dist, dist_bits, limit;
 	int round = -1;
 
+	if (level == LZRC_LEVEL_OPTIMAL)
+	{
+		int size = lzrc_compress_optimal(out, out_len, in, in_len);
+		if (size >= 0)
+			return size;
+		level = LZRC_LEVEL_DEFAULT;  // No memory for the parser, the greedy encoder needs none.
+	}
+	if (level < 1 || level > LZRC_LEVEL_MAX)
+		level = LZRC_LEVEL_DEFAULT;
+	max_chain = lzrc_levels[level].max_chain;
+	nice_len = lzrc_levels[level].nice_len;
+
 	re_init(&re, out, out_len, in, in_len);
 	init_tree();
 
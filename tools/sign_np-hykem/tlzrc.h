@@ -2,6 +2,9 @@
    SPDX-FileCopyrightText: 2015 Hykem <hykem@hotmail.com>
    SPDX-License-Identifier: GPL-3.0-only */
 
+#ifndef TLZRC_H
+#define TLZRC_H
+
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
@@ -27,7 +30,27 @@ typedef struct {
 	u8 bm_dist[18][8];
 	u8 bm_match[8][8];
 	u8 bm_len[8][31];
+
+	int error;
 } LZRC_DECODE;
 
+// Compression level of lzrc_compress, compressed blocks are cached per level.
+#define LZRC_LEVEL_DEFAULT 9
+#define LZRC_LEVEL_OPTIMAL 10	// Price based parse, smallest output, several times slower.
+#define LZRC_LEVEL_MAX 10
+
+/*
+	Revision of the compressed output. It is part of the --cache keys: bump
+	it whenever an encoder change alters the bytes produced for any block,
+	so that the blocks of the earlier encoder are no longer served.
+	  2: re_flush propagates a pending carry.
+*/
+#define LZRC_ENCODER_REV 2
+
 int lzrc_compress(void *out, int out_len, void *in, int in_len);
-int lzrc_decompress(void *out, int out_len, void *in, int in_len);
\ No newline at end of file
+
+// Level 1 (fastest) to LZRC_LEVEL_MAX, fewer match candidates are tried at low levels.
+int lzrc_compress_level(void *out, int out_len, void *in, int in_len, int level);
+int lzrc_decompress(void *out, int out_len, void *in, int in_len);
+
+#endif
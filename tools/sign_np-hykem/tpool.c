@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "tpool.h"
+#include "utils.h"
+
+typedef struct tpool_job {
+	tpool_func func;
+	void *arg;
+	double queued;
+	struct tpool_job *next;
+} tpool_job;
+
+struct tpool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	// Signaled when a job is queued or on shutdown.
+	pthread_cond_t done;	// Signaled when the last pending job completes.
+	tpool_job *head;
+	tpool_job *tail;
+	int pending;			// Queued and running jobs.
+	int stop;
+	int nthreads;
+	pthread_t *threads;
+	double queue_wait;		// Time the jobs spent queued.
+	double join_wait;		// Time spent in tpool_wait.
+};
+
+int tpool_cpu_count(void)
+{
+	long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return (n < 1) ? 1 : (int) n;
+}
+
+static void *tpool_worker(void *arg)
+{
+	tpool *pool = (tpool *) arg;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;)
+	{
+		tpool_job *job;
+
+		while (pool->head == NULL && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->head == NULL)
+			break;
+
+		job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		pool->queue_wait += get_time() - job->queued;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->func(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+tpool *tpool_create(int threads)
+{
+	tpool *pool;
+	int i;
+
+	if (threads <= 0)
+		threads = tpool_cpu_count();
+
+	pool = (tpool *) calloc(1, sizeof(tpool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->threads = (pthread_t *) malloc(threads * sizeof(pthread_t));
+	if (pool->threads == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < threads; i++)
+	{
+		if (pthread_create(&pool->threads[i], NULL, tpool_worker, pool) != 0)
+			break;
+	}
+	pool->nthreads = i;
+
+	// Couldn't start any thread, the caller will run the jobs inline.
+	if (pool->nthreads == 0)
+	{
+		tpool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+int tpool_submit(tpool *pool, tpool_func func, void *arg)
+{
+	tpool_job *job;
+
+	if (pool == NULL)
+	{
+		func(arg);
+		return 0;
+	}
+
+	job = (tpool_job *) malloc(sizeof(tpool_job));
+	if (job == NULL)
+	{
+		// Still make progress, just without the pool.
+		func(arg);
+		return 0;
+	}
+
+	job->func = func;
+	job->arg = arg;
+	job->next = NULL;
+	job->queued = get_time();
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail != NULL)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pool->pending++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void tpool_wait(tpool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	double start = get_time();
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pool->join_wait += get_time() - start;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void tpool_wait_times(tpool *pool, double *queue_wait, double *join_wait)
+{
+	*queue_wait = 0;
+	*join_wait = 0;
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	*queue_wait = pool->queue_wait;
+	*join_wait = pool->join_wait;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int tpool_threads(tpool *pool)
+{
+	return (pool == NULL) ? 1 : pool->nthreads;
+}
+
+void tpool_destroy(tpool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+
+	tpool_wait(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
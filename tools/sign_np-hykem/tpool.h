@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef TPOOL_H
+#define TPOOL_H
+
+typedef void (*tpool_func)(void *arg);
+
+typedef struct tpool tpool;
+
+// Number of online CPUs (at least 1).
+int tpool_cpu_count(void);
+
+// Start a pool of worker threads (threads <= 0 means one per CPU).
+tpool *tpool_create(int threads);
+
+// Queue a job. With a NULL pool the job is run right away.
+int tpool_submit(tpool *pool, tpool_func func, void *arg);
+
+// Wait until every queued job has completed.
+void tpool_wait(tpool *pool);
+
+// Total time the jobs spent queued, and spent in tpool_wait (0 for a NULL pool).
+void tpool_wait_times(tpool *pool, double *queue_wait, double *join_wait);
+
+// Number of worker threads (1 for a NULL pool).
+int tpool_threads(tpool *pool);
+
+// Wait for the queued jobs and stop the workers.
+void tpool_destroy(tpool *pool);
+
+#endif
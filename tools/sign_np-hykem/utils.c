@@ -3,6 +3,15 @@
 
 #include "utils.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#ifndef __MINGW32__
+#include <sys/uio.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+
 // Auxiliary functions.
 u16 se16(u16 i)
 {
@@ -98,4 +107,155 @@ bool is_hex(const char* hex_str, unsigned int str_length)
 	}
 
     return true;
-}
\ No newline at end of file
+}
+
+#ifdef __MINGW32__
+// No pread/pwrite on Windows, only used from the main thread.
+static ssize_t pread(int fd, void *buf, size_t size, long long offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return read(fd, buf, size);
+}
+
+static ssize_t pwrite(int fd, const void *buf, size_t size, long long offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return write(fd, buf, size);
+}
+#endif
+
+int read_at(int fd, void *buf, size_t size, long long offset)
+{
+	u8 *p = (u8 *) buf;
+
+	while (size > 0)
+	{
+		ssize_t ret = pread(fd, p, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		p += ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+int write_at(int fd, const void *buf, size_t size, long long offset)
+{
+	const u8 *p = (const u8 *) buf;
+
+	while (size > 0)
+	{
+		ssize_t ret = pwrite(fd, p, size, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		p += ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+int writev_at(int fd, struct iovec *iov, int iovcnt, long long offset)
+{
+#ifdef __MINGW32__
+	// No pwritev on Windows, one positioned write per buffer.
+	int i;
+	for (i = 0; i < iovcnt; i++)
+	{
+		if (write_at(fd, iov[i].iov_base, iov[i].iov_len, offset) != 0)
+			return -1;
+		offset += iov[i].iov_len;
+	}
+#else
+	while (iovcnt > 0)
+	{
+		// Empty buffers are skipped, a write of nothing would not progress.
+		if (iov->iov_len == 0)
+		{
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		ssize_t ret = pwritev(fd, iov, iovcnt, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		offset += ret;
+
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len)
+		{
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		// The rest of a partly written buffer, the vector itself is left as it was.
+		if (ret > 0)
+		{
+			if (write_at(fd, (u8 *)iov->iov_base + ret, iov->iov_len - ret, offset) != 0)
+				return -1;
+			offset += iov->iov_len - ret;
+			iov++;
+			iovcnt--;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+double get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	if (stat(a, &sa) != 0 || stat(b, &sb) != 0)
+		return 0;
+
+	return sa.st_ino != 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+char *tmp_path(const char *path)
+{
+	char *tmp = (char *) malloc(strlen(path) + 5);
+
+	if (tmp != NULL)
+	{
+		strcpy(tmp, path);
+		strcat(tmp, ".tmp");
+	}
+	return tmp;
+}
+
+int replace_file(const char *tmp, const char *path)
+{
+#ifdef _WIN32
+	remove(path);
+#endif
+	if (rename(tmp, path) != 0)
+	{
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -17,4 +17,29 @@ u64 se64(u64 i);
 bool isEmpty(unsigned char* buf, int buf_size);
 u64 hex_to_u64(const char* hex_str);
 void hex_to_bytes(unsigned char *data, const char *hex_str, unsigned int str_length);
-bool is_hex(const char* hex_str, unsigned int str_length);
\ No newline at end of file
+bool is_hex(const char* hex_str, unsigned int str_length);
+
+// Positioned I/O, return 0 once all size bytes were transferred.
+int read_at(int fd, void *buf, size_t size, long long offset);
+int write_at(int fd, const void *buf, size_t size, long long offset);
+
+// Gathered write of iovcnt buffers at offset, returns 0 once all were written.
+#ifdef __MINGW32__
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+struct iovec;
+#endif
+int writev_at(int fd, struct iovec *iov, int iovcnt, long long offset);
+
+// Monotonic time in seconds, for throughput reports.
+double get_time(void);
+
+// 1 if both paths name the same existing file. Never on Windows, where there are no inode numbers.
+int same_file(const char *a, const char *b);
+
+// Output written to <path>.tmp first, an existing file is only replaced once the new one is complete.
+char *tmp_path(const char *path);
+int replace_file(const char *tmp, const char *path);
@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: GPL-3.0-only
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "verify.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define PSP_MAGIC 0x5053507E
+
+static u8 *verify_read(int fd, long long offset, int size)
+{
+	u8 *buf = (u8 *) malloc (size);
+
+	if (buf != NULL && read_at(fd, buf, size, offset) != 0)
+	{
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+// Test the ECDSA signature of DATA.PSP, made over PARAM.SFO and the content ID.
+static const char *verify_data_psp(int fd, u32 *offsets)
+{
+	int sfo_size = offsets[1] - offsets[0];
+	const char *ret = "DATA.PSP signature";
+
+	if (offsets[7] - offsets[6] < 0x594)
+		return "DATA.PSP size";
+
+	u8 *sha1_inbuf = (u8 *) malloc (sfo_size + 0x30);
+	u8 *data_psp = verify_read(fd, offsets[6], 0x594);
+	if (sha1_inbuf == NULL || data_psp == NULL || read_at(fd, sha1_inbuf, sfo_size, offsets[0]) != 0)
+	{
+		ret = "DATA.PSP read";
+		goto out;
+	}
+
+	// Rebuild the hashed buffer.
+	memcpy(sha1_inbuf + sfo_size, data_psp + 0x560, 0x30);
+
+	u8 hash[0x14];
+	if (kirk_sha1(sha1_inbuf, sfo_size + 0x30, hash) != 0)
+		goto out;
+
+	if (kirk_ecdsa_verify(npumdimg_public_key, hash, data_psp) == 0)
+		ret = NULL;
+
+out:
+	free(sha1_inbuf);
+	free(data_psp);
+	return ret;
+}
+
+static const char *verify_npumdimg(const char *name, int fd, u32 *offsets, u8 *version_key, tpool *pool)
+{
+	NPUMDIMG_HEADER header;
+	NPUMDIMG np;
+	u8 key[0x10];
+	const char *ret;
+	int bad;
+
+	ret = verify_data_psp(fd, offsets);
+	if (ret != NULL)
+		return ret;
+
+	// Without a version key, use the fixed key of the content ID if it has one.
+	memcpy(key, version_key, 0x10);
+	if (isEmpty(key, 0x10) && read_at(fd, &header, sizeof(NPUMDIMG_HEADER), offsets[7]) == 0)
+	{
+		char content_id[0x31];
+		memcpy(content_id, header.content_id, 0x30);
+		content_id[0x30] = 0;
+		if (sceNpDrmGetFixedKey(key, content_id, header.np_flags) != 0)
+			memset(key, 0, 0x10);
+	}
+
+	if (npumdimg_open(&np, name, key) != 0)
+		return "NPUMDIMG header";
+
+	if (npumdimg_check_signature(&np) != 0)
+		ret = "NPUMDIMG signature";
+	else if (npumdimg_check_table(&np) != 0)
+		ret = "NPUMDIMG table";
+	else if ((bad = npumdimg_check_blocks(&np, pool)) >= 0)
+	{
+		static char block_msg[32];
+		snprintf(block_msg, sizeof(block_msg), "NPUMDIMG block %d", bad);
+		ret = block_msg;
+	}
+
+	npumdimg_close(&np);
+	return ret;
+}
+
+static const char *verify_eboot_at(int fd, long long offset, long long max_size)
+{
+	u8 header[0x30];
+	const char *ret;
+
+	if (max_size < 0x150 || read_at(fd, header, 0x30, offset) != 0)
+		return "~PSP header";
+
+	int psp_size = *(int*)(header + 0x2C);
+	if (psp_size < 0x150 || psp_size > max_size)
+		return "~PSP size";
+
+	u8 *seboot = verify_read(fd, offset, psp_size);
+	if (seboot == NULL)
+		return "~PSP read";
+
+	ret = verify_eboot(seboot, psp_size);
+	free(seboot);
+
+	return ret;
+}
+
+const char *verify_file(const char *name, u8 *version_key, tpool *pool)
+{
+	struct stat st;
+	u8 header[0x28];
+	const char *ret;
+	int i;
+
+	int fd = open(name, O_RDONLY | O_BINARY);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return "open";
+	}
+
+	if (st.st_size < 0x28 || read_at(fd, header, 0x28, 0) != 0)
+	{
+		ret = "header";
+	}
+	else if (*(u32*)header == PSP_MAGIC)
+	{
+		ret = verify_eboot_at(fd, 0, st.st_size);
+	}
+	else if (*(u32*)header == PBP_MAGIC)
+	{
+		// PARAM.SFO, ICON0.PNG, ICON1.PMF, PIC0.PNG, PIC1.PNG, SND0.AT3, DATA.PSP and DATA.PSAR offsets.
+		u32 *offsets = (u32*)(header + 0x08);
+		u8 magic[8];
+
+		ret = NULL;
+		for (i = 0; i < 8; i++)
+		{
+			if ((i > 0 && offsets[i] < offsets[i - 1]) || offsets[i] > st.st_size)
+				ret = "PBP header";
+		}
+
+		if (ret == NULL)
+		{
+			if (read_at(fd, magic, 8, offsets[7]) == 0 && !memcmp(magic, "NPUMDIMG", 8))
+				ret = verify_npumdimg(name, fd, offsets, version_key, pool);
+			else
+				ret = verify_eboot_at(fd, offsets[6], offsets[7] - offsets[6]);
+		}
+	}
+	else
+	{
+		ret = "unknown format";
+	}
+
+	close(fd);
+	return ret;
+}
+
+int verify_files(char **names, int count, u8 *version_key, tpool *pool)
+{
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		const char *ret = verify_file(names[i], version_key, pool);
+
+		if (ret == NULL)
+		{
+			printf("PASS\t%s\n", names[i]);
+		}
+		else
+		{
+			printf("FAIL\t%s\t%s\n", names[i], ret);
+			failed++;
+		}
+		fflush(stdout);
+	}
+
+	return failed;
+}
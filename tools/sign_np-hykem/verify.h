@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "eboot.h"
+#include "npumdimg.h"
+
+/*
+	Check a signed file: a PSN PBP (DATA.PSP signature, NPUMDIMG header hash
+	and signature, table hash and block MACs), a PBP holding an EBOOT, or an
+	EBOOT.BIN (~PSP header). The version key may be empty, it is then derived
+	from the content ID or recovered from the header. Returns NULL if the file
+	is valid, else the name of the first failed check.
+*/
+const char *verify_file(const char *name, u8 *version_key, tpool *pool);
+
+/*
+	Check each file and print one line per file to stdout:
+	"PASS<TAB>name" or "FAIL<TAB>name<TAB>check". Returns the failed count.
+*/
+int verify_files(char **names, int count, u8 *version_key, tpool *pool);
+
+#endif